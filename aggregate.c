@@ -0,0 +1,151 @@
+
+/*
+ * Hash tables that aggregate Pairs by key for jobs that skip the shuffle.
+ * Each key keeps one Pair, and the value of a Pair added for that key is
+ * folded into it with combine() over the two values, so the job's
+ * combine() (or reduce()) must accept its own output, as with -c.
+ */
+
+#include "aggregate.h"
+#include "hash.h"
+#include "job.h"
+#include "utils.h"
+
+/*
+ * Returns the slot holding key, or the empty slot where it belongs.
+ *
+ * @param table         table to search
+ * @param key           key to look for
+ */
+static size_t find_slot(const Aggregate *table, const char *key) {
+    size_t mask = table->capacity - 1;
+    size_t slot = hash_content(CONTENT_HASH_SEED, key, strlen(key)) & mask;
+
+    while (table->used[slot] && strcmp(table->pairs[slot].key, key) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/*
+ * Allocates capacity empty slots.
+ *
+ * @param table         table to allocate
+ * @param capacity      number of slots, a power of two
+ * @exit                1 if error
+ */
+static void allocate_slots(Aggregate *table, size_t capacity) {
+    table->capacity = capacity;
+    table->count = 0;
+    safe_malloc((void **) &(table->pairs), sizeof(Pair) * capacity);
+    safe_malloc((void **) &(table->used), capacity);
+    memset(table->used, 0, capacity);
+}
+
+/*
+ * Allocates an empty table.
+ *
+ * @param table         table to initialize
+ * @exit                1 if error
+ */
+void aggregate_init(Aggregate *table) {
+    allocate_slots(table, AGGREGATE_SLOTS);
+}
+
+/*
+ * Doubles the slots of a table, moving its Pairs to their new slots.
+ *
+ * @param table         table to grow
+ * @exit                1 if error
+ */
+static void grow(Aggregate *table) {
+    Pair *pairs = table->pairs;
+    unsigned char *used = table->used;
+    size_t capacity = table->capacity;
+
+    allocate_slots(table, capacity * 2);
+    for (size_t i = 0; i < capacity; i++) {
+        if (used[i]) {
+            size_t slot = find_slot(table, pairs[i].key);
+            table->pairs[slot] = pairs[i];
+            table->used[slot] = 1;
+            table->count++;
+        }
+    }
+
+    free(pairs);
+    free(used);
+}
+
+/**
+ * Adds a Pair to the table, combining it with the Pair of its key if any.
+ *
+ * @param table         table to add to
+ * @param pair          Pair to add
+ * @exit                1 if error
+ */
+void aggregate_add(Aggregate *table, const Pair *pair) {
+    // keep the table at most three quarters full
+    if ((table->count + 1) * 4 > table->capacity * 3) {
+        grow(table);
+    }
+
+    size_t slot = find_slot(table, pair->key);
+    Pair *held = &table->pairs[slot];
+    if (!table->used[slot]) {
+        *held = *pair;
+        table->used[slot] = 1;
+        table->count++;
+        return;
+    }
+
+    LLValues added = {.next = NULL};
+    LLValues values = {.next = &added};
+    strncpy(values.value, held->value, MAX_VALUE);
+    strncpy(added.value, pair->value, MAX_VALUE);
+
+    Pair combined = job_combine(held->key, &values);
+    strncpy(held->value, combined.value, MAX_VALUE);
+}
+
+/*
+ * Copies the Pairs of the table to pairs, in no particular order.
+ *
+ * @param table         table to copy
+ * @param pairs         room for table->count Pairs
+ * @return              number of Pairs copied
+ */
+size_t aggregate_collect(const Aggregate *table, Pair *pairs) {
+    size_t npairs = 0;
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->used[i]) {
+            pairs[npairs++] = table->pairs[i];
+        }
+    }
+    return npairs;
+}
+
+/*
+ * Writes the Pairs of the table to stream, in no particular order.
+ *
+ * @param table         table to write
+ * @param stream        file to write to
+ * @exit                1 if error
+ */
+void aggregate_write(const Aggregate *table, FILE *stream) {
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->used[i]) {
+            safe_fwrite(&table->pairs[i], sizeof(Pair), 1, stream);
+        }
+    }
+}
+
+/*
+ * Frees memory held by the table.
+ *
+ * @param table         table to free
+ */
+void aggregate_free(Aggregate *table) {
+    free(table->pairs);
+    free(table->used);
+}
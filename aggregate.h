@@ -0,0 +1,49 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "mapreduce.h"
+
+#define AGGREGATE_SLOTS 1024    // initial slots of a table, a power of two
+
+/*
+ * Open addressing hash table holding one Pair per key. A Pair added for a
+ * key already in the table is folded into it with the job's combine(), so
+ * values are aggregated as they arrive and keys are never sorted.
+ */
+typedef struct aggregate {
+    Pair *pairs;
+    unsigned char *used;    // 1 if the slot holds a Pair
+    size_t capacity;        // in slots, a power of two
+    size_t count;           // slots used
+} Aggregate;
+
+/*
+ * Allocates an empty table.
+ */
+void aggregate_init(Aggregate *table);
+
+/*
+ * Adds a Pair to the table, combining it with the Pair of its key if any.
+ */
+void aggregate_add(Aggregate *table, const Pair *pair);
+
+/*
+ * Copies the Pairs of the table to pairs, which must hold table->count
+ * Pairs, in no particular order. Returns the number of Pairs copied.
+ */
+size_t aggregate_collect(const Aggregate *table, Pair *pairs);
+
+/*
+ * Writes the Pairs of the table to stream, in no particular order.
+ */
+void aggregate_write(const Aggregate *table, FILE *stream);
+
+/*
+ * Frees memory held by the table.
+ */
+void aggregate_free(Aggregate *table);
+
+#endif
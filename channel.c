@@ -0,0 +1,272 @@
+
+/*
+ * Shared memory rings master uses to feed reducers. A Pair crosses a ring
+ * with one copy in and one copy out, instead of being copied into and out
+ * of a pipe's kernel buffer, and a ring holds far more than a pipe.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <linux/limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "channel.h"
+#include "mapreduce.h"
+#include "trace.h"
+#include "utils.h"
+
+/*
+ * Sleeps while *word is value, or until woken.
+ */
+static void futex_wait(int *word, int value) {
+    if (syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0) == -1 &&
+        errno != EAGAIN && errno != EINTR) {
+        perror("futex");
+        exit(1);
+    }
+}
+
+/*
+ * Wakes a process sleeping on word.
+ */
+static void futex_wake(int *word) {
+    if (syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0) == -1) {
+        perror("futex");
+        exit(1);
+    }
+}
+
+/**
+ * Creates a ring of npairs Pairs in a shared memory file, mapped so that
+ * it is shared with children forked afterwards.
+ *
+ * @param npairs        capacity in Pairs
+ * @exit                1 if error
+ * @return              the channel, or NULL if there are no shared
+ *                      memory files on this system
+ */
+Channel *channel_create(int npairs) {
+    size_t capacity = sizeof(Pair) * npairs;
+    size_t size = sizeof(RingHeader) + capacity;
+
+    int fd = memfd_create("mapreduce-ring", MFD_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (ftruncate(fd, size) == -1) {
+        perror("ftruncate");
+        exit(1);
+    }
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    // the mapping keeps the memory alive
+    safe_close(fd);
+
+    Channel *channel;
+    safe_malloc((void **) &channel, sizeof(Channel));
+    channel->header = memory;
+    channel->data = (char *) memory + sizeof(RingHeader);
+    channel->capacity = capacity;
+    channel->tail = 0;
+    safe_pipe(channel->doorbell);
+
+    // a new file is zero filled, the header starts empty and open
+    return channel;
+}
+
+/*
+ * Keeps the producer end of a channel after fork.
+ *
+ * @param channel       channel to produce into
+ * @exit                1 if error
+ */
+void channel_become_producer(Channel *channel) {
+    safe_close(channel->doorbell[WRITE_END]);
+    channel->doorbell[WRITE_END] = -1;
+}
+
+/*
+ * Keeps the consumer end of a channel after fork.
+ *
+ * @param channel       channel to consume from
+ * @exit                1 if error
+ */
+void channel_become_consumer(Channel *channel) {
+    safe_close(channel->doorbell[READ_END]);
+    channel->doorbell[READ_END] = -1;
+}
+
+/*
+ * Returns 1 if nbyte more bytes fit in the ring, else 0.
+ *
+ * @param channel       channel to check
+ * @param nbyte         bytes to fit
+ */
+int channel_has_room(const Channel *channel, size_t nbyte) {
+    size_t head = __atomic_load_n(&channel->header->head, __ATOMIC_ACQUIRE);
+    return channel->capacity - (channel->tail - head) >= nbyte;
+}
+
+/*
+ * Copies bytes into the ring, wrapping around the end of the buffer.
+ * They reach the consumer once published. The ring must have room.
+ *
+ * @param channel       channel to push into
+ * @param buf           bytes to copy
+ * @param nbyte         number of bytes
+ */
+void channel_push(Channel *channel, const void *buf, size_t nbyte) {
+    size_t offset = channel->tail % channel->capacity;
+    size_t first = channel->capacity - offset;
+    if (first > nbyte) {
+        first = nbyte;
+    }
+
+    memcpy(channel->data + offset, buf, first);
+    memcpy(channel->data, (const char *) buf + first, nbyte - first);
+    channel->tail += nbyte;
+}
+
+/*
+ * Makes pushed bytes visible to the consumer, waking it if it sleeps.
+ * Master publishes once per pass of its routing loop, so a busy consumer
+ * sees a batch of Pairs per wake up.
+ *
+ * @param channel       channel to publish
+ * @exit                1 if error
+ */
+void channel_publish(Channel *channel) {
+    RingHeader *header = channel->header;
+    if (__atomic_load_n(&header->tail, __ATOMIC_RELAXED) == channel->tail) {
+        return;
+    }
+
+    __atomic_store_n(&header->tail, channel->tail, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->consumer_waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_add(&header->data_futex, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&header->data_futex);
+    }
+}
+
+/**
+ * Publishes pushed bytes and asks the consumer to ring the doorbell once
+ * it frees room. The producer then waits for the doorbell to be readable.
+ *
+ * @param channel       full channel
+ * @param nbyte         bytes the producer needs room for
+ * @exit                1 if error
+ * @return              1 if room was freed meanwhile, so there is nothing
+ *                      to wait for, else 0
+ */
+int channel_wait_for_room(Channel *channel, size_t nbyte) {
+    channel_publish(channel);
+
+    __atomic_store_n(&channel->header->producer_waiting, 1, __ATOMIC_SEQ_CST);
+    if (channel_has_room(channel, nbyte)) {
+        __atomic_store_n(&channel->header->producer_waiting, 0,
+                         __ATOMIC_SEQ_CST);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Reads the doorbell rung by the consumer.
+ *
+ * @param channel       channel whose doorbell is readable
+ * @exit                1 if error
+ * @return              0 if the consumer is gone, else 1
+ */
+int channel_answer_doorbell(Channel *channel) {
+    char rings[PIPE_BUF];
+    return safe_read(channel->doorbell[READ_END], rings, sizeof(rings)) > 0;
+}
+
+/*
+ * Publishes pushed bytes and tells the consumer nothing more is coming.
+ *
+ * @param channel       channel to close
+ * @exit                1 if error
+ */
+void channel_close(Channel *channel) {
+    RingHeader *header = channel->header;
+    __atomic_store_n(&header->tail, channel->tail, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&header->closed, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&header->data_futex, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&header->data_futex);
+}
+
+/**
+ * Reads up to nbyte bytes, sleeping on the futex until some are published.
+ * Rings the doorbell if the producer waits for the room this frees.
+ *
+ * @param channel       channel to consume from
+ * @param buf           where to copy the bytes
+ * @param nbyte         most bytes to read
+ * @exit                1 if error
+ * @return              bytes read, 0 once the channel is closed and drained
+ */
+size_t channel_read(Channel *channel, void *buf, size_t nbyte) {
+    RingHeader *header = channel->header;
+    size_t head = __atomic_load_n(&header->head, __ATOMIC_RELAXED);
+    size_t tail;
+
+    TRACE_BEGIN(started);
+    while ((tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE)) == head) {
+        if (__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+
+        // the producer wakes a consumer it sees waiting, so check again
+        // after announcing it, before going to sleep
+        __atomic_store_n(&header->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+        int sequence = __atomic_load_n(&header->data_futex, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&header->tail, __ATOMIC_SEQ_CST) == head &&
+            !__atomic_load_n(&header->closed, __ATOMIC_SEQ_CST)) {
+            futex_wait(&header->data_futex, sequence);
+        }
+        __atomic_store_n(&header->consumer_waiting, 0, __ATOMIC_RELAXED);
+    }
+    TRACE_END(TRACE_READ, started);
+
+    size_t available = tail - head;
+    if (nbyte > available) {
+        nbyte = available;
+    }
+    size_t offset = head % channel->capacity;
+    size_t first = channel->capacity - offset;
+    if (first > nbyte) {
+        first = nbyte;
+    }
+    memcpy(buf, channel->data + offset, first);
+    memcpy((char *) buf + first, channel->data, nbyte - first);
+
+    __atomic_store_n(&header->head, head + nbyte, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&header->producer_waiting, 0, __ATOMIC_SEQ_CST)) {
+        safe_write(channel->doorbell[WRITE_END], "", 1);
+    }
+
+    return nbyte;
+}
+
+/*
+ * Unmaps the ring and closes this process's doorbell end.
+ *
+ * @param channel       channel to free
+ * @exit                1 if error
+ */
+void channel_free(Channel *channel) {
+    munmap(channel->header, sizeof(RingHeader) + channel->capacity);
+    for (int end = 0; end < 2; end++) {
+        if (channel->doorbell[end] != -1) {
+            safe_close(channel->doorbell[end]);
+        }
+    }
+    free(channel);
+}
@@ -0,0 +1,96 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stddef.h>
+
+#define CHANNEL_PAIRS 4096      // Pairs a shared memory ring holds.
+#define CACHE_LINE 64
+
+/*
+ * Control block at the start of a shared ring. head and tail count bytes
+ * ever consumed and produced, and sit on their own cache lines as they
+ * are written by different processes.
+ */
+typedef struct ring_header {
+    size_t head;                // written by the consumer
+    char head_pad[CACHE_LINE - sizeof(size_t)];
+    size_t tail;                // written by the producer
+    char tail_pad[CACHE_LINE - sizeof(size_t)];
+    int data_futex;             // bumped when data is published to a sleeper
+    int consumer_waiting;       // 1 while the consumer sleeps on data_futex
+    int producer_waiting;       // 1 while the producer waits on the doorbell
+    int closed;                 // 1 once the producer sends nothing more
+} RingHeader;
+
+/*
+ * Single producer, single consumer ring of bytes in shared memory, handed
+ * to a child across fork. The consumer sleeps on a futex when the ring is
+ * empty. The producer multiplexes with select, so the consumer rings a
+ * doorbell pipe when the producer waits for room. The consumer holds the
+ * only write end of the doorbell, so it reads end of file once the
+ * consumer is gone.
+ */
+typedef struct channel {
+    RingHeader *header;
+    char *data;
+    size_t capacity;            // bytes
+    size_t tail;                // producer's tail, not yet published
+    int doorbell[2];
+} Channel;
+
+/*
+ * Creates a ring of npairs Pairs. Returns NULL if the system has no
+ * shared memory files, so the caller falls back to pipes.
+ */
+Channel *channel_create(int npairs);
+
+/*
+ * Keeps the end of a channel used by this process after fork.
+ */
+void channel_become_producer(Channel *channel);
+void channel_become_consumer(Channel *channel);
+
+/*
+ * Returns 1 if nbyte more bytes fit in the ring, else 0.
+ */
+int channel_has_room(const Channel *channel, size_t nbyte);
+
+/*
+ * Copies bytes into the ring without publishing them. The ring must
+ * have room.
+ */
+void channel_push(Channel *channel, const void *buf, size_t nbyte);
+
+/*
+ * Makes pushed bytes visible to the consumer, waking it if it sleeps.
+ */
+void channel_publish(Channel *channel);
+
+/*
+ * Publishes pushed bytes and asks the consumer to ring the doorbell once
+ * it frees room. Returns 1 if the ring already has room for nbyte bytes.
+ */
+int channel_wait_for_room(Channel *channel, size_t nbyte);
+
+/*
+ * Reads the doorbell. Returns 0 if the consumer is gone, else 1.
+ */
+int channel_answer_doorbell(Channel *channel);
+
+/*
+ * Publishes pushed bytes and tells the consumer nothing more is coming.
+ */
+void channel_close(Channel *channel);
+
+/*
+ * Reads up to nbyte bytes, sleeping until some are published.
+ * Returns 0 once the channel is closed and drained.
+ */
+size_t channel_read(Channel *channel, void *buf, size_t nbyte);
+
+/*
+ * Unmaps the ring and closes this process's doorbell end.
+ */
+void channel_free(Channel *channel);
+
+#endif
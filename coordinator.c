@@ -0,0 +1,185 @@
+
+/*
+ * The coordinator runs a job on worker daemons on other hosts instead of
+ * forking local workers. It hands map tasks to the workers one at a time,
+ * lets them shuffle Pairs among themselves, and collects the output of
+ * every partition into a local file.
+ *
+ * Input files are opened by the workers at the same path, so the input
+ * directory must be on storage every worker host can read.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+
+#include "coordinator.h"
+#include "job.h"
+#include "mapreduce.h"
+#include "master.h"
+#include "net.h"
+#include "utils.h"
+
+/*
+ * Splits the comma separated "host:port" list of worker daemons.
+ *
+ * @param workers       list of worker daemons
+ * @param peers         where to store the addresses, allocated here
+ * @return              number of workers
+ */
+static int parse_workers(const char *workers, PeerAddress **peers) {
+    int n = 1;
+    for (const char *c = workers; *c != '\0'; c++) {
+        if (*c == ',') {
+            n++;
+        }
+    }
+    safe_malloc((void **) peers, sizeof(PeerAddress) * n);
+
+    char address[MAX_HOST + 16];
+    const char *start = workers;
+    for (int i = 0; i < n; i++) {
+        const char *end = strchr(start, ',');
+        size_t length = end ? (size_t) (end - start) : strlen(start);
+        if (length >= sizeof(address)) {
+            length = sizeof(address) - 1;
+        }
+        memcpy(address, start, length);
+        address[length] = '\0';
+        parse_address(address, (*peers)[i].host, &(*peers)[i].port);
+        start = end + 1;
+    }
+
+    return n;
+}
+
+/*
+ * Sends the next task nobody has run to a worker. The path is made
+ * absolute, as workers do not run in the coordinator's directory.
+ *
+ * @param fd            connection to the worker
+ * @param next_task     index of the next task to hand out
+ * @exit                1 if error
+ */
+static void send_next_task(int fd, int *next_task) {
+    if (*next_task < task_table.ntasks) {
+        MapTask *task = &task_table.tasks[(*next_task)++];
+        char path[PATH_MAX];
+        if (realpath(task->path, path) == NULL) {
+            safe_fprintf(stderr, "coordinator: cannot resolve '%s'\n",
+                         task->path);
+            exit(1);
+        }
+        net_send_message(fd, MSG_MAP_TASK, path, strlen(path));
+    }
+}
+
+/**
+ * Runs a job on the worker daemons listed in logistics->workers.
+ * Worker i reduces partition i, and its output is written to
+ * [worker-i].out in the current directory.
+ *
+ * @param  logistics    settings of the job.
+ * @exit                1 if error, or a worker is lost
+ * @return              zero on success.
+ */
+int run_coordinator(const MapReduceLogistics *logistics) {
+    PeerAddress *workers;
+    int n = parse_workers(logistics->workers, &workers);
+
+    read_map_tasks(logistics->dirname);
+
+    int fds[n];
+    PeerAddress peers[n];
+    int type;
+    void *payload;
+    size_t length;
+
+    // start the job on every worker and learn where they shuffle
+    unsigned long long job_hash = job_identity();
+    for (int i = 0; i < n; i++) {
+        fds[i] = net_connect(workers[i].host, workers[i].port);
+        JobSpec spec = {.index = htonl(i), .nworkers = htonl(n),
+                        .combine = htonl(logistics->combine),
+                        .job_hash = {htonl(job_hash >> 32),
+                                     htonl(job_hash & 0xffffffff)}};
+        net_send_message(fds[i], MSG_JOB, &spec, sizeof(spec));
+    }
+    for (int i = 0; i < n; i++) {
+        if (!net_recv_message(fds[i], &type, &payload, &length) ||
+            type != MSG_JOB_ACK || length != sizeof(uint32_t)) {
+            safe_fprintf(stderr, "coordinator: worker %d refused the job\n", i);
+            exit(1);
+        }
+        strncpy(peers[i].host, workers[i].host, MAX_HOST);
+        peers[i].port = *(uint32_t *) payload;
+        free(payload);
+    }
+    for (int i = 0; i < n; i++) {
+        net_send_message(fds[i], MSG_PEERS, peers, sizeof(peers));
+    }
+
+    // one task in flight per worker
+    int next_task = 0;
+    int ndone = 0;
+    for (int i = 0; i < n; i++) {
+        send_next_task(fds[i], &next_task);
+    }
+    if (task_table.ntasks == 0) {
+        for (int i = 0; i < n; i++) {
+            net_send_message(fds[i], MSG_MAP_END, NULL, 0);
+        }
+    }
+
+    FILE *outputs[n];
+    for (int i = 0; i < n; i++) {
+        char filename[MAX_FILENAME] = "";
+        sprintf(filename, "[worker-%d].out", i);
+        outputs[i] = safe_fopen(filename, "wb");
+    }
+
+    int finished = 0;
+    fd_set read_set;
+    while (finished < n) {
+        FD_ZERO(&read_set);
+        for (int i = 0; i < n; i++) {
+            if (outputs[i] != NULL) {
+                FD_SET(fds[i], &read_set);
+            }
+        }
+        safe_select(FD_SETSIZE, &read_set, NULL, NULL);
+
+        for (int i = 0; i < n; i++) {
+            if (outputs[i] == NULL || !FD_ISSET(fds[i], &read_set)) {
+                continue;
+            }
+            if (!net_recv_message(fds[i], &type, &payload, &length)) {
+                safe_fprintf(stderr, "coordinator: lost worker %s:%d\n",
+                             workers[i].host, workers[i].port);
+                exit(1);
+            }
+
+            if (type == MSG_TASK_DONE) {
+                ndone++;
+                send_next_task(fds[i], &next_task);
+                if (ndone == task_table.ntasks) {
+                    for (int j = 0; j < n; j++) {
+                        net_send_message(fds[j], MSG_MAP_END, NULL, 0);
+                    }
+                }
+            } else if (type == MSG_RESULT) {
+                safe_fwrite(payload, sizeof(char), length, outputs[i]);
+            } else if (type == MSG_RESULT_END) {
+                safe_fclose(outputs[i]);
+                outputs[i] = NULL;
+                safe_close(fds[i]);
+                finished++;
+            }
+            free(payload);
+        }
+    }
+
+    free(workers);
+    free(task_table.tasks);
+    return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef COORDINATOR_H
+#define COORDINATOR_H
+
+#include "utils.h"
+
+/*
+ * Runs a job on the worker daemons listed in logistics->workers.
+ */
+int run_coordinator(const MapReduceLogistics *logistics);
+
+#endif
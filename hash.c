@@ -3,8 +3,11 @@
  * Made by Juan Camilo Osorio.
  */
 
+#include <stdio.h>
 #include <string.h>
 
+#include "hash.h"
+
 // Some notes:
 // This hash function was created by us after some brief research.
 // The constants are chosen because they generated minimal collisions
@@ -35,3 +38,44 @@ unsigned int hash(const char *key) {
     return hash;
 }
 
+/*
+ * Continues a 64-bit hash of file contents with the next nbytes bytes.
+ * This is FNV-1a, used to tell whether an input file changed between runs.
+ *
+ * @param hash      hash of the preceding bytes, or CONTENT_HASH_SEED
+ * @param bytes     next bytes of the contents
+ * @param nbytes    number of bytes
+ * @return          hash of the contents up to and including bytes.
+ */
+unsigned long long hash_content(unsigned long long hash,
+                                const char *bytes, size_t nbytes) {
+    for (size_t i = 0; i < nbytes; i++) {
+        hash ^= (unsigned char) bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/*
+ * Returns the hash of the contents of a file, as computed by mappers.
+ *
+ * @param path          file to hash
+ * @return              hash, or 0 if the file cannot be read
+ */
+unsigned long long hash_file(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    char buffer[BUFSIZ];
+    unsigned long long content_hash = CONTENT_HASH_SEED;
+    size_t nread;
+    while ((nread = fread(buffer, sizeof(char), BUFSIZ, file)) > 0) {
+        content_hash = hash_content(content_hash, buffer, nread);
+    }
+
+    fclose(file);
+    return content_hash;
+}
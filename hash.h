@@ -1,10 +1,26 @@
 #ifndef HASH_H
 #define HASH_H
 
+#include <stddef.h>
+
 /*
  * Returns a hash value for a given key. Uniformly distributes keys.
  */
 unsigned int hash(const char *key);
 
+#define CONTENT_HASH_SEED 14695981039346656037ULL  // FNV-1a offset basis
+
+/*
+ * Continues a 64-bit hash of file contents with the next nbytes bytes.
+ * Start from CONTENT_HASH_SEED.
+ */
+unsigned long long hash_content(unsigned long long hash,
+                                const char *bytes, size_t nbytes);
+
+/*
+ * Returns the hash of the contents of a file, 0 if it cannot be read.
+ */
+unsigned long long hash_file(const char *path);
+
 #endif
 
@@ -0,0 +1,195 @@
+/*
+ * Input readers let mappers map compressed files without decompressing
+ * them to disk first. The reader of a file is chosen by its extension:
+ * .gz files are inflated with zlib and .zst files decompressed with
+ * zstd (see zstdinput.c), and any other file is read as it is. Every
+ * reader hands map() the contents of the file in the same READSIZE
+ * chunks, so a compressed file maps to the same Pairs as its contents.
+ */
+
+#define _GNU_SOURCE
+
+#include "input.h"
+#include "readahead.h"
+#include "utils.h"
+#include "zstdinput.h"
+
+static void *gzip_open(const char *path);
+static size_t gzip_read(void *file, char *buf, size_t nbyte);
+static void gzip_close(void *file);
+static void *plain_open(const char *path);
+static size_t plain_read(void *file, char *buf, size_t nbyte);
+static void plain_close(void *file);
+
+// readers by extension, the last one reads any other file
+static const InputReader readers[] = {
+    {".gz", gzip_open, gzip_read, gzip_close},
+    {".zst", zstd_input_open, zstd_input_read, zstd_input_close},
+    {NULL, plain_open, plain_read, plain_close}
+};
+
+
+/*
+ * Opens a file read as it is, ahead of the mapper.
+ *
+ * @param path          path of the file
+ * @exit                1 if error
+ * @return              the ReadAhead of the file
+ */
+static void *plain_open(const char *path) {
+    return read_ahead_open(path);
+}
+
+/*
+ * Copies the next bytes of a file read as it is.
+ *
+ * @param file          ReadAhead of the file
+ * @param buf           where to copy the bytes
+ * @param nbyte         bytes to copy
+ * @exit                1 if error
+ * @return              bytes copied, fewer than nbyte only at the end
+ */
+static size_t plain_read(void *file, char *buf, size_t nbyte) {
+    return read_ahead_read(file, buf, nbyte);
+}
+
+/*
+ * Closes a file read as it is.
+ *
+ * @param file          ReadAhead of the file
+ * @exit                1 if error
+ */
+static void plain_close(void *file) {
+    read_ahead_close(file);
+}
+
+/*
+ * Opens a gzip file, reading its compressed bytes ahead.
+ *
+ * @param path          path of the file
+ * @exit                1 if error
+ * @return              the GzipInput of the file
+ */
+static void *gzip_open(const char *path) {
+    GzipInput *input;
+    safe_malloc((void **) &input, sizeof(GzipInput));
+    memset(&input->stream, 0, sizeof(z_stream));
+
+    // 32 lets zlib accept a gzip header, of up to 2^15 byte windows
+    if (inflateInit2(&input->stream, 15 + 32) != Z_OK) {
+        safe_fprintf(stderr, "Error inflating '%s'\n", path);
+        exit(1);
+    }
+    input->compressed = read_ahead_open(path);
+    input->in_member = 0;
+    input->path = path;
+    return input;
+}
+
+/*
+ * Inflates the next bytes of a gzip file.
+ *
+ * @param file          GzipInput of the file
+ * @param buf           where to copy the bytes
+ * @param nbyte         bytes to copy
+ * @exit                1 if the file is corrupt or truncated
+ * @return              bytes copied, fewer than nbyte only at the end
+ */
+static size_t gzip_read(void *file, char *buf, size_t nbyte) {
+    GzipInput *input = file;
+    z_stream *stream = &input->stream;
+    stream->next_out = (unsigned char *) buf;
+    stream->avail_out = nbyte;
+
+    while (stream->avail_out > 0) {
+        if (stream->avail_in == 0) {
+            size_t nread = read_ahead_read(input->compressed,
+                                           (char *) input->in,
+                                           GZIP_INPUT_BYTES);
+            if (nread == 0) {
+                if (input->in_member) {
+                    safe_fprintf(stderr, "'%s' is truncated\n", input->path);
+                    exit(1);
+                }
+                break;
+            }
+            stream->next_in = input->in;
+            stream->avail_in = nread;
+        }
+
+        input->in_member = 1;
+        int result = inflate(stream, Z_NO_FLUSH);
+        if (result == Z_STREAM_END) {
+            // another member may follow
+            inflateReset(stream);
+            input->in_member = 0;
+        } else if (result != Z_OK) {
+            safe_fprintf(stderr, "Error inflating '%s': %s\n", input->path,
+                         stream->msg != NULL ? stream->msg : "corrupt data");
+            exit(1);
+        }
+    }
+    return nbyte - stream->avail_out;
+}
+
+/*
+ * Closes a gzip file.
+ *
+ * @param file          GzipInput of the file
+ * @exit                1 if error
+ */
+static void gzip_close(void *file) {
+    GzipInput *input = file;
+    inflateEnd(&input->stream);
+    read_ahead_close(input->compressed);
+    free(input);
+}
+
+/**
+ * Opens an input file with the reader for its extension.
+ *
+ * @param path          path of the file
+ * @exit                1 if error
+ * @return              the file being read
+ */
+Input *input_open(const char *path) {
+    size_t length = strlen(path);
+    const InputReader *reader = readers;
+    while (reader->extension != NULL &&
+           (length < strlen(reader->extension) ||
+            strcmp(path + length - strlen(reader->extension),
+                   reader->extension) != 0)) {
+        reader++;
+    }
+
+    Input *input;
+    safe_malloc((void **) &input, sizeof(Input));
+    input->reader = reader;
+    input->file = reader->open(path);
+    return input;
+}
+
+/**
+ * Copies the next nbyte bytes of the contents of a file to buf.
+ *
+ * @param input         file being read
+ * @param buf           where to copy the bytes
+ * @param nbyte         bytes to copy
+ * @exit                1 if error
+ * @return              bytes copied, fewer than nbyte only at the end of
+ *                      the file
+ */
+size_t input_read(Input *input, char *buf, size_t nbyte) {
+    return input->reader->read(input->file, buf, nbyte);
+}
+
+/*
+ * Closes an input file.
+ *
+ * @param input         file to close
+ * @exit                1 if error
+ */
+void input_close(Input *input) {
+    input->reader->close(input->file);
+    free(input);
+}
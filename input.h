@@ -0,0 +1,61 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stddef.h>
+#include <zlib.h>
+
+#include "readahead.h"
+
+#define GZIP_INPUT_BYTES READ_AHEAD_BLOCK   // compressed bytes inflated
+                                            //   at once
+
+/*
+ * A reader of one kind of input file. Mappers pick the reader by the
+ * extension of the file.
+ */
+typedef struct input_reader {
+    const char *extension;      // ".gz", NULL for the reader of any other
+                                //   file
+    void *(*open)(const char *path);
+    size_t (*read)(void *file, char *buf, size_t nbyte);
+    void (*close)(void *file);
+} InputReader;
+
+/*
+ * An input file being read, its contents decompressed if it is
+ * compressed.
+ */
+typedef struct input {
+    const InputReader *reader;
+    void *file;                 // what the reader's open returned
+} Input;
+
+/*
+ * A gzip file, inflated as it is read ahead. Files of several gzip
+ * members, as concatenated .gz files are, are read to the last member.
+ */
+typedef struct gzip_input {
+    ReadAhead *compressed;
+    z_stream stream;
+    unsigned char in[GZIP_INPUT_BYTES];
+    int in_member;              // 1 if a member was started, not ended
+    const char *path;
+} GzipInput;
+
+/*
+ * Opens an input file with the reader for its extension.
+ */
+Input *input_open(const char *path);
+
+/*
+ * Copies the next nbyte bytes of the contents of the file to buf, as
+ * fread does. Returns fewer than nbyte only at the end of the file.
+ */
+size_t input_read(Input *input, char *buf, size_t nbyte);
+
+/*
+ * Closes an input file.
+ */
+void input_close(Input *input);
+
+#endif
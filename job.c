@@ -0,0 +1,256 @@
+
+/*
+ * Job holds the map reduce functions of the job being run. They are the
+ * map() and reduce() the binary was linked with, or the ones a plugin
+ * exports, so one binary can run many jobs.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <linux/limits.h>
+#include <stddef.h>
+
+#include "hash.h"
+#include "job.h"
+#include "linkedlist.h"
+#include "mapreduce.h"
+#include "trace.h"
+#include "utils.h"
+
+// global variable
+Job current_job = {
+    .abi_version = JOB_ABI_VERSION,
+    .map = map,
+    .reduce = reduce,
+    .combine = NULL,
+    .partition = NULL,
+    .map_pair = NULL,
+    .compare_values = NULL,
+    .rank = NULL
+};
+
+// global variable
+JobChain job_chain = {
+    .nstages = 0,
+    .stage = 0,
+    .identity = CONTENT_HASH_SEED
+};
+
+
+/**
+ * Loads the job exported by a shared object as the next stage of the
+ * chain. The first job loaded becomes current_job. Workers forked
+ * afterwards inherit the loaded jobs.
+ *
+ * @param path          path of the shared object
+ * @exit                1 if the object cannot be loaded, does not export
+ *                      a Job, was built for an unknown ABI version, or
+ *                      the chain is full
+ */
+void load_job(const char *path) {
+    // a path without a slash would be searched in the library path
+    char local_path[PATH_MAX];
+    if (strchr(path, '/') == NULL) {
+        snprintf(local_path, PATH_MAX, "./%s", path);
+        path = local_path;
+    }
+
+    void *plugin = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (plugin == NULL) {
+        safe_fprintf(stderr, "Error loading job: %s\n", dlerror());
+        exit(1);
+    }
+
+    const Job *exported = dlsym(plugin, JOB_SYMBOL);
+    if (exported == NULL) {
+        safe_fprintf(stderr, "Error loading job: %s does not export %s\n",
+                     path, JOB_SYMBOL);
+        exit(1);
+    }
+    if (exported->abi_version < 1 ||
+        exported->abi_version > JOB_ABI_VERSION) {
+        safe_fprintf(stderr, "Error loading job: %s was built for job ABI "
+                     "version %d, not %d\n", path, exported->abi_version,
+                     JOB_ABI_VERSION);
+        exit(1);
+    }
+    if (exported->map == NULL || exported->reduce == NULL) {
+        safe_fprintf(stderr, "Error loading job: %s has no map or reduce\n",
+                     path);
+        exit(1);
+    }
+    if (job_chain.nstages == MAX_STAGES) {
+        safe_fprintf(stderr, "Error loading job: at most %d jobs can be "
+                     "chained\n", MAX_STAGES);
+        exit(1);
+    }
+
+    // a Job of an older version ends before the fields added since
+    const size_t job_sizes[JOB_ABI_VERSION + 1] = {
+        0,
+        offsetof(Job, map_pair),
+        offsetof(Job, compare_values),
+        sizeof(Job)
+    };
+    Job *job = &job_chain.stages[job_chain.nstages++];
+    memset(job, 0, sizeof(Job));
+    memcpy(job, exported, job_sizes[exported->abi_version]);
+    unsigned long long plugin_hash = hash_file(path);
+    job_chain.identity = hash_content(job_chain.identity,
+                                      (const char *) &plugin_hash,
+                                      sizeof(plugin_hash));
+
+    // the plugin stays loaded for the life of the process
+    if (job_chain.nstages == 1) {
+        current_job = *job;
+    }
+}
+
+/*
+ * Empties the chain, making the job linked into the binary current again.
+ * The plugins stay loaded, so loading one again is cheap.
+ */
+void reset_job_chain() {
+    job_chain.nstages = 0;
+    job_chain.stage = 0;
+    job_chain.identity = CONTENT_HASH_SEED;
+    current_job = (Job) {
+        .abi_version = JOB_ABI_VERSION,
+        .map = map,
+        .reduce = reduce
+    };
+}
+
+/*
+ * Returns a hash identifying the jobs of the chain, so processes on
+ * other hosts can tell whether they load the same jobs. The path of a
+ * plugin may differ between hosts, so only its contents count.
+ *
+ * @return              hash of the plugins of the chain, or of the binary
+ *                      if no plugin was loaded
+ */
+unsigned long long job_identity() {
+    if (job_chain.nstages == 0) {
+        return hash_file("/proc/self/exe");
+    }
+    return job_chain.identity;
+}
+
+/*
+ * Makes the job of a stage of the chain current_job. Workers forked
+ * afterwards run that job.
+ *
+ * @param stage         index of the job in the chain
+ */
+void enter_stage(int stage) {
+    job_chain.stage = stage;
+    current_job = job_chain.stages[stage];
+}
+
+/*
+ * Returns the job of the stage after the current one, which maps the
+ * output of the current stage's reducers.
+ *
+ * @return              next job, or NULL if the current stage is the last
+ */
+const Job *next_stage_job() {
+    if (job_chain.stage + 1 >= job_chain.nstages) {
+        return NULL;
+    }
+    return &job_chain.stages[job_chain.stage + 1];
+}
+
+/*
+ * Maps a Pair reduced by the previous stage with the job's map_pair(),
+ * or passes it through unchanged if the job has none.
+ *
+ * @param job           job of the next stage
+ * @param pair          reduced Pair
+ * @param outfd         where the mapped Pairs are written
+ * @exit                1 if error
+ */
+void job_map_pair(const Job *job, const Pair *pair, int outfd) {
+    if (job->map_pair != NULL) {
+        job->map_pair(pair, outfd);
+    } else {
+        safe_write(outfd, pair, sizeof(Pair));
+    }
+}
+
+/*
+ * Returns the reduce partition of key, out of npartitions.
+ *
+ * @param key           key to partition
+ * @param npartitions   number of reduce partitions
+ * @return              partition in [0, npartitions)
+ */
+int job_partition(const char *key, int npartitions) {
+    if (current_job.partition != NULL) {
+        return current_job.partition(key, npartitions) % npartitions;
+    }
+
+    // hash function is uniform, see hash.c for more info
+    return hash(key) % npartitions;
+}
+
+/*
+ * Combines the values of key with the job's combine(), or with reduce()
+ * if the job has none, in which case reduce() must accept its own output
+ * as a value.
+ *
+ * @param key           key of the values
+ * @param values        values to combine
+ * @return              combined Pair
+ */
+Pair job_combine(const char *key, const LLValues *values) {
+    if (current_job.combine != NULL) {
+        return current_job.combine(key, values);
+    }
+    return current_job.reduce(key, values);
+}
+
+/*
+ * Reduces the values of key with the job's reduce(). A job with
+ * compare_values() gets the values sorted by it, a secondary sort on top
+ * of the grouping by key.
+ *
+ * @param key           key of the values
+ * @param values        values to reduce, reordered in place
+ * @return              reduced Pair
+ */
+Pair job_reduce(const char *key, LLValues **values) {
+    if (current_job.compare_values != NULL) {
+        *values = sort_values(*values, current_job.compare_values);
+    }
+
+    TRACE_BEGIN(started);
+    Pair result = current_job.reduce(key, *values);
+    TRACE_END(TRACE_REDUCE, started);
+    return result;
+}
+
+/*
+ * Ranks reduced Pairs with the job's rank(), or by numeric value, larger
+ * first, if it has none. Ties are broken by key so the ranking is total.
+ *
+ * @param a             reduced Pair
+ * @param b             reduced Pair
+ * @return              negative if a ranks above b, zero if they are the
+ *                      same Pair, else positive
+ */
+int job_rank(const Pair *a, const Pair *b) {
+    if (current_job.rank != NULL) {
+        int order = current_job.rank(a, b);
+        if (order != 0) {
+            return order;
+        }
+    } else {
+        double value_a = strtod(a->value, NULL);
+        double value_b = strtod(b->value, NULL);
+        if (value_a != value_b) {
+            return value_a > value_b ? -1 : 1;
+        }
+    }
+    return strcmp(a->key, b->key);
+}
@@ -0,0 +1,118 @@
+#ifndef JOB_H
+#define JOB_H
+
+#include "mapreduce.h"
+
+#define JOB_ABI_VERSION 3           // bumped whenever Job changes
+#define JOB_SYMBOL "mapreduce_job"  // name of the Job a plugin exports
+#define MAX_STAGES 8                // jobs in a chain
+
+/*
+ * The functions of a map reduce job. A job built as a shared object
+ * exports one of these named mapreduce_job, with abi_version set to the
+ * JOB_ABI_VERSION it was compiled against:
+ *
+ *     const Job mapreduce_job = {
+ *         .abi_version = JOB_ABI_VERSION,
+ *         .map = map,
+ *         .reduce = reduce
+ *     };
+ */
+typedef struct job {
+    int abi_version;
+    void (*map)(const char *chunk, int outfd);
+    Pair (*reduce)(const char *key, const LLValues *values);
+
+    // optional, NULL to combine with reduce()
+    Pair (*combine)(const char *key, const LLValues *values);
+
+    // optional, NULL to partition with hash()
+    unsigned int (*partition)(const char *key, int npartitions);
+
+    // since version 2, optional: maps a Pair reduced by the previous job
+    // of a chain, NULL to pass it through unchanged
+    void (*map_pair)(const Pair *pair, int outfd);
+
+    // since version 3, optional: orders the values of a key before
+    // reduce() sees them, NULL to leave them in arrival order
+    int (*compare_values)(const char *a, const char *b);
+
+    // since version 3, optional: ranks reduced Pairs for a top K query,
+    // negative if a ranks above b, NULL to rank by numeric value
+    int (*rank)(const Pair *a, const Pair *b);
+} Job;
+
+/*
+ * Jobs run as one chain, each mapping the reduced output of the job
+ * before it.
+ */
+typedef struct job_chain {
+    int nstages;            // 0 if just the linked job runs
+    int stage;              // index of current_job in stages
+    Job stages[MAX_STAGES];
+    unsigned long long identity;    // hash of the plugins, in chain order
+} JobChain;
+
+/*
+ * The job being run, the map() and reduce() linked into the binary
+ * unless a plugin was loaded.
+ */
+extern Job current_job;
+
+extern JobChain job_chain;
+
+/*
+ * Loads the job exported by the shared object at path as the next stage
+ * of the chain.
+ */
+void load_job(const char *path);
+
+/*
+ * Empties the chain, making the linked job current_job again.
+ */
+void reset_job_chain();
+
+/*
+ * Returns a hash identifying the jobs of the chain by the contents of
+ * their plugins, or of the binary if just the linked job runs.
+ */
+unsigned long long job_identity();
+
+/*
+ * Makes the job of a stage of the chain current_job.
+ */
+void enter_stage(int stage);
+
+/*
+ * Returns the job of the stage after the current one, NULL if none.
+ */
+const Job *next_stage_job();
+
+/*
+ * Maps a Pair reduced by the previous stage with the job's map_pair().
+ */
+void job_map_pair(const Job *job, const Pair *pair, int outfd);
+
+/*
+ * Returns the reduce partition of key, out of npartitions.
+ */
+int job_partition(const char *key, int npartitions);
+
+/*
+ * Combines the values of key with the job's combine(), or reduce().
+ */
+Pair job_combine(const char *key, const LLValues *values);
+
+/*
+ * Reduces the values of key with the job's reduce(), sorting them first
+ * if the job has compare_values().
+ */
+Pair job_reduce(const char *key, LLValues **values);
+
+/*
+ * Returns a negative number if reduced Pair a ranks above b, zero if they
+ * tie, else a positive number.
+ */
+int job_rank(const Pair *a, const Pair *b);
+
+#endif
@@ -0,0 +1,260 @@
+/*
+ * Broadcast hash joins. The small side of a join, a directory of files of
+ * "key<TAB>value" lines, is loaded by master into a hash table before any
+ * mapper is forked. Every mapper then probes the table with the Pairs its
+ * map() writes for the large side, and keeps only the Pairs whose key is
+ * in it, joined with its value. The large side is never shuffled to be
+ * joined.
+ *
+ * The table is built compact: slots of a 32-bit hash and an offset into
+ * one array of the keys and values, all in one anonymous mapping that
+ * is made read-only once built, so forked mappers share its pages.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "hash.h"
+#include "input.h"
+#include "join.h"
+#include "mapreduce.h"
+#include "utils.h"
+
+/*
+ * Records of the small side as they are read, before the table is built.
+ */
+typedef struct join_records {
+    char *strings;          // "key\0value\0" of each record
+    size_t length;
+    size_t capacity;
+    size_t *offsets;        // of each record in strings
+    size_t nrecords;
+    size_t records_capacity;
+} JoinRecords;
+
+/*
+ * Hashes a key for the table.
+ *
+ * @param key           key to hash
+ */
+static unsigned int hash_key(const char *key) {
+    unsigned long long h = hash_content(CONTENT_HASH_SEED, key, strlen(key));
+    return h ^ (h >> 32);
+}
+
+/*
+ * Adds a record to the records read so far. Keys too long to be the key
+ * of a Pair cannot match one and are skipped, and values too long to fit
+ * a Pair are cut.
+ *
+ * @param records       records read so far
+ * @param key           key of the record, of key_length bytes
+ * @param key_length    bytes of the key
+ * @param value         value of the record, of value_length bytes
+ * @param value_length  bytes of the value
+ * @exit                1 if error
+ */
+static void add_record(JoinRecords *records, const char *key,
+                       size_t key_length, const char *value,
+                       size_t value_length) {
+    if (key_length == 0 || key_length >= MAX_KEY) {
+        return;
+    }
+    if (value_length >= MAX_VALUE) {
+        value_length = MAX_VALUE - 1;
+    }
+
+    size_t needed = records->length + key_length + value_length + 2;
+    if (needed > records->capacity) {
+        while (needed > records->capacity) {
+            records->capacity = records->capacity * 2 + JOIN_READ_BYTES;
+        }
+        safe_realloc((void **) &(records->strings), records->capacity);
+    }
+    if (records->nrecords == records->records_capacity) {
+        records->records_capacity = records->records_capacity * 2 + 1024;
+        safe_realloc((void **) &(records->offsets),
+                     sizeof(size_t) * records->records_capacity);
+    }
+
+    records->offsets[records->nrecords++] = records->length;
+    char *record = records->strings + records->length;
+    memcpy(record, key, key_length);
+    record[key_length] = '\0';
+    memcpy(record + key_length + 1, value, value_length);
+    record[key_length + 1 + value_length] = '\0';
+    records->length = needed;
+}
+
+/*
+ * Reads the records of one file of the small side, with the reader for
+ * its extension, so it may be compressed.
+ *
+ * @param records       records read so far
+ * @param path          path of the file
+ * @exit                1 if error
+ */
+static void read_side_file(JoinRecords *records, const char *path) {
+    char *text = NULL;
+    size_t length = 0;
+    size_t nread;
+    Input *input = input_open(path);
+    do {
+        safe_realloc((void **) &text, length + JOIN_READ_BYTES + 1);
+        nread = input_read(input, text + length, JOIN_READ_BYTES);
+        length += nread;
+    } while (nread == JOIN_READ_BYTES);
+    input_close(input);
+    text[length] = '\0';
+
+    char *line = text;
+    while (line < text + length) {
+        char *end = memchr(line, '\n', text + length - line);
+        if (end == NULL) {
+            end = text + length;
+        }
+        size_t line_length = end - line;
+        if (line_length > 0 && line[line_length - 1] == '\r') {
+            line_length--;
+        }
+
+        // a line with no tab is a key with an empty value
+        char *tab = memchr(line, '\t', line_length);
+        if (tab == NULL) {
+            add_record(records, line, line_length, "", 0);
+        } else {
+            add_record(records, line, tab - line, tab + 1,
+                       line + line_length - tab - 1);
+        }
+        line = end + 1;
+    }
+    free(text);
+}
+
+/*
+ * Returns the slot holding key, or the empty slot where it belongs.
+ *
+ * @param table         table to search
+ * @param key           key to look for
+ * @param hash          hash_key() of the key
+ */
+static size_t find_slot(const JoinTable *table, const char *key,
+                        unsigned int hash) {
+    size_t mask = table->capacity - 1;
+    size_t slot = hash & mask;
+    while (table->slots[slot].offset != 0 &&
+           (table->slots[slot].hash != hash ||
+            strcmp(table->strings + table->slots[slot].offset - 1,
+                   key) != 0)) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/**
+ * Loads the records of every file of dirname into a read-only table.
+ * Each line of a file is a record, its key up to the first tab and its
+ * value after it. Files are read in name order, and a key found again
+ * keeps its first value.
+ *
+ * @param dirname       directory of the small side
+ * @exit                1 if error
+ * @return              the table
+ */
+JoinTable *join_table_load(const char *dirname) {
+    struct dirent **entries;
+    int nentries = scandir(dirname, &entries, NULL, alphasort);
+    if (nentries == -1) {
+        safe_fprintf(stderr, "Error opening %s\n", dirname);
+        exit(1);
+    }
+
+    JoinRecords records = {.strings = NULL, .length = 0, .capacity = 0,
+                           .offsets = NULL, .nrecords = 0,
+                           .records_capacity = 0};
+    for (int i = 0; i < nentries; i++) {
+        if (entries[i]->d_name[0] != '.') {
+            char path[PATH_MAX];
+            snprintf(path, PATH_MAX, "%s/%s", dirname, entries[i]->d_name);
+            read_side_file(&records, path);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    if (records.length >= UINT_MAX) {
+        safe_fprintf(stderr, "%s is too large to join with\n", dirname);
+        exit(1);
+    }
+
+    // at most half full
+    size_t capacity = JOIN_MIN_SLOTS;
+    while (capacity < records.nrecords * 2) {
+        capacity *= 2;
+    }
+
+    JoinTable *table;
+    safe_malloc((void **) &table, sizeof(JoinTable));
+    table->capacity = capacity;
+    table->nrecords = 0;
+    table->mapping_size = sizeof(JoinSlot) * capacity + records.length;
+    table->mapping = mmap(NULL, table->mapping_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table->mapping == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    // a fresh anonymous mapping is all zeros, every slot empty
+    table->slots = table->mapping;
+    char *strings = (char *) table->mapping + sizeof(JoinSlot) * capacity;
+    if (records.length > 0) {
+        memcpy(strings, records.strings, records.length);
+    }
+    table->strings = strings;
+
+    for (size_t r = 0; r < records.nrecords; r++) {
+        const char *key = strings + records.offsets[r];
+        unsigned int hash = hash_key(key);
+        size_t slot = find_slot(table, key, hash);
+        if (table->slots[slot].offset == 0) {
+            table->slots[slot].hash = hash;
+            table->slots[slot].offset = records.offsets[r] + 1;
+            table->nrecords++;
+        }
+    }
+    free(records.strings);
+    free(records.offsets);
+
+    if (mprotect(table->mapping, table->mapping_size, PROT_READ) == -1) {
+        perror("mprotect");
+        exit(1);
+    }
+    return table;
+}
+
+/**
+ * Returns the value of key in the table, or NULL if it has none.
+ *
+ * @param table         table to search
+ * @param key           key to look up
+ */
+const char *join_table_lookup(const JoinTable *table, const char *key) {
+    size_t slot = find_slot(table, key, hash_key(key));
+    if (table->slots[slot].offset == 0) {
+        return NULL;
+    }
+    const char *record = table->strings + table->slots[slot].offset - 1;
+    return record + strlen(record) + 1;
+}
+
+/*
+ * Unmaps a table.
+ *
+ * @param table         table to free
+ */
+void join_table_free(JoinTable *table) {
+    munmap(table->mapping, table->mapping_size);
+    free(table);
+}
@@ -0,0 +1,48 @@
+#ifndef JOIN_H
+#define JOIN_H
+
+#include <stddef.h>
+
+#define JOIN_READ_BYTES (64 * 1024)     // bytes of a side file read at once
+#define JOIN_MIN_SLOTS 16               // slots of a table at least
+
+/*
+ * A slot of a join table, empty if offset is 0.
+ */
+typedef struct join_slot {
+    unsigned int hash;          // low bits of the hash of the key
+    unsigned int offset;        // of the record in strings, plus 1
+} JoinSlot;
+
+/*
+ * The small side of a broadcast join: a read-only open addressing hash
+ * table from key to value. Master loads it into one anonymous mapping
+ * before it forks any mapper, and mappers share it copy-on-write without
+ * ever copying it, as nothing writes to it.
+ */
+typedef struct join_table {
+    JoinSlot *slots;
+    size_t capacity;            // in slots, a power of two
+    const char *strings;        // "key\0value\0" of each record
+    size_t nrecords;
+    void *mapping;              // slots, then strings
+    size_t mapping_size;
+} JoinTable;
+
+/*
+ * Loads the records of every file of dirname, one "key<TAB>value" per
+ * line, into a read-only table.
+ */
+JoinTable *join_table_load(const char *dirname);
+
+/*
+ * Returns the value of key in the table, or NULL if it has none.
+ */
+const char *join_table_lookup(const JoinTable *table, const char *key);
+
+/*
+ * Unmaps a table.
+ */
+void join_table_free(JoinTable *table);
+
+#endif
@@ -0,0 +1,272 @@
+
+/*
+ * Dictionary encoding of the keys master sends to a reducer. The first
+ * Pair of a key carries the key and gives it the next id of the stream,
+ * later Pairs of the key carry just the id and the value. Ids and lengths
+ * are varints, so a word count Pair of a known key takes a few bytes
+ * instead of sizeof(Pair), and the reducer groups values by id without
+ * comparing keys until it sorts the distinct keys once.
+ *
+ * A record is the varint id * 2 + 1 followed by the varint length and
+ * bytes of the key for a new key, or id * 2 for a known one, then the
+ * varint length and bytes of the value.
+ *
+ * Only the master to reducer leg is encoded. Mappers still send master
+ * whole Pairs: map() writes them straight to the pipe, and master needs
+ * the key of each Pair to partition it, fold it into an aggregate, and
+ * spill or replay it for restarted reducers.
+ */
+
+#define _GNU_SOURCE
+
+#include "hash.h"
+#include "keydict.h"
+#include "utils.h"
+
+/*
+ * Writes value as a varint, 7 bits a byte, low bits first.
+ *
+ * @param out           where to write, up to 5 bytes
+ * @param value         value to write
+ * @return              bytes written
+ */
+static size_t put_varint(char *out, unsigned int value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = (char) (value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (char) value;
+    return length;
+}
+
+/*
+ * Reads a varint.
+ *
+ * @param in            bytes to read from
+ * @param nbytes        bytes available
+ * @param value         where to store the value
+ * @return              bytes read, 0 if the varint is incomplete
+ */
+static size_t get_varint(const char *in, size_t nbytes, unsigned int *value) {
+    *value = 0;
+    for (size_t i = 0; i < nbytes && i < 5; i++) {
+        unsigned char byte = in[i];
+        *value |= (unsigned int) (byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns the slot holding a key, or the empty slot where it belongs.
+ *
+ * @param encoder       encoder to search
+ * @param key           key to look for
+ * @param length        length of key
+ */
+static size_t find_slot(const KeyEncoder *encoder, const char *key,
+                        size_t length) {
+    size_t mask = encoder->capacity - 1;
+    size_t slot = hash_content(CONTENT_HASH_SEED, key, length) & mask;
+
+    while (encoder->slots[slot] != 0) {
+        const char *known = encoder->keys[encoder->slots[slot] - 1];
+        if (strncmp(known, key, length) == 0 && known[length] == '\0') {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/*
+ * Allocates capacity empty slots and room for as many keys.
+ *
+ * @param encoder       encoder to allocate
+ * @param capacity      number of slots, a power of two
+ * @exit                1 if error
+ */
+static void allocate_slots(KeyEncoder *encoder, size_t capacity) {
+    encoder->capacity = capacity;
+    safe_malloc((void **) &(encoder->slots), sizeof(int) * capacity);
+    memset(encoder->slots, 0, sizeof(int) * capacity);
+}
+
+/*
+ * Allocates an encoder with no keys.
+ *
+ * @param encoder       encoder to initialize
+ * @exit                1 if error
+ */
+void key_encoder_init(KeyEncoder *encoder) {
+    allocate_slots(encoder, KEY_DICT_SLOTS);
+    safe_malloc((void **) &(encoder->keys), MAX_KEY * KEY_DICT_SLOTS);
+    encoder->nkeys = 0;
+}
+
+/*
+ * Forgets the keys of an encoder, for a stream to a new reader.
+ *
+ * @param encoder       encoder to reset
+ */
+void key_encoder_reset(KeyEncoder *encoder) {
+    memset(encoder->slots, 0, sizeof(int) * encoder->capacity);
+    encoder->nkeys = 0;
+}
+
+/*
+ * Doubles the slots of an encoder, rehashing its keys.
+ *
+ * @param encoder       encoder to grow
+ * @exit                1 if error
+ */
+static void grow(KeyEncoder *encoder) {
+    free(encoder->slots);
+    allocate_slots(encoder, encoder->capacity * 2);
+    safe_realloc((void **) &(encoder->keys), MAX_KEY * encoder->capacity);
+
+    for (int id = 0; id < encoder->nkeys; id++) {
+        const char *key = encoder->keys[id];
+        encoder->slots[find_slot(encoder, key, strlen(key))] = id + 1;
+    }
+}
+
+/**
+ * Encodes a Pair, giving its key the next id if the key is new. Keys and
+ * values longer than a Pair holds are cut, as reducers would.
+ *
+ * @param encoder       dictionary of the stream
+ * @param pair          Pair to encode
+ * @param record        where to write, ENCODED_PAIR_MAX bytes
+ * @exit                1 if error
+ * @return              length of the record
+ */
+size_t key_encoder_encode(KeyEncoder *encoder, const Pair *pair,
+                          char *record) {
+    size_t key_length = strnlen(pair->key, MAX_KEY - 1);
+    size_t value_length = strnlen(pair->value, MAX_VALUE - 1);
+    size_t slot = find_slot(encoder, pair->key, key_length);
+    size_t length;
+
+    if (encoder->slots[slot] != 0) {
+        length = put_varint(record, (encoder->slots[slot] - 1) * 2);
+    } else {
+        int id = encoder->nkeys++;
+        memcpy(encoder->keys[id], pair->key, key_length);
+        encoder->keys[id][key_length] = '\0';
+        encoder->slots[slot] = id + 1;
+
+        length = put_varint(record, id * 2 + 1);
+        length += put_varint(record + length, key_length);
+        memcpy(record + length, pair->key, key_length);
+        length += key_length;
+
+        // keep the table at most 3/4 full
+        if ((size_t) encoder->nkeys * 4 >= encoder->capacity * 3) {
+            grow(encoder);
+        }
+    }
+
+    length += put_varint(record + length, value_length);
+    memcpy(record + length, pair->value, value_length);
+    return length + value_length;
+}
+
+/*
+ * Frees memory held by an encoder.
+ *
+ * @param encoder       encoder to free
+ */
+void key_encoder_free(KeyEncoder *encoder) {
+    free(encoder->slots);
+    free(encoder->keys);
+    encoder->slots = NULL;
+    encoder->keys = NULL;
+}
+
+/*
+ * Allocates a decoder with no keys.
+ *
+ * @param decoder       decoder to initialize
+ * @exit                1 if error
+ */
+void key_decoder_init(KeyDecoder *decoder) {
+    decoder->capacity = KEY_DICT_SLOTS;
+    decoder->nkeys = 0;
+    safe_malloc((void **) &(decoder->keys), MAX_KEY * decoder->capacity);
+}
+
+/**
+ * Decodes the record at the start of bytes. A new key is added to the
+ * decoder only once its whole record has arrived.
+ *
+ * @param decoder       dictionary of the stream
+ * @param bytes         bytes received
+ * @param nbytes        number of bytes received
+ * @param id            where to store the id of the key
+ * @param value         where to store the value, MAX_VALUE bytes
+ * @exit                1 if the record is corrupt
+ * @return              length of the record, 0 if bytes hold part of it
+ */
+size_t key_decoder_decode(KeyDecoder *decoder, const char *bytes,
+                          size_t nbytes, int *id, char *value) {
+    unsigned int tag;
+    size_t length = get_varint(bytes, nbytes, &tag);
+    if (length == 0) {
+        return 0;
+    }
+
+    int is_new = tag & 1;
+    *id = tag >> 1;
+    const char *key = NULL;
+    unsigned int key_length = 0;
+    if (is_new) {
+        size_t read = get_varint(bytes + length, nbytes - length, &key_length);
+        if (read == 0 || nbytes - length - read < key_length) {
+            return 0;
+        }
+        key = bytes + length + read;
+        length += read + key_length;
+    }
+
+    unsigned int value_length;
+    size_t read = get_varint(bytes + length, nbytes - length, &value_length);
+    if (read == 0 || nbytes - length - read < value_length) {
+        return 0;
+    }
+
+    if ((is_new && (*id != decoder->nkeys || key_length >= MAX_KEY)) ||
+        (!is_new && *id >= decoder->nkeys) || value_length >= MAX_VALUE) {
+        safe_fprintf(stderr, "Corrupt encoded Pair\n");
+        exit(1);
+    }
+
+    memcpy(value, bytes + length + read, value_length);
+    value[value_length] = '\0';
+    length += read + value_length;
+
+    if (is_new) {
+        if (decoder->nkeys == decoder->capacity) {
+            decoder->capacity *= 2;
+            safe_realloc((void **) &(decoder->keys),
+                         MAX_KEY * decoder->capacity);
+        }
+        memcpy(decoder->keys[decoder->nkeys], key, key_length);
+        decoder->keys[decoder->nkeys][key_length] = '\0';
+        decoder->nkeys++;
+    }
+    return length;
+}
+
+/*
+ * Frees memory held by a decoder.
+ *
+ * @param decoder       decoder to free
+ */
+void key_decoder_free(KeyDecoder *decoder) {
+    free(decoder->keys);
+    decoder->keys = NULL;
+}
@@ -0,0 +1,75 @@
+#ifndef KEYDICT_H
+#define KEYDICT_H
+
+#include <stddef.h>
+
+#include "mapreduce.h"
+
+#define KEY_DICT_SLOTS 1024     // initial slots of an encoder, a power of two
+
+// Bytes of the longest encoded Pair: id, key length, key, value length
+// and value, with lengths and ids as varints of up to 5 bytes
+#define ENCODED_PAIR_MAX (5 + 5 + MAX_KEY + 5 + MAX_VALUE)
+
+/*
+ * Dictionary of the keys sent on one stream of Pairs. Each new key gets
+ * the next id and is sent once, later Pairs of the key send the id.
+ */
+typedef struct key_encoder {
+    char (*keys)[MAX_KEY];  // key of each id
+    int *slots;             // id + 1 of the key hashed to each slot, 0 if
+                            //   the slot is empty
+    size_t capacity;        // slots, a power of two, and room in keys
+    int nkeys;
+} KeyEncoder;
+
+/*
+ * Keys received on one stream of Pairs, indexed by id.
+ */
+typedef struct key_decoder {
+    char (*keys)[MAX_KEY];
+    int nkeys;
+    int capacity;
+} KeyDecoder;
+
+/*
+ * Allocates an encoder with no keys.
+ */
+void key_encoder_init(KeyEncoder *encoder);
+
+/*
+ * Forgets the keys of an encoder, for a stream to a new reader.
+ */
+void key_encoder_reset(KeyEncoder *encoder);
+
+/*
+ * Encodes a Pair into record, which holds ENCODED_PAIR_MAX bytes.
+ * Returns the length of the record.
+ */
+size_t key_encoder_encode(KeyEncoder *encoder, const Pair *pair,
+                          char *record);
+
+/*
+ * Frees memory held by an encoder.
+ */
+void key_encoder_free(KeyEncoder *encoder);
+
+/*
+ * Allocates a decoder with no keys.
+ */
+void key_decoder_init(KeyDecoder *decoder);
+
+/*
+ * Decodes the record at the start of bytes into the id of its key, whose
+ * key is then decoder->keys[id], and its value. Returns the length of the
+ * record, or 0 if bytes hold only part of it.
+ */
+size_t key_decoder_decode(KeyDecoder *decoder, const char *bytes,
+                          size_t nbytes, int *id, char *value);
+
+/*
+ * Frees memory held by a decoder.
+ */
+void key_decoder_free(KeyDecoder *decoder);
+
+#endif
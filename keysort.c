@@ -0,0 +1,225 @@
+/*
+ * Sorting of the distinct keys of a reducer. Keys are sorted by
+ * multikey quicksort, which partitions on one character at a time and so
+ * never compares the characters two keys share more than once. The first
+ * eight bytes of every key are cached next to its group as an integer,
+ * so the characters read most are read from one array instead of from
+ * every key's node.
+ *
+ * With several threads, a radix pass first splits the keys into buckets
+ * by their first two bytes, in order, and the threads take the buckets
+ * one at a time and sort each from its third byte.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+
+#include "keysort.h"
+#include "utils.h"
+
+/*
+ * Buckets of a radix pass shared by the threads sorting them.
+ */
+typedef struct bucket_sort {
+    KeyEntry *entries;
+    size_t *starts;         // entries of bucket b start at starts[b]
+    int next;               // next bucket a thread takes
+} BucketSort;
+
+/*
+ * Returns the first eight bytes of key as a big-endian integer, with the
+ * bytes after the end of the key 0.
+ *
+ * @param key           key to read
+ */
+static unsigned long long key_prefix(const char *key) {
+    unsigned long long prefix = 0;
+    int ended = 0;
+    for (int i = 0; i < 8; i++) {
+        unsigned char c = ended ? 0 : (unsigned char) key[i];
+        ended = (c == 0);
+        prefix = (prefix << 8) | c;
+    }
+    return prefix;
+}
+
+/*
+ * Returns the character of an entry's key at depth, 0 past its end. Only
+ * read at depths the key is known to reach.
+ *
+ * @param entry         entry to read
+ * @param depth         index of the character
+ */
+static int char_at(const KeyEntry *entry, int depth) {
+    if (depth < 8) {
+        return (entry->prefix >> (56 - 8 * depth)) & 0xff;
+    }
+    return (unsigned char) entry->group->key[depth];
+}
+
+/*
+ * Compares the keys of two entries as strcmp does.
+ */
+static int compare_entries(const KeyEntry *a, const KeyEntry *b) {
+    if (a->prefix != b->prefix) {
+        return a->prefix < b->prefix ? -1 : 1;
+    }
+    if ((a->prefix & 0xff) == 0) {
+        // both keys end within the prefix
+        return 0;
+    }
+    return strcmp(a->group->key + 8, b->group->key + 8);
+}
+
+/*
+ * Swaps two entries.
+ */
+static void swap_entries(KeyEntry *a, KeyEntry *b) {
+    KeyEntry swapped = *a;
+    *a = *b;
+    *b = swapped;
+}
+
+/*
+ * Sorts a few entries by insertion.
+ *
+ * @param entries       entries to sort
+ * @param n             number of entries
+ */
+static void insertion_sort(KeyEntry *entries, size_t n) {
+    for (size_t i = 1; i < n; i++) {
+        KeyEntry entry = entries[i];
+        size_t j = i;
+        while (j > 0 && compare_entries(&entry, &entries[j - 1]) < 0) {
+            entries[j] = entries[j - 1];
+            j--;
+        }
+        entries[j] = entry;
+    }
+}
+
+/*
+ * Sorts entries whose keys share their first depth characters, by
+ * multikey quicksort: entries are split three ways on the character at
+ * depth, and the middle part, which shares one more character, is sorted
+ * from the next one.
+ *
+ * @param entries       entries to sort
+ * @param n             number of entries
+ * @param depth         characters all the keys share
+ */
+static void multikey_sort(KeyEntry *entries, size_t n, int depth) {
+    while (n > KEY_SORT_INSERTION) {
+        // median of the first, middle and last characters
+        int a = char_at(&entries[0], depth);
+        int b = char_at(&entries[n / 2], depth);
+        int c = char_at(&entries[n - 1], depth);
+        int pivot = a < b ? (b < c ? b : (a < c ? c : a))
+                          : (a < c ? a : (b < c ? c : b));
+
+        size_t lt = 0;
+        size_t i = 0;
+        size_t gt = n;
+        while (i < gt) {
+            int ch = char_at(&entries[i], depth);
+            if (ch < pivot) {
+                swap_entries(&entries[lt++], &entries[i++]);
+            } else if (ch > pivot) {
+                swap_entries(&entries[i], &entries[--gt]);
+            } else {
+                i++;
+            }
+        }
+
+        multikey_sort(entries, lt, depth);
+        if (pivot != 0) {
+            multikey_sort(entries + lt, gt - lt, depth + 1);
+        }
+        entries += gt;
+        n -= gt;
+    }
+    insertion_sort(entries, n);
+}
+
+/*
+ * Takes buckets of a radix pass one at a time and sorts them, until none
+ * are left.
+ *
+ * @param arg           the BucketSort
+ * @return              NULL
+ */
+static void *sort_buckets(void *arg) {
+    BucketSort *sort = arg;
+    int bucket;
+    while ((bucket = __atomic_fetch_add(&sort->next, 1, __ATOMIC_RELAXED)) <
+           KEY_SORT_BUCKETS) {
+        size_t start = sort->starts[bucket];
+        multikey_sort(sort->entries + start,
+                      sort->starts[bucket + 1] - start, 2);
+    }
+    return NULL;
+}
+
+/**
+ * Sorts groups by key, with nthreads threads. Keys must be distinct.
+ *
+ * @param groups        groups to sort
+ * @param ngroups       number of groups
+ * @param nthreads      threads to sort with, the caller included
+ * @exit                1 if error
+ */
+void sort_groups(LLKeyValues **groups, size_t ngroups, int nthreads) {
+    KeyEntry *entries;
+    safe_malloc((void **) &entries, sizeof(KeyEntry) * (ngroups + 1));
+    for (size_t i = 0; i < ngroups; i++) {
+        entries[i].prefix = key_prefix(groups[i]->key);
+        entries[i].group = groups[i];
+    }
+
+    if (nthreads <= 1 || ngroups < KEY_SORT_PARALLEL) {
+        multikey_sort(entries, ngroups, 0);
+    } else {
+        // radix pass on the first two bytes
+        size_t *starts;
+        safe_malloc((void **) &starts,
+                    sizeof(size_t) * (KEY_SORT_BUCKETS + 1));
+        memset(starts, 0, sizeof(size_t) * (KEY_SORT_BUCKETS + 1));
+        for (size_t i = 0; i < ngroups; i++) {
+            starts[(entries[i].prefix >> 48) + 1]++;
+        }
+        for (int b = 0; b < KEY_SORT_BUCKETS; b++) {
+            starts[b + 1] += starts[b];
+        }
+        KeyEntry *sorted;
+        safe_malloc((void **) &sorted, sizeof(KeyEntry) * (ngroups + 1));
+        size_t *cursors;
+        safe_malloc((void **) &cursors, sizeof(size_t) * KEY_SORT_BUCKETS);
+        memcpy(cursors, starts, sizeof(size_t) * KEY_SORT_BUCKETS);
+        for (size_t i = 0; i < ngroups; i++) {
+            sorted[cursors[entries[i].prefix >> 48]++] = entries[i];
+        }
+        free(cursors);
+        free(entries);
+        entries = sorted;
+
+        BucketSort sort = {.entries = entries, .starts = starts, .next = 0};
+        pthread_t threads[nthreads - 1];
+        for (int t = 0; t < nthreads - 1; t++) {
+            if (pthread_create(&threads[t], NULL, sort_buckets, &sort) != 0) {
+                safe_fprintf(stderr, "Error starting a thread\n");
+                exit(1);
+            }
+        }
+        sort_buckets(&sort);
+        for (int t = 0; t < nthreads - 1; t++) {
+            pthread_join(threads[t], NULL);
+        }
+        free(starts);
+    }
+
+    for (size_t i = 0; i < ngroups; i++) {
+        groups[i] = entries[i].group;
+    }
+    free(entries);
+}
@@ -0,0 +1,27 @@
+#ifndef KEYSORT_H
+#define KEYSORT_H
+
+#include <stddef.h>
+
+#include "mapreduce.h"
+
+#define KEY_SORT_BUCKETS 65536      // buckets of the first radix pass, by
+                                    //   the first two bytes of a key
+#define KEY_SORT_INSERTION 16       // groups sorted by insertion sort
+#define KEY_SORT_PARALLEL 16384     // fewer groups are sorted by one thread
+
+/*
+ * A group of values to sort by key, with the first eight bytes of the
+ * key cached big-endian, so most comparisons never read the key itself.
+ */
+typedef struct key_entry {
+    unsigned long long prefix;      // bytes after the end of the key are 0
+    LLKeyValues *group;
+} KeyEntry;
+
+/*
+ * Sorts groups by key, with nthreads threads. Keys must be distinct.
+ */
+void sort_groups(LLKeyValues **groups, size_t ngroups, int nthreads);
+
+#endif
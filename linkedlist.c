@@ -88,3 +88,116 @@ void free_key_values_list(LLKeyValues *head) {
         curr = next;
     }
 }
+
+/*
+ * Compare two Pairs by key, for use with qsort.
+ */
+static int compare_pairs(const void *a, const void *b) {
+    return strcmp(((const Pair *) a)->key, ((const Pair *) b)->key);
+}
+
+/*
+ * Sort a batch of Pairs and group them into a new sorted list of keys
+ * and values. The batch is reordered in place.
+ */
+LLKeyValues *build_sorted_run(Pair *pairs, int npairs) {
+    LLKeyValues *head = NULL;
+    LLKeyValues *tail = NULL;
+
+    qsort(pairs, npairs, sizeof(Pair), compare_pairs);
+
+    for (int i = 0; i < npairs; i++) {
+        if (tail != NULL && strcmp(tail->key, pairs[i].key) == 0) {
+            insert_value(tail, pairs[i].value);
+        } else {
+            LLKeyValues *new_node = create_node(pairs[i]);
+            if (tail == NULL) {
+                head = new_node;
+            } else {
+                tail->next = new_node;
+            }
+            tail = new_node;
+        }
+    }
+
+    return head;
+}
+
+/*
+ * Merge two sorted lists of keys and values into one sorted list.
+ * Values of keys present in both lists are joined under a single node,
+ * and the now unused node of list b is freed.
+ */
+LLKeyValues *merge_key_values_lists(LLKeyValues *a, LLKeyValues *b) {
+    LLKeyValues merged = {.next = NULL};
+    LLKeyValues *tail = &merged;
+
+    while (a != NULL && b != NULL) {
+        int cmp = strcmp(a->key, b->key);
+        if (cmp < 0) {
+            tail->next = a;
+            a = a->next;
+        } else if (cmp > 0) {
+            tail->next = b;
+            b = b->next;
+        } else {
+            // append b's values to the end of a's values
+            LLValues *last = a->head_value;
+            while (last->next != NULL) {
+                last = last->next;
+            }
+            last->next = b->head_value;
+
+            LLKeyValues *next_b = b->next;
+            free(b);
+            b = next_b;
+
+            tail->next = a;
+            a = a->next;
+        }
+        tail = tail->next;
+    }
+    tail->next = (a != NULL) ? a : b;
+
+    return merged.next;
+}
+
+/*
+ * Sort a list of values with compare, keeping values that compare equal
+ * in their original order. This is a merge sort, so no value is copied.
+ */
+LLValues *sort_values(LLValues *head,
+                      int (*compare)(const char *a, const char *b)) {
+    if (head == NULL || head->next == NULL) {
+        return head;
+    }
+
+    // split the list in two halves
+    LLValues *slow = head;
+    LLValues *fast = head->next;
+    while (fast != NULL && fast->next != NULL) {
+        slow = slow->next;
+        fast = fast->next->next;
+    }
+    LLValues *second = slow->next;
+    slow->next = NULL;
+
+    LLValues *a = sort_values(head, compare);
+    LLValues *b = sort_values(second, compare);
+
+    LLValues merged = {.next = NULL};
+    LLValues *tail = &merged;
+    while (a != NULL && b != NULL) {
+        if (compare(b->value, a->value) < 0) {
+            tail->next = b;
+            b = b->next;
+        } else {
+            tail->next = a;
+            a = a->next;
+        }
+        tail = tail->next;
+    }
+    tail->next = (a != NULL) ? a : b;
+
+    return merged.next;
+}
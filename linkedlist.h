@@ -14,4 +14,23 @@ void insert_into_keys(LLKeyValues **head_ptr, Pair pair);
  */
 void free_key_values_list(LLKeyValues *head);
 
+/*
+ * Sorts a batch of Pairs and groups them into a new sorted list of keys
+ * and values.
+ */
+LLKeyValues *build_sorted_run(Pair *pairs, int npairs);
+
+/*
+ * Merges two sorted lists of keys and values into one sorted list,
+ * grouping values of keys that appear in both.
+ */
+LLKeyValues *merge_key_values_lists(LLKeyValues *a, LLKeyValues *b);
+
+/*
+ * Sorts a list of values with compare, keeping the original order of
+ * values that compare equal. Returns the new head of the list.
+ */
+LLValues *sort_values(LLValues *head,
+                      int (*compare)(const char *a, const char *b));
+
 #endif
\ No newline at end of file
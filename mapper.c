@@ -1,55 +1,644 @@
 /*
  * The Map worker (mapper) receives filenames via stdin,
  * and outputs map() of <key, value> Pairs through stdout.
+ * A job without reducers has each file mapped straight to its own output
+ * file instead, and only the done markers go to master.
+ *
+ * With a work directory, the output of each file is also persisted there,
+ * partitioned by reducer and sorted by key, so an interrupted job can be
+ * resumed from the shuffle instead of mapping the input again.
  */
 
+#define _GNU_SOURCE
+
+#include <limits.h>
 #include <linux/limits.h>
 
+#include "aggregate.h"
+#include "hash.h"
+#include "input.h"
+#include "job.h"
+#include "join.h"
+#include "linkedlist.h"
+#include "mapper.h"
 #include "mapreduce.h"
+#include "sketch.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
 
 
+// global variable
+MapSettings map_settings = {
+    .r = 1,
+    .workdir = NULL,
+    .combine = 0,
+    .map_only = 0,
+    .aggregate = 0,
+    .approx = 0,
+    .join = NULL
+};
+
+
 /**
- * Perform map() on the file chunk by chunk.
+ * Perform map() on the file chunk by chunk. The file is read ahead, so
+ * the next chunks are usually read by the time map() needs them. A .gz
+ * or .zst file is decompressed as it is read, and map() sees its
+ * contents in the same chunks as if it were not compressed.
  *
  * @param file_path         path of the file
+ * @param outfd             where map() writes its Pairs
  * @exit                    1 if error
+ * @return                  hash of the contents of the file
  */
-void map_digest_file(char *file_path) {
+unsigned long long map_digest_file(char *file_path, int outfd) {
     char chunk[READSIZE + 1];
+    unsigned long long content_hash = CONTENT_HASH_SEED;
 
-    FILE *map_file = safe_fopen(file_path, "r");
+    Input *input = input_open(file_path);
 
     size_t chunkSize;
 
     do {
-        chunkSize = safe_fread(chunk, sizeof(char), READSIZE, map_file);
+        TRACE_BEGIN(read_started);
+        chunkSize = input_read(input, chunk, READSIZE);
+        TRACE_END(TRACE_INPUT, read_started);
         chunk[chunkSize] = '\0';
+        content_hash = hash_content(content_hash, chunk, chunkSize);
+        stats_add_input(chunkSize);
 
-        map(chunk, STDOUT_FILENO);
+        TRACE_BEGIN(map_started);
+        current_job.map(chunk, outfd);
+        TRACE_END(TRACE_MAP, map_started);
     } while (chunkSize == READSIZE);
 
-    // check we reached EOF
-    if (!feof(map_file)) {
-        safe_fprintf(stderr, "Could not read to end of %s", file_path);
+    input_close(input);
+    return content_hash;
+}
+
+/*
+ * Maps the files of a task one after the other to outfd.
+ *
+ * @param paths             paths of the files
+ * @param npaths            number of files, more than 1 for a pack
+ * @param outfd             where map() writes its Pairs
+ * @exit                    1 if error
+ * @return                  hash of the contents of the file, or of the
+ *                          hashes of the files of a pack
+ */
+static unsigned long long map_task_files(char **paths, int npaths,
+                                         int outfd) {
+    if (npaths == 1) {
+        return map_digest_file(paths[0], outfd);
     }
 
-    safe_fclose(map_file);
+    unsigned long long content_hash = CONTENT_HASH_SEED;
+    for (int i = 0; i < npaths; i++) {
+        unsigned long long file_hash = map_digest_file(paths[i], outfd);
+        content_hash = hash_content(content_hash, (const char *) &file_hash,
+                                    sizeof(file_hash));
+    }
+    return content_hash;
+}
+
+/*
+ * Maps the files of a task to outfd. In a join, the Pairs map() writes
+ * are spilled to an anonymous file and probed in the join table
+ * SPILL_READ_PAIRS at a time, and only the Pairs whose key is in it are
+ * written, with the value of the key appended after a tab.
+ *
+ * @param paths             paths of the files
+ * @param npaths            number of files, more than 1 for a pack
+ * @param outfd             where the Pairs go
+ * @exit                    1 if error
+ * @return                  hash of the contents of the files
+ */
+static unsigned long long map_digest_task(char **paths, int npaths,
+                                          int outfd) {
+    if (map_settings.join == NULL) {
+        return map_task_files(paths, npaths, outfd);
+    }
+
+    FILE *spill = tmpfile();
+    if (spill == NULL) {
+        safe_fprintf(stderr, "Error creating spill file\n");
+        exit(1);
+    }
+    unsigned long long content_hash = map_task_files(paths, npaths,
+                                                     fileno(spill));
+    rewind(spill);
+
+    Pair *pairs;
+    safe_malloc((void **) &pairs, sizeof(Pair) * SPILL_READ_PAIRS);
+    size_t npairs;
+    while ((npairs = safe_fread(pairs, sizeof(Pair), SPILL_READ_PAIRS,
+                                spill)) > 0) {
+        size_t njoined = 0;
+        for (size_t i = 0; i < npairs; i++) {
+            const char *value = join_table_lookup(map_settings.join,
+                                                  pairs[i].key);
+            if (value == NULL) {
+                continue;
+            }
+            Pair *joined = &pairs[njoined++];
+            *joined = pairs[i];
+            size_t length = strlen(joined->value);
+            snprintf(joined->value + length, MAX_VALUE - length, "\t%s",
+                     value);
+        }
+        safe_write(outfd, pairs, sizeof(Pair) * njoined);
+    }
+    free(pairs);
+    safe_fclose(spill);
+    return content_hash;
+}
+
+/**
+ * Path of the persisted output of the task with the given id.
+ *
+ * @param path              buffer of PATH_MAX bytes to write the path to
+ * @param output_id         id master gave the task output
+ */
+void map_output_path(char *path, int output_id) {
+    snprintf(path, PATH_MAX, "%s/map-%d.out", map_settings.workdir, output_id);
+}
+
+/*
+ * Compare two Pairs by reduce partition, then key, for use with qsort.
+ */
+static int compare_partitioned_pairs(const void *a, const void *b) {
+    const Pair *pair_a = a;
+    const Pair *pair_b = b;
+    int partition_a = job_partition(pair_a->key, map_settings.r);
+    int partition_b = job_partition(pair_b->key, map_settings.r);
+
+    if (partition_a != partition_b) {
+        return partition_a < partition_b ? -1 : 1;
+    }
+    return strcmp(pair_a->key, pair_b->key);
+}
+
+/*
+ * Combines Pairs of the same key into one Pair with the job's combine(),
+ * or reduce() if it has none.
+ *
+ * @param pairs             Pairs to combine, reordered in place
+ * @param npairs            number of Pairs, at most COLLECT_PAIRS
+ * @return                  number of combined Pairs now at start of pairs
+ */
+static size_t combine_pairs(Pair *pairs, size_t npairs) {
+    LLKeyValues *grouped = build_sorted_run(pairs, npairs);
+
+    size_t ncombined = 0;
+    for (LLKeyValues *cur = grouped; cur != NULL; cur = cur->next) {
+        pairs[ncombined++] = job_combine(cur->key, cur->head_value);
+    }
+
+    free_key_values_list(grouped);
+    return ncombined;
+}
+
+/*
+ * Aggregates the spilled output of a task by key in a hash table, without
+ * sorting it, and writes the aggregated Pairs to outfd. The table holds
+ * one Pair per distinct key, whatever the task output.
+ *
+ * @param spill             spilled output, at its start
+ * @param outfd             where the aggregated Pairs go
+ * @exit                    1 if error
+ */
+static void aggregate_spill(FILE *spill, int outfd) {
+    Aggregate table;
+    aggregate_init(&table);
+
+    Pair *pairs;
+    safe_malloc((void **) &pairs, sizeof(Pair) * SPILL_READ_PAIRS);
+    size_t npairs;
+    while ((npairs = safe_fread(pairs, sizeof(Pair), SPILL_READ_PAIRS,
+                                spill)) > 0) {
+        for (size_t i = 0; i < npairs; i++) {
+            aggregate_add(&table, &pairs[i]);
+        }
+    }
+    free(pairs);
+
+    safe_malloc((void **) &pairs, sizeof(Pair) * (table.count + 1));
+    npairs = aggregate_collect(&table, pairs);
+    aggregate_free(&table);
+    safe_write(outfd, pairs, sizeof(Pair) * npairs);
+    free(pairs);
+}
+
+/*
+ * A sorted chunk of the output of a task, read back CHUNK_READ_PAIRS at
+ * a time while the chunks are merged.
+ */
+typedef struct chunk_cursor {
+    off_t next;             // offset of the next Pair to read back
+    size_t left;            // Pairs of the chunk not read back yet
+    Pair pairs[CHUNK_READ_PAIRS];
+    size_t cursor;          // next Pair of pairs to merge
+    size_t npairs;          // Pairs read back into pairs
+} ChunkCursor;
+
+/*
+ * Returns the next Pair of a chunk to merge, reading more back if needed.
+ *
+ * @param chunk             chunk to merge
+ * @param fd                file of the sorted chunks
+ * @exit                    1 if error
+ * @return                  the Pair, NULL once the chunk is merged
+ */
+static const Pair *chunk_head(ChunkCursor *chunk, int fd) {
+    if (chunk->cursor < chunk->npairs) {
+        return &chunk->pairs[chunk->cursor];
+    }
+    if (chunk->left == 0) {
+        return NULL;
+    }
+
+    size_t npairs = chunk->left < CHUNK_READ_PAIRS ? chunk->left :
+                                                     CHUNK_READ_PAIRS;
+    ssize_t nread = pread(fd, chunk->pairs, sizeof(Pair) * npairs,
+                          chunk->next);
+    if (nread != (ssize_t) (sizeof(Pair) * npairs)) {
+        safe_fprintf(stderr, "Error reading a sorted chunk back\n");
+        exit(1);
+    }
+    chunk->next += nread;
+    chunk->left -= npairs;
+    chunk->cursor = 0;
+    chunk->npairs = npairs;
+    return &chunk->pairs[0];
+}
+
+/*
+ * Persists the output of a task to the work directory, merging its
+ * chunks sorted by partition and key, and writes the merged Pairs to
+ * outfd as well. A persisted file is complete once it has its final
+ * name, so a crash never leaves a truncated output behind.
+ *
+ * @param chunks            file of the sorted chunks
+ * @param chunk_pairs       Pairs of each chunk, in the order of the file
+ * @param nchunks           number of chunks
+ * @param counts            Pairs of each partition in all of the chunks
+ * @param output_id         id master gave the task output
+ * @param outfd             where the merged Pairs go
+ * @exit                    1 if error
+ */
+static void persist_chunks(FILE *chunks, const size_t *chunk_pairs,
+                           int nchunks, const int *counts, int output_id,
+                           int outfd) {
+    MapOutputHeader header = {.npartitions = map_settings.r};
+    strncpy(header.magic, MAP_OUTPUT_MAGIC, sizeof(header.magic));
+
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 32];
+    map_output_path(path, output_id);
+    // a speculative attempt of the task may be writing the same output
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, getpid());
+
+    FILE *fout = safe_fopen(tmp_path, "wb");
+    safe_fwrite(&header, sizeof(MapOutputHeader), 1, fout);
+    safe_fwrite(counts, sizeof(int), map_settings.r, fout);
+
+    ChunkCursor *cursors;
+    safe_malloc((void **) &cursors, sizeof(ChunkCursor) * (nchunks + 1));
+    off_t offset = 0;
+    for (int c = 0; c < nchunks; c++) {
+        cursors[c].next = offset;
+        cursors[c].left = chunk_pairs[c];
+        cursors[c].cursor = 0;
+        cursors[c].npairs = 0;
+        offset += sizeof(Pair) * chunk_pairs[c];
+    }
+
+    // the chunks are few, the smallest head is found by a scan
+    Pair *merged;
+    safe_malloc((void **) &merged, sizeof(Pair) * SPILL_READ_PAIRS);
+    size_t nmerged = 0;
+    int fd = fileno(chunks);
+    while (1) {
+        int smallest = -1;
+        const Pair *head = NULL;
+        for (int c = 0; c < nchunks; c++) {
+            const Pair *pair = chunk_head(&cursors[c], fd);
+            if (pair != NULL &&
+                (head == NULL || compare_partitioned_pairs(pair, head) < 0)) {
+                smallest = c;
+                head = pair;
+            }
+        }
+
+        if (nmerged == SPILL_READ_PAIRS || (head == NULL && nmerged > 0)) {
+            safe_fwrite(merged, sizeof(Pair), nmerged, fout);
+            safe_write(outfd, merged, sizeof(Pair) * nmerged);
+            nmerged = 0;
+        }
+        if (head == NULL) {
+            break;
+        }
+        merged[nmerged++] = *head;
+        cursors[smallest].cursor++;
+    }
+    free(merged);
+    free(cursors);
+
+    fflush(fout);
+    fsync(fileno(fout));
+    safe_fclose(fout);
+    if (rename(tmp_path, path) != 0) {
+        safe_fprintf(stderr, "Error renaming %s\n", tmp_path);
+        exit(1);
+    }
+}
+
+/**
+ * Maps the files of a task, combines or aggregates their output if asked
+ * to, persists it to the work directory if there is one and writes it to
+ * outfd. The output is spilled to an anonymous file and combined
+ * COLLECT_PAIRS at a time, so a key of a large task may be combined into
+ * a few Pairs, which reducers combine further. With a work directory
+ * each chunk is sorted by partition and key into a file of chunks,
+ * merged as it is persisted, so a mapper needs the same memory however
+ * much a task outputs.
+ *
+ * @param paths             paths of the files
+ * @param npaths            number of files, more than 1 for a pack
+ * @param output_id         id master gave the task output
+ * @param outfd             where the output goes, master or an output file
+ * @exit                    1 if error
+ * @return                  hash of the contents of the files
+ */
+static unsigned long long map_collect_task(char **paths, int npaths,
+                                           int output_id, int outfd) {
+    // collect the output of map() in an anonymous file
+    FILE *spill = tmpfile();
+    if (spill == NULL) {
+        safe_fprintf(stderr, "Error creating spill file\n");
+        exit(1);
+    }
+    unsigned long long content_hash = map_digest_task(paths, npaths,
+                                                      fileno(spill));
+    rewind(spill);
+
+    if (map_settings.aggregate) {
+        aggregate_spill(spill, outfd);
+        safe_fclose(spill);
+        return content_hash;
+    }
+
+    FILE *chunks = NULL;
+    if (map_settings.workdir != NULL && (chunks = tmpfile()) == NULL) {
+        safe_fprintf(stderr, "Error creating spill file\n");
+        exit(1);
+    }
+    size_t *chunk_pairs = NULL;
+    int nchunks = 0;
+    size_t counts[map_settings.r + 1];
+    memset(counts, 0, sizeof(size_t) * (map_settings.r + 1));
+
+    Pair *pairs;
+    safe_malloc((void **) &pairs, sizeof(Pair) * COLLECT_PAIRS);
+    size_t npairs;
+    while ((npairs = safe_fread(pairs, sizeof(Pair), COLLECT_PAIRS,
+                                spill)) > 0) {
+        if (map_settings.combine) {
+            npairs = combine_pairs(pairs, npairs);
+        }
+        if (chunks == NULL) {
+            safe_write(outfd, pairs, sizeof(Pair) * npairs);
+            continue;
+        }
+
+        qsort(pairs, npairs, sizeof(Pair), compare_partitioned_pairs);
+        for (size_t i = 0; i < npairs; i++) {
+            counts[job_partition(pairs[i].key, map_settings.r)]++;
+        }
+        safe_fwrite(pairs, sizeof(Pair), npairs, chunks);
+        safe_realloc((void **) &chunk_pairs, sizeof(size_t) * (nchunks + 1));
+        chunk_pairs[nchunks++] = npairs;
+    }
+    free(pairs);
+    safe_fclose(spill);
+
+    if (chunks != NULL) {
+        // the header counts Pairs as ints
+        int partition_counts[map_settings.r + 1];
+        for (int p = 0; p < map_settings.r; p++) {
+            if (counts[p] > INT_MAX) {
+                safe_fprintf(stderr, "Output of %s too large to persist\n",
+                             paths[0]);
+                exit(1);
+            }
+            partition_counts[p] = counts[p];
+        }
+        fflush(chunks);
+        persist_chunks(chunks, chunk_pairs, nchunks, partition_counts,
+                       output_id, outfd);
+        safe_fclose(chunks);
+        free(chunk_pairs);
+    }
+    return content_hash;
+}
+
+/**
+ * Maps the files of a task and sends master a sketch of their output
+ * instead of the output itself. The output is spilled to an anonymous
+ * file and counted SPILL_READ_PAIRS at a time, so a mapper needs the
+ * same memory however much a task outputs.
+ *
+ * @param paths             paths of the files
+ * @param npaths            number of files, more than 1 for a pack
+ * @param outfd             where the sketch goes
+ * @exit                    1 if error
+ * @return                  hash of the contents of the files
+ */
+static unsigned long long map_sketch_task(char **paths, int npaths,
+                                          int outfd) {
+    FILE *spill = tmpfile();
+    if (spill == NULL) {
+        safe_fprintf(stderr, "Error creating spill file\n");
+        exit(1);
+    }
+    unsigned long long content_hash = map_digest_task(paths, npaths,
+                                                      fileno(spill));
+    rewind(spill);
+
+    Sketch *sketch = sketch_create();
+    Pair *pairs;
+    safe_malloc((void **) &pairs, sizeof(Pair) * SPILL_READ_PAIRS);
+    size_t npairs;
+    while ((npairs = safe_fread(pairs, sizeof(Pair), SPILL_READ_PAIRS,
+                                spill)) > 0) {
+        for (size_t i = 0; i < npairs; i++) {
+            sketch_add_pair(sketch, &pairs[i]);
+        }
+    }
+    free(pairs);
+    safe_fclose(spill);
+
+    sketch_write(sketch, outfd);
+    sketch_free(sketch);
+    return content_hash;
+}
+
+/**
+ * Path of the output file of a task of a job without reducers.
+ *
+ * @param path              buffer of PATH_MAX bytes to write the path to
+ * @param output_id         id master gave the task output
+ */
+void map_only_output_path(char *path, int output_id) {
+    snprintf(path, PATH_MAX, "[map-%d].out", output_id);
+}
+
+/**
+ * Maps the files of a task straight to the output file of the task,
+ * combining their output if asked to. Attempts of the task write their
+ * own temporary file and rename it, so a failed attempt never leaves a
+ * partial output and a speculative one just replaces the same output.
+ *
+ * @param paths             paths of the files
+ * @param npaths            number of files, more than 1 for a pack
+ * @param output_id         id master gave the task output
+ * @exit                    1 if error
+ * @return                  hash of the contents of the files
+ */
+static unsigned long long map_only_task(char **paths, int npaths,
+                                        int output_id) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 32];
+    map_only_output_path(path, output_id);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, getpid());
+
+    FILE *fout = safe_fopen(tmp_path, "wb");
+    unsigned long long content_hash;
+    if (map_settings.combine) {
+        content_hash = map_collect_task(paths, npaths, output_id,
+                                        fileno(fout));
+    } else {
+        content_hash = map_digest_task(paths, npaths, fileno(fout));
+    }
+    safe_fclose(fout);
+
+    if (rename(tmp_path, path) != 0) {
+        safe_fprintf(stderr, "Error renaming %s\n", tmp_path);
+        exit(1);
+    }
+    return content_hash;
+}
+
+/**
+ * Returns 1 if pair marks the end of the output of a task, else 0.
+ *
+ * @param pair              Pair read from a mapper
+ */
+int is_task_done_marker(const Pair *pair) {
+    return pair->key[0] == '\0' &&
+           strncmp(pair->value, TASK_DONE_VALUE, strlen(TASK_DONE_VALUE)) == 0;
+}
+
+/**
+ * Reads the hash of the contents of the input file from a done marker.
+ *
+ * @param pair              done marker
+ * @param content_hash      where to store the hash
+ * @return                  1 if the marker has a hash, else 0
+ */
+int task_done_marker_hash(const Pair *pair, unsigned long long *content_hash) {
+    return sscanf(pair->value + strlen(TASK_DONE_VALUE), " %llx",
+                  content_hash) == 1;
+}
+
+/*
+ * Frees the paths of the files of a pack.
+ */
+static void free_pack_paths(char **paths, int npaths) {
+    for (int i = 0; i < npaths; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+}
+
+/*
+ * Reads the paths of the files of a pack sent by master.
+ *
+ * @param npaths            number of files
+ * @exit                    1 if error
+ * @return                  the paths, NULL if master sent fewer
+ */
+static char **read_pack_paths(int npaths) {
+    char file_path[PATH_MAX];
+    char **paths;
+    safe_malloc((void **) &paths, sizeof(char *) * npaths);
+
+    for (int i = 0; i < npaths; i++) {
+        if (scanf(" %s", file_path) != 1) {
+            free_pack_paths(paths, i);
+            return NULL;
+        }
+        safe_malloc((void **) &paths[i], strlen(file_path) + 1);
+        strcpy(paths[i], file_path);
+    }
+    return paths;
 }
 
 /**
  * Process all files assigned to this map worker.
+ * Master sends "kind output_id path" for each task, or
+ * "kind output_id npaths path ..." for a pack of files, and the next task
+ * once the done marker of the last one is read. The files of a pack are
+ * mapped as one task, with one done marker. Returns once master closes
+ * the pipe of tasks.
  *
- * @exit        0 if all files processed correctly, else 1
+ * @exit        1 if error
  */
 void map_digest_files() {
     // PATH_MAX is an OS defined macro
     char file_path[PATH_MAX];
+    char *single_path[1] = {file_path};
+    char kind;
+    int output_id;
 
-    while(scanf("%s", file_path) > 0) {
-        map_digest_file(file_path);
+    Pair done_marker = {"", TASK_DONE_VALUE};
+
+    while(scanf(" %c %d", &kind, &output_id) == 2) {
+        char **paths = single_path;
+        int npaths = 1;
+        if (kind == TASK_PACK) {
+            if (scanf(" %d", &npaths) != 1 || npaths < 1 ||
+                (paths = read_pack_paths(npaths)) == NULL) {
+                break;
+            }
+        } else if (scanf(" %s", file_path) != 1) {
+            break;
+        }
+
+        unsigned long long content_hash;
+        stats_start_task();
+        stats_set_phase(PHASE_MAPPING);
+        if (map_settings.map_only) {
+            content_hash = map_only_task(paths, npaths, output_id);
+        } else if (map_settings.approx) {
+            content_hash = map_sketch_task(paths, npaths, STDOUT_FILENO);
+        } else if (map_settings.workdir != NULL || map_settings.combine ||
+                   map_settings.aggregate) {
+            content_hash = map_collect_task(paths, npaths, output_id,
+                                            STDOUT_FILENO);
+        } else {
+            content_hash = map_digest_task(paths, npaths, STDOUT_FILENO);
+        }
+        // master records the hash to spot unchanged files next run
+        snprintf(done_marker.value, MAX_VALUE, "%s %016llx", TASK_DONE_VALUE,
+                 content_hash);
+        stats_set_phase(PHASE_IDLE);
+        safe_write(STDOUT_FILENO, &done_marker, sizeof(Pair));
+
+        if (paths != single_path) {
+            free_pack_paths(paths, npaths);
+        }
     }
 
-    exit(0);
+    stats_set_phase(PHASE_DONE);
 }
-
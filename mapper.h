@@ -1,10 +1,75 @@
 #ifndef MAPPER_H
 #define MAPPER_H
 
+#include "join.h"
+#include "mapreduce.h"
+
+// Value of the Pair with an empty key a mapper writes after each file,
+// telling master the output of the task is complete. It is followed by the
+// hash of the contents of the files of the task.
+#define TASK_DONE_VALUE "\001task-done"
+
+#define SPILL_READ_PAIRS 1024   // spilled Pairs read back at once
+#define COLLECT_PAIRS 65536     // Pairs of a task combined or sorted at once
+#define CHUNK_READ_PAIRS 64     // Pairs of a sorted chunk read back at once
+
+#define MAP_OUTPUT_MAGIC "MRMAP01"  // first bytes of a persisted map output
+
+// Kinds of task master sends to a mapper
+#define TASK_MAP 'M'        // map the input file
+#define TASK_PACK 'P'       // map a pack of small files as one task
+
+/*
+ * Settings of map workers, set by master before any mapper is forked.
+ */
+typedef struct map_settings {
+    int r;                  // number of reduce partitions
+    const char *workdir;    // directory for persisted map output, or NULL
+    int combine;            // 1 to combine the output of a file with reduce()
+    int map_only;           // 1 to write map output to files, no reducers
+    int aggregate;          // 1 to aggregate the output of a file by key
+                            //   in a hash table, for a job with no reducers
+    int approx;             // 1 to count the output of a file in a sketch,
+                            //   for an approximate job with no reducers
+    const JoinTable *join;  // small side of a broadcast join, NULL if the
+                            //   job joins nothing
+} MapSettings;
+
+extern MapSettings map_settings;
+
+/*
+ * Header of a persisted map output file. It is followed by npartitions
+ * Pair counts, then the Pairs sorted by partition and key.
+ */
+typedef struct map_output_header {
+    char magic[8];
+    int npartitions;
+} MapOutputHeader;
+
 /**
  * Perform map() on the file chunk by chunk.
  */
-void map_digest_file(char *file_path);
+unsigned long long map_digest_file(char *file_path, int outfd);
+
+/**
+ * Path of the persisted output of the task with the given id.
+ */
+void map_output_path(char *path, int output_id);
+
+/**
+ * Path of the output file of a task of a job without reducers.
+ */
+void map_only_output_path(char *path, int output_id);
+
+/**
+ * Returns 1 if pair marks the end of the output of a task, else 0.
+ */
+int is_task_done_marker(const Pair *pair);
+
+/**
+ * Reads the hash of the contents of the input file from a done marker.
+ */
+int task_done_marker_hash(const Pair *pair, unsigned long long *content_hash);
 
 /**
  * Process all files assigned to this map worker.
@@ -7,13 +7,24 @@
 #include <unistd.h>
 
 #include "mapreduce.h"
+#include "job.h"
 #include "master.h"
+#include "placement.h"
+#include "server.h"
 #include "utils.h"
+#include "worker.h"
 
 /**
  * Read the command line arguments and set MapReduce logistics
  * appropriately.
- * Usage format is "mapreduce [-m numprocs] [-r numprocs] -d dirname".
+ * Usage format is
+ * "mapreduce [-m numprocs] [-r numprocs] [-t threads] [-c] [-a] [--approx]
+ *  [-k K] [-j job.so [-j job.so ...]] [-w workdir [--resume]] [--pipes]
+ *  [--auto] [--progress] [--pack bytes] [--join dir] [-H host:port,...]
+ *  [-s socket] -d dirname",
+ * where -r 0 runs a map only job,
+ * or "mapreduce [-j job.so] -W port" to serve jobs as a worker daemon,
+ * or "mapreduce -S socket" to serve jobs as a job server.
  *
  * @param argc      command line argument count
  * @param argv      command line argument vector
@@ -25,23 +36,68 @@ MapReduceLogistics process(int argc, char *const *argv) {
     MapReduceLogistics res = {
         .nmapworkers = DEFAULT_NWORKERS,
         .nreduceworkers = DEFAULT_NWORKERS,
-        .dirname = NULL
+        .reduce_threads = 1,
+        .dirname = NULL,
+        .workdir = NULL,
+        .resume = 0,
+        .combine = 0,
+        .aggregate = 0,
+        .approx = 0,
+        .join_dir = NULL,
+        .top_k = 0,
+        .auto_tune = 0,
+        .progress = 0,
+        .pack_bytes = 0,
+        .pipes = 0,
+        .jobs = NULL,
+        .njobs = 0,
+        .workers = NULL,
+        .daemon_port = 0,
+        .server_socket = NULL,
+        .submit_socket = NULL
     };
 
+    static struct option long_options[] = {
+        {"resume", no_argument, NULL, 'R'},
+        {"incremental", no_argument, NULL, 'R'},
+        {"pipes", no_argument, NULL, 'P'},
+        {"auto", no_argument, NULL, 'A'},
+        {"progress", no_argument, NULL, 'G'},
+        {"pack", required_argument, NULL, 'p'},
+        {"approx", no_argument, NULL, 'X'},
+        {"join", required_argument, NULL, 'J'},
+        {NULL, 0, NULL, 0}
+    };
+
+    // a chain has at most as many jobs as arguments
+    safe_malloc((void **) &(res.jobs), sizeof(char *) * argc);
+
     int dflag = 0;
+    int mflag = 0;
+    int rflag = 0;
     int throw_error = 0;
 
     opterr = 0;       // do not let getopts throw error if missing argument
     int output;
 
-    while ((output = getopt(argc, argv, "m:r:d:")) != -1) {
+    while ((output = getopt_long(argc, argv, "m:r:t:d:w:cak:j:H:W:S:s:",
+                                 long_options, NULL)) != -1) {
         switch (output) {
             case 'm':
+                mflag = 1;
                 res.nmapworkers = strtol(optarg, NULL, 10);
                 break;
             case 'r':
+                rflag = 1;
                 res.nreduceworkers = strtol(optarg, NULL, 10);
                 break;
+            case 't':
+                res.reduce_threads = strtol(optarg, NULL, 10);
+                if (res.reduce_threads <= 0 ||
+                    res.reduce_threads > MAX_REDUCE_THREADS) {
+                    throw_error = 1;
+                }
+                break;
             case 'd':
                 dflag = 1;
                 // we though MAX_FILENAME (32 bytes) was too short
@@ -53,31 +109,179 @@ MapReduceLogistics process(int argc, char *const *argv) {
                 strncpy(res.dirname, optarg, strlen(optarg) + 2);
 
                 // concatenating '/' if needed
-                if (res.dirname[strlen(res.dirname) - 1] != '/') {
-                    res.dirname[strlen(res.dirname)] = '/';
-                    res.dirname[strlen(res.dirname) + 1] = '\0';
+                if (res.dirname[strlen(optarg) - 1] != '/') {
+                    res.dirname[strlen(optarg)] = '/';
+                    res.dirname[strlen(optarg) + 1] = '\0';
+                }
+                break;
+            case 'w':
+                res.workdir = optarg;
+                break;
+            case 'R':
+                res.resume = 1;
+                break;
+            case 'c':
+                res.combine = 1;
+                break;
+            case 'a':
+                res.aggregate = 1;
+                break;
+            case 'X':
+                res.approx = 1;
+                break;
+            case 'J':
+                res.join_dir = optarg;
+                break;
+            case 'k':
+                res.top_k = strtol(optarg, NULL, 10);
+                if (res.top_k <= 0) {
+                    throw_error = 1;
                 }
                 break;
+            case 'P':
+                res.pipes = 1;
+                break;
+            case 'A':
+                res.auto_tune = 1;
+                break;
+            case 'G':
+                res.progress = 1;
+                break;
+            case 'p':
+                res.pack_bytes = strtoll(optarg, NULL, 10);
+                if (res.pack_bytes <= 0) {
+                    throw_error = 1;
+                }
+                break;
+            case 'j':
+                res.jobs[res.njobs++] = optarg;
+                break;
+            case 'H':
+                res.workers = optarg;
+                break;
+            case 'W':
+                res.daemon_port = strtol(optarg, NULL, 10);
+                if (res.daemon_port <= 0) {
+                    throw_error = 1;
+                }
+                break;
+            case 'S':
+                res.server_socket = optarg;
+                break;
+            case 's':
+                res.submit_socket = optarg;
+                break;
             default:
                 throw_error = 1;
         }
     }
 
-    if (!dflag || res.nmapworkers <= 0 || res.nreduceworkers <= 0 ||
-     optind != argc) {
+    if (res.auto_tune) {
+        // master sizes the workers not given once it knows the input
+        if (!mflag) {
+            res.nmapworkers = AUTO_NWORKERS;
+        }
+        if (!rflag) {
+            res.nreduceworkers = AUTO_NWORKERS;
+        }
+    }
+
+    if (res.aggregate || res.approx) {
+        // master aggregates the output of mappers itself
+        res.nreduceworkers = 0;
+    }
+
+    if (res.server_socket != NULL) {
+        // the jobs come from the clients
+        if (argc != 3) {
+            throw_error = 1;
+        }
+    } else if (res.daemon_port > 0) {
+        // a worker daemon gets its jobs from the coordinator
+        if (dflag || res.workers != NULL || optind != argc ||
+            res.njobs > 1 || res.auto_tune) {
+            throw_error = 1;
+        }
+    } else if (!dflag ||
+     (res.nmapworkers <= 0 && res.nmapworkers != AUTO_NWORKERS) ||
+     (res.nreduceworkers < 0 && res.nreduceworkers != AUTO_NWORKERS) ||
+     (res.auto_tune && res.workers != NULL) ||
+     optind != argc || (res.resume && res.workdir == NULL) ||
+     (res.workers != NULL && (res.workdir != NULL || res.njobs > 1)) ||
+     (res.nreduceworkers == 0 && (res.workdir != NULL || res.njobs > 1 ||
+                                  res.workers != NULL)) ||
+     (res.top_k > 0 && ((res.nreduceworkers == 0 && !res.aggregate &&
+                         !res.approx) || res.workers != NULL)) ||
+     (res.approx && (res.aggregate || res.combine)) ||
+     (res.join_dir != NULL && (res.workdir != NULL || res.workers != NULL ||
+                               res.submit_socket != NULL)) ||
+     (res.pack_bytes > 0 && (res.workdir != NULL || res.workers != NULL)) ||
+     (res.submit_socket != NULL && (res.workdir != NULL ||
+                                    res.workers != NULL || res.auto_tune ||
+                                    res.progress))) {
         throw_error = 1;
     }
 
     if (throw_error) {
         safe_fprintf(
             stderr,
-            "usage: %s [-m nmapworkers] [-r nreduceworkers] -d dirname\n",
-            argv[0]);
+            "usage: %s [-m nmapworkers] [-r nreduceworkers] [-t threads] "
+            "[-c] [-a] [--approx]\n"
+            "       [-k K] [-j job.so ...] [-w workdir [--resume]] [--pipes] "
+            "[--auto] [--progress]\n"
+            "       [--pack bytes] [--join dir] [-H host:port,...] [-s socket] "
+            "-d dirname\n"
+            "       %s [-j job.so] -W port\n"
+            "       %s -S socket\n",
+            argv[0], argv[0], argv[0]);
         safe_fprintf(stderr,
             "\t-m nmapworkers: number of map processes (default 2)\n"
             );
         safe_fprintf(stderr,
-         "\t-r nreduceworkers: number of reduce processes (default 2)\n");
+         "\t-r nreduceworkers: number of reduce processes (default 2), 0 to "
+         "write map output without reducing\n");
+        safe_fprintf(stderr,
+         "\t-t threads: threads sorting and reducing the keys of each "
+         "reducer (default 1)\n");
+        safe_fprintf(stderr,
+         "\t-w workdir: directory to persist map output in\n");
+        safe_fprintf(stderr,
+         "\t-c: combine the output of each file with combine() or reduce()\n");
+        safe_fprintf(stderr,
+         "\t-a: aggregate the output by key with combine() or reduce(), "
+         "without reducers\n");
+        safe_fprintf(stderr,
+         "\t--approx: count keys approximately in fixed memory, without "
+         "reducers\n");
+        safe_fprintf(stderr,
+         "\t-k K: keep only the K best ranked results, by rank() or value\n");
+        safe_fprintf(stderr,
+         "\t-j job.so: run the job built as this plugin, repeat to chain "
+         "jobs\n");
+        safe_fprintf(stderr,
+         "\t--resume, --incremental: reuse map output persisted in "
+         "workdir for unchanged files\n");
+        safe_fprintf(stderr,
+         "\t--pipes: feed reducers through pipes instead of shared memory\n");
+        safe_fprintf(stderr,
+         "\t--auto: size -m and -r from the cpus and input if not given, "
+         "and pin workers to cpus\n");
+        safe_fprintf(stderr,
+         "\t--progress: report progress on stderr every second\n");
+        safe_fprintf(stderr,
+         "\t--pack bytes: map small files together in tasks of up to this "
+         "many bytes\n");
+        safe_fprintf(stderr,
+         "\t--join dir: keep the Pairs whose key is in the \"key<TAB>value\" "
+         "lines of dir, joined\n\t\twith the value\n");
+        safe_fprintf(stderr,
+         "\t-H host:port,...: run the job on these worker daemons\n");
+        safe_fprintf(stderr,
+         "\t-W port: serve jobs as a worker daemon on port\n");
+        safe_fprintf(stderr,
+         "\t-S socket: serve jobs as a job server on this Unix socket\n");
+        safe_fprintf(stderr,
+         "\t-s socket: run the job on the job server at this socket\n");
         safe_fprintf(stderr,
          "\t-d dirname: directory of files to map reduce\n");
 
@@ -92,8 +296,24 @@ MapReduceLogistics process(int argc, char *const *argv) {
  */
 int main(int argc, char *argv[]) {
     MapReduceLogistics out = process(argc, argv);
-    create_master(out.dirname, out.nmapworkers, out.nreduceworkers);
+    if (out.server_socket != NULL) {
+        run_job_server(out.server_socket);
+    }
+    if (out.submit_socket != NULL) {
+        int result = submit_job(out.submit_socket, &out);
+        free(out.dirname);
+        free(out.jobs);
+        return result;
+    }
+    for (int i = 0; i < out.njobs; i++) {
+        load_job(out.jobs[i]);
+    }
+    if (out.daemon_port > 0) {
+        run_worker_daemon(out.daemon_port);
+    }
+    create_master(&out);
     free(out.dirname);
+    free(out.jobs);
     return 0;
 }
 
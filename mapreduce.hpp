@@ -0,0 +1,434 @@
+#ifndef MAPREDUCE_HPP
+#define MAPREDUCE_HPP
+
+/*
+ * Typed map reduce jobs in C++, built as plugins with
+ * "make cxxplugin JOB=filename" and run with "mapreduce -j filename.so"
+ * like any other job.
+ *
+ * A job is a class with static functions. It derives from Mapper<K, V>,
+ * for a map() emitting Pairs of key type K and value type V, and from
+ * Reducer<K, V, Out>, for a reduce() turning the values of a key into one
+ * value of type Out:
+ *
+ *     struct WordCount : mapreduce::Mapper<std::string_view, long>,
+ *                        mapreduce::Reducer<std::string_view, long, long> {
+ *         static void map(const char *chunk, Emitter &out);
+ *         static long reduce(const std::string_view &key, Values values);
+ *     };
+ *     MAPREDUCE_JOB(WordCount)
+ *
+ * It may also define, with the same meaning as in job.h:
+ *
+ *     static V combine(const K &key, Values values);
+ *     static unsigned int partition(const K &key, int npartitions);
+ *     static int compare_values(const V &a, const V &b);
+ *     static int rank(const Out &a, const Out &b);
+ *
+ * MAPREDUCE_JOB() exports the Job the engine loads, with every function
+ * a template instance calling the job's own directly, so nothing is
+ * dispatched at run time. The engine still moves fixed Pairs of strings,
+ * compared with strcmp, so keys and values are encoded as strings with
+ * no null byte, by the Codec of their type:
+ *
+ *   - strings as they are, cut to fit
+ *   - numbers as decimal text, written and parsed without locale, so
+ *     outputs read as those of C jobs and -k ranks them
+ *   - other trivially copyable types as the hex of their bytes
+ *
+ * A job whose Out is a number and that defines no rank() gets one
+ * comparing the decoded numbers, larger first.
+ *
+ * Keys and values stay text rather than raw bytes because the engine
+ * treats them as null terminated strings: it hashes keys to partitions,
+ * sorts and merges them with strcmp, and -k and mrmerge read the output
+ * files of C and C++ jobs alike. The bytes of a number may hold a null
+ * byte, so they could not travel as they are. For the same reason a job
+ * with no partition() is partitioned by the engine's hash of the encoded
+ * key, which spreads numbers as well as words.
+ */
+
+extern "C" {
+#include "job.h"
+#include "mapreduce.h"
+}
+
+#include <charconv>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unistd.h>
+
+namespace mapreduce {
+
+/*
+ * Encodes values of type T into the key or value of a Pair, and decodes
+ * them back. encode() writes at most size - 1 bytes and a null byte, and
+ * decode() reads a string encode() wrote. This is the encoding of a
+ * trivially copyable type, the hex of its bytes; strings and numbers
+ * have their own below.
+ */
+template <typename T, typename Enable = void>
+struct Codec {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "a key or value type must be a string, a number or "
+                  "trivially copyable");
+
+    static constexpr size_t length = 2 * sizeof(T);    // bytes encoded
+
+    static void encode(const T &value, char *out, size_t size) {
+        static const char digits[] = "0123456789abcdef";
+        unsigned char bytes[sizeof(T)];
+        std::memcpy(bytes, &value, sizeof(T));
+        size_t n = 0;
+        for (size_t i = 0; i < sizeof(T) && n + 2 < size; i++) {
+            out[n++] = digits[bytes[i] >> 4];
+            out[n++] = digits[bytes[i] & 0xf];
+        }
+        out[n] = '\0';
+    }
+
+    static T decode(const char *encoded) {
+        unsigned char bytes[sizeof(T)];
+        for (size_t i = 0; i < sizeof(T); i++) {
+            int high = hex_digit(encoded[2 * i]);
+            int low = high == -1 ? -1 : hex_digit(encoded[2 * i + 1]);
+            if (low == -1) {
+                malformed(encoded);
+            }
+            bytes[i] = (high << 4) | low;
+        }
+        if (encoded[length] != '\0') {
+            malformed(encoded);
+        }
+        T value;
+        std::memcpy(&value, bytes, sizeof(T));
+        return value;
+    }
+
+private:
+    // -1 if c is not a hex digit, the null byte included
+    static int hex_digit(char c) {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        }
+        if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        }
+        if (c >= 'A' && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        return -1;
+    }
+
+    [[noreturn]] static void malformed(const char *encoded) {
+        std::fprintf(stderr, "Not the hex of a %zu byte value: %s\n",
+                     sizeof(T), encoded);
+        std::exit(1);
+    }
+};
+
+/*
+ * Numbers, as the shortest decimal text that reads back as the same
+ * number.
+ */
+template <typename T>
+struct Codec<T, std::enable_if_t<std::is_arithmetic_v<T> &&
+                                 !std::is_same_v<T, bool>>> {
+    static constexpr size_t length = 0;    // varies
+
+    static void encode(const T &value, char *out, size_t size) {
+        std::to_chars_result written = std::to_chars(out, out + size - 1,
+                                                     value);
+        *(written.ec == std::errc() ? written.ptr : out) = '\0';
+    }
+
+    static T decode(const char *encoded) {
+        T value = 0;
+        std::from_chars(encoded, encoded + std::strlen(encoded), value);
+        return value;
+    }
+};
+
+/*
+ * Strings, as they are. A string_view decoded points into the Pair or
+ * list of values it was read from, and is valid as long as they are, for
+ * the length of the call it was passed to.
+ */
+template <>
+struct Codec<std::string_view> {
+    static constexpr size_t length = 0;
+
+    static void encode(const std::string_view &value, char *out,
+                       size_t size) {
+        size_t n = value.size() < size - 1 ? value.size() : size - 1;
+        std::memcpy(out, value.data(), n);
+        out[n] = '\0';
+    }
+
+    static std::string_view decode(const char *encoded) {
+        return std::string_view(encoded);
+    }
+};
+
+template <>
+struct Codec<std::string> {
+    static constexpr size_t length = 0;
+
+    static void encode(const std::string &value, char *out, size_t size) {
+        Codec<std::string_view>::encode(value, out, size);
+    }
+
+    static std::string decode(const char *encoded) {
+        return std::string(encoded);
+    }
+};
+
+/*
+ * Fails to compile if values of type T always encode longer than size
+ * bytes allow.
+ */
+template <typename T, size_t size>
+constexpr void check_fits() {
+    static_assert(Codec<T>::length < size,
+                  "the type encodes too long for a key or value");
+}
+
+/*
+ * Writes the Pairs map() emits to the engine, as many at once as a pipe
+ * writes atomically.
+ */
+template <typename K, typename V>
+class Emitter {
+public:
+    explicit Emitter(int outfd) : outfd(outfd), npairs(0) {
+        check_fits<K, MAX_KEY>();
+        check_fits<V, MAX_VALUE>();
+    }
+
+    Emitter(const Emitter &) = delete;
+    Emitter &operator=(const Emitter &) = delete;
+
+    ~Emitter() {
+        flush();
+    }
+
+    void emit(const K &key, const V &value) {
+        if (npairs == EMIT_PAIRS) {
+            flush();
+        }
+        // encode() stops at the null byte, the rest is sent as is
+        pairs[npairs] = Pair();
+        Codec<K>::encode(key, pairs[npairs].key, MAX_KEY);
+        Codec<V>::encode(value, pairs[npairs].value, MAX_VALUE);
+        npairs++;
+    }
+
+    void flush() {
+        const char *bytes = reinterpret_cast<const char *>(pairs);
+        size_t nbytes = sizeof(Pair) * npairs;
+        while (nbytes > 0) {
+            ssize_t nwritten = write(outfd, bytes, nbytes);
+            if (nwritten == -1 && errno != EINTR) {
+                perror("write");
+                exit(1);
+            }
+            if (nwritten > 0) {
+                bytes += nwritten;
+                nbytes -= nwritten;
+            }
+        }
+        npairs = 0;
+    }
+
+private:
+    static constexpr size_t EMIT_PAIRS = PIPE_BUF / sizeof(Pair);
+
+    int outfd;
+    size_t npairs;
+    Pair pairs[EMIT_PAIRS] = {};
+};
+
+/*
+ * The values of a key, decoded one at a time as they are iterated.
+ */
+template <typename V>
+class Values {
+public:
+    class iterator {
+    public:
+        explicit iterator(const LLValues *node) : node(node) {}
+
+        V operator*() const {
+            return Codec<V>::decode(node->value);
+        }
+
+        iterator &operator++() {
+            node = node->next;
+            return *this;
+        }
+
+        bool operator!=(const iterator &other) const {
+            return node != other.node;
+        }
+
+    private:
+        const LLValues *node;
+    };
+
+    explicit Values(const LLValues *head) : head(head) {}
+
+    iterator begin() const {
+        return iterator(head);
+    }
+
+    iterator end() const {
+        return iterator(nullptr);
+    }
+
+private:
+    const LLValues *head;
+};
+
+/*
+ * Base of a job whose map() emits Pairs of key type K and value type V.
+ */
+template <typename K, typename V>
+struct Mapper {
+    using MapKey = K;
+    using MapValue = V;
+    using Emitter = mapreduce::Emitter<K, V>;
+};
+
+/*
+ * Base of a job whose reduce() turns the values of type V of a key of
+ * type K into one of type Out.
+ */
+template <typename K, typename V, typename Out>
+struct Reducer {
+    using ReduceKey = K;
+    using ReduceValue = V;
+    using Output = Out;
+    using Values = mapreduce::Values<V>;
+};
+
+// whether a job defines each optional function
+template <typename J, typename = void>
+struct has_combine : std::false_type {};
+template <typename J>
+struct has_combine<J, std::void_t<decltype(&J::combine)>>
+    : std::true_type {};
+
+template <typename J, typename = void>
+struct has_partition : std::false_type {};
+template <typename J>
+struct has_partition<J, std::void_t<decltype(&J::partition)>>
+    : std::true_type {};
+
+template <typename J, typename = void>
+struct has_compare_values : std::false_type {};
+template <typename J>
+struct has_compare_values<J, std::void_t<decltype(&J::compare_values)>>
+    : std::true_type {};
+
+template <typename J, typename = void>
+struct has_rank : std::false_type {};
+template <typename J>
+struct has_rank<J, std::void_t<decltype(&J::rank)>> : std::true_type {};
+
+/*
+ * The functions of the Job exported for J, each decoding what the engine
+ * passes and encoding what J returns.
+ */
+template <typename J>
+struct JobFunctions {
+    using K = typename J::ReduceKey;
+    using V = typename J::ReduceValue;
+    using Out = typename J::Output;
+
+    static_assert(std::is_same_v<typename J::MapKey, K> &&
+                  std::is_same_v<typename J::MapValue, V>,
+                  "map() must emit the key and value types reduce() takes");
+
+    static void map(const char *chunk, int outfd) {
+        typename J::Emitter out(outfd);
+        J::map(chunk, out);
+    }
+
+    static Pair reduce(const char *key, const LLValues *values) {
+        check_fits<Out, MAX_VALUE>();
+        Pair pair = {};
+        std::strncpy(pair.key, key, MAX_KEY);
+        Codec<Out>::encode(J::reduce(Codec<K>::decode(key), Values<V>(values)),
+                           pair.value, MAX_VALUE);
+        return pair;
+    }
+
+    static Pair combine(const char *key, const LLValues *values) {
+        Pair pair = {};
+        std::strncpy(pair.key, key, MAX_KEY);
+        Codec<V>::encode(J::combine(Codec<K>::decode(key), Values<V>(values)),
+                         pair.value, MAX_VALUE);
+        return pair;
+    }
+
+    static unsigned int partition(const char *key, int npartitions) {
+        return J::partition(Codec<K>::decode(key), npartitions);
+    }
+
+    static int compare_values(const char *a, const char *b) {
+        return J::compare_values(Codec<V>::decode(a), Codec<V>::decode(b));
+    }
+
+    static int rank(const Pair *a, const Pair *b) {
+        Out value_a = Codec<Out>::decode(a->value);
+        Out value_b = Codec<Out>::decode(b->value);
+        if constexpr (has_rank<J>::value) {
+            return J::rank(value_a, value_b);
+        } else {
+            return value_a > value_b ? -1 : (value_a < value_b ? 1 : 0);
+        }
+    }
+};
+
+/*
+ * Returns the Job of J, with the optional functions J does not define
+ * left NULL, except rank() for numeric results.
+ */
+template <typename J>
+constexpr Job make_job() {
+    using Functions = JobFunctions<J>;
+    Job job = {};
+    job.abi_version = JOB_ABI_VERSION;
+    job.map = Functions::map;
+    job.reduce = Functions::reduce;
+    if constexpr (has_combine<J>::value) {
+        job.combine = Functions::combine;
+    }
+    if constexpr (has_partition<J>::value) {
+        job.partition = Functions::partition;
+    }
+    if constexpr (has_compare_values<J>::value) {
+        job.compare_values = Functions::compare_values;
+    }
+    if constexpr (has_rank<J>::value ||
+                  std::is_arithmetic_v<typename Functions::Out>) {
+        job.rank = Functions::rank;
+    }
+    return job;
+}
+
+}
+
+/*
+ * Exports the Job of J as the mapreduce_job of the plugin.
+ */
+#define MAPREDUCE_JOB(J) \
+    extern "C" const Job mapreduce_job = mapreduce::make_job<J>();
+
+#endif
@@ -1,315 +1,2062 @@
 /*
  Master process orchestrates the execution of the Lister,
  Mapper and Reducer.
+
+ Master hands one map task (input file) at a time to each idle mapper,
+ stages the Pairs of the task until the mapper reports it done and only
+ then routes them to reducers. A mapper that dies has its task re-run
+ from the input still on disk, and a task that runs far longer than
+ its peers is speculatively re-run on an idle mapper. At most
+ STAGED_PAIRS of a task are held in memory, the rest waits in a spill
+ file, or in the work directory where the mapper persisted it. What was
+ routed stays there until the reducers are done, so a failed reducer is
+ restarted and fed its Pairs again from disk.
+
+ Whole tasks are staged because a reducer cannot take Pairs back: the
+ Pairs of an attempt that may still fail, or lose to a backup attempt,
+ must not reach it. Reducers still work while the input is mapped, a
+ task at a time, as each finished task is routed while the others are
+ mapped, so an input of many tasks keeps them busy from the first task.
+
+ A job without reducers skips the shuffle: mappers either write their
+ output files directly, or send the output of each task aggregated by
+ key, which master folds into one hash table and writes out at the end.
+ An approximate job is the same, with mappers sending a sketch of the
+ output of each task, which master merges.
+
+ For a broadcast join, master loads the small side into a table that
+ mappers inherit, and they keep only the Pairs that join with it.
+
+ For a top K query, every reducer writes the K best results of its
+ partition, and master merges them into the K best of the job.
 */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include "aggregate.h"
+#include "channel.h"
+#include "coordinator.h"
 #include "hash.h"
+#include "job.h"
+#include "join.h"
 #include "lister.h"
 #include "mapper.h"
 #include "mapreduce.h"
 #include "master.h"
+#include "pairqueue.h"
+#include "placement.h"
+#include "pool.h"
 #include "reducer.h"
+#include "stats.h"
+#include "topk.h"
+#include "trace.h"
 #include "utils.h"
 
-// global variable
-PipeSet master_pipes = {
-    .m = 0,
-    .r = 0,
-    .from_mapper = NULL,
-    .to_mapper = NULL,
-    .to_reducer = NULL
-};
+#define STAGED_PAIRS 1024   // Pairs staged in memory per mapper
+#define REPLAY_PAIRS 64     // Pairs read at once to feed a restarted reducer
+#define MANIFEST_SETTINGS_BYTES ((PATH_MAX + 32) * (MAX_STAGES + 1))
+                            // first line of the manifest, with every job
+
+// global variable
+PipeSet master_pipes = {
+    .m = 0,
+    .r = 0,
+    .from_mapper = NULL,
+    .to_mapper = NULL,
+    .to_reducer = NULL,
+    .from_reducer = NULL
+};
+
+// global variable
+TaskTable task_table = {
+    .ntasks = 0,
+    .ndone = 0,
+    .tasks = NULL,
+    .pack_bytes = 0,
+    .mappers = NULL,
+    .reducers = NULL,
+    .runs = NULL,
+    .nruns = 0,
+    .runs_capacity = 0,
+    .total_task_seconds = 0,
+    .manifest = NULL,
+    .shared_memory = 0,
+    .upstream = NULL,
+    .aggregate = NULL,
+    .sketch = NULL,
+    .lister = 0,
+    .progress = 0,
+    .started = 0,
+    .last_progress = 0,
+    .input_bytes = 0,
+    .done_bytes = 0,
+    .routed = 0
+};
+
+
+/*
+ * Returns the current time in seconds.
+ */
+static double now_seconds() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec + now.tv_usec / 1e6;
+}
+
+/*
+ * Closes every pipe master holds. Called in a freshly forked worker.
+ *
+ * @exit                1 if error
+ */
+static void close_master_pipes() {
+    for (int i = 0; i < master_pipes.m; i++) {
+        if (master_pipes.to_mapper[i] != -1) {
+            safe_close(master_pipes.to_mapper[i]);
+        }
+        if (master_pipes.from_mapper[i] != -1) {
+            safe_close(master_pipes.from_mapper[i]);
+        }
+    }
+    for (int i = 0; i < master_pipes.r; i++) {
+        if (master_pipes.to_reducer[i] != -1) {
+            safe_close(master_pipes.to_reducer[i]);
+        }
+        if (master_pipes.from_reducer[i] != -1) {
+            safe_close(master_pipes.from_reducer[i]);
+        }
+        Channel *channel = task_table.reducers[i].channel;
+        if (channel != NULL && channel->doorbell[READ_END] != -1) {
+            safe_close(channel->doorbell[READ_END]);
+            channel->doorbell[READ_END] = -1;
+        }
+        if (task_table.upstream != NULL &&
+            task_table.upstream[i].pid != -1) {
+            safe_close(task_table.upstream[i].fd);
+        }
+    }
+}
+
+/*
+ * Kills every worker and exits, the job cannot complete.
+ *
+ * @exit                1
+ */
+static void abort_job() {
+    for (int i = 0; i < master_pipes.m; i++) {
+        if (task_table.mappers[i].pid != -1) {
+            kill(task_table.mappers[i].pid, SIGKILL);
+        }
+    }
+    for (int i = 0; i < master_pipes.r; i++) {
+        if (task_table.reducers[i].pid != -1) {
+            kill(task_table.reducers[i].pid, SIGKILL);
+        }
+        if (task_table.upstream != NULL &&
+            task_table.upstream[i].pid != -1) {
+            kill(task_table.upstream[i].pid, SIGKILL);
+        }
+    }
+    // idle warm workers would never exit on their own
+    pool_kill();
+    while (waitpid(-1, NULL, 0) >= 0) {
+        // reap all killed workers
+    }
+    exit(1);
+}
+
+/*
+ * Waits for a worker to terminate and reports whether it succeeded.
+ *
+ * @param pid           worker to wait for
+ * @param role          "mapper" or "reducer", for the error message
+ * @return              1 if the worker exited with status 0, else 0
+ */
+static int reap_worker(pid_t pid, const char *role) {
+    if (worker_pool.active && pool_finish(pid)) {
+        // the warm worker is done with its role and waits for another
+        return 1;
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        return 0;
+    }
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        return 1;
+    }
+
+    if (WIFSIGNALED(status)) {
+        safe_fprintf(stderr, "master: %s %d killed by signal %d\n",
+                     role, pid, WTERMSIG(status));
+    } else {
+        safe_fprintf(stderr, "master: %s %d exited with status %d\n",
+                     role, pid, WEXITSTATUS(status));
+    }
+    return 0;
+}
+
+/*
+ * Adds a small file to the last task, packing them together, if the
+ * pack stays within task_table.pack_bytes.
+ *
+ * @param path          path of the file
+ * @param size          size of the file, -1 if unknown
+ * @exit                1 if error
+ * @return              1 if the file was packed, else 0
+ */
+static int pack_into_last_task(const char *path, long long size) {
+    if (task_table.pack_bytes == 0 || task_table.ntasks == 0 || size < 0) {
+        return 0;
+    }
+
+    MapTask *task = &task_table.tasks[task_table.ntasks - 1];
+    size_t length = task->pack != NULL ? strlen(task->pack) :
+                                         strlen(task->path) + 1;
+    if (task->size < 0 || task->size + size > task_table.pack_bytes ||
+        length + strlen(path) + 1 > PACK_REQUEST_BYTES) {
+        return 0;
+    }
+
+    if (task->pack == NULL) {
+        safe_malloc((void **) &(task->pack), PACK_REQUEST_BYTES + 1);
+        strcpy(task->pack, task->path);
+        strcat(task->pack, " ");
+    }
+    strcat(task->pack, path);
+    strcat(task->pack, " ");
+    task->nfiles++;
+    task->size += size;
+    return 1;
+}
+
+/**
+ * Reads filenames located at dirname from stdin (sent by lister)
+ * into the table of map tasks. If task_table.pack_bytes is set, runs of
+ * small files are packed into tasks of up to that many bytes.
+ *
+ * @param dirname                   directory containing the input files.
+ * @exit                            1 if error, or if the lister fails
+ */
+void read_map_tasks(char *dirname) {
+    int capacity = 16;
+    safe_malloc((void **) &(task_table.tasks), sizeof(MapTask) * capacity);
+
+    char filename[PATH_MAX];        // read filename
+    char path[PATH_MAX];
+    struct stat file_stat;
+
+    // Read file names from lister
+    while (scanf("%s", filename) != EOF) {
+        // a file that cannot be stat'ed fails when it is mapped
+        snprintf(path, PATH_MAX, "%s%s", dirname, filename);
+        int found = stat(path, &file_stat) == 0;
+        if (found && pack_into_last_task(path, file_stat.st_size)) {
+            continue;
+        }
+
+        if (task_table.ntasks == capacity) {
+            capacity *= 2;
+            safe_realloc((void **) &(task_table.tasks),
+                         sizeof(MapTask) * capacity);
+        }
+
+        MapTask *task = &task_table.tasks[task_table.ntasks++];
+        strcpy(task->path, path);
+        task->nfiles = 1;
+        task->pack = NULL;
+        task->attempts = 0;
+        task->running = 0;
+        task->done = 0;
+        task->output_id = task_table.ntasks - 1;
+        task->persisted = 0;
+
+        task->size = -1;
+        task->mtime = -1;
+        task->content_hash = 0;
+        if (found) {
+            task->size = file_stat.st_size;
+            task->mtime = file_stat.st_mtim.tv_sec * 1000000000LL +
+                          file_stat.st_mtim.tv_nsec;
+        }
+    }
+
+    // the lister is done once its output ends, and a listing that failed
+    // would map only part of the input, or none of it
+    if (!reap_worker(task_table.lister, "lister")) {
+        safe_fprintf(stderr, "Error listing the files of %s\n", dirname);
+        pool_kill();
+        exit(1);
+    }
+}
+
+/*
+ * Writes the manifest line of a task with persisted output.
+ *
+ * @param manifest      manifest to write to
+ * @param task          task whose output is persisted
+ * @exit                1 if error
+ */
+static void write_manifest_entry(FILE *manifest, const MapTask *task) {
+    safe_fprintf(manifest, "%d %lld %lld %016llx %s\n", task->output_id,
+                 task->size, task->mtime, task->content_hash, task->path);
+}
+
+/*
+ * Writes the line heading the manifest: whether map output is combined
+ * and the jobs that map the input, each with the hash of its plugin, or
+ * of the binary for the job linked into it. Output persisted by a run
+ * with another line was made by another job or setting.
+ *
+ * @param settings      where to write the line, MANIFEST_SETTINGS_BYTES
+ * @param logistics     settings of the job
+ */
+static void manifest_settings(char *settings,
+                              const MapReduceLogistics *logistics) {
+    int length = snprintf(settings, MANIFEST_SETTINGS_BYTES,
+                          "settings combine=%d", logistics->combine);
+    if (logistics->njobs == 0) {
+        length += snprintf(settings + length, MANIFEST_SETTINGS_BYTES - length,
+                           " linked:%016llx", hash_file("/proc/self/exe"));
+    }
+    for (int j = 0; j < logistics->njobs; j++) {
+        length += snprintf(settings + length, MANIFEST_SETTINGS_BYTES - length,
+                           " %s:%016llx", logistics->jobs[j],
+                           hash_file(logistics->jobs[j]));
+    }
+    snprintf(settings + length, MANIFEST_SETTINGS_BYTES - length, "\n");
+}
+
+/**
+ * Opens the manifest of persisted map output in workdir. The first line
+ * of the manifest records the jobs and combine setting the output was
+ * made with (see manifest_settings()), and every other line is
+ * "output_id size mtime content_hash path" for a task whose output was
+ * persisted.
+ *
+ * When resuming with the same jobs and combine setting, a task whose
+ * input file has the size and modification time recorded in the
+ * manifest, or else the same content hash, reuses the persisted output.
+ * The manifest is rewritten with just those entries, and the output of
+ * changed or deleted files is removed. With other jobs or setting, every
+ * entry is removed and all of the input is mapped again.
+ *
+ * @param logistics                 settings of the job, with the work
+ *                                  directory and whether to resume
+ * @exit                            1 if error
+ */
+void open_manifest(const MapReduceLogistics *logistics) {
+    const char *workdir = logistics->workdir;
+    if (mkdir(workdir, 0755) != 0 && errno != EEXIST) {
+        safe_fprintf(stderr, "Error creating work directory %s\n", workdir);
+        exit(1);
+    }
+
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 8];
+    snprintf(path, PATH_MAX, "%s/%s", workdir, MANIFEST_NAME);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    char *settings;
+    safe_malloc((void **) &settings, MANIFEST_SETTINGS_BYTES);
+    manifest_settings(settings, logistics);
+
+    FILE *previous = logistics->resume ? fopen(path, "r") : NULL;
+    task_table.manifest = safe_fopen(tmp_path, "w");
+    safe_fprintf(task_table.manifest, "%s", settings);
+
+    if (previous != NULL) {
+        // a manifest without the line is older, its output is not reused
+        char *previous_settings;
+        safe_malloc((void **) &previous_settings, MANIFEST_SETTINGS_BYTES);
+        int same_settings = 0;
+        if (fgets(previous_settings, MANIFEST_SETTINGS_BYTES, previous) !=
+            NULL) {
+            if (strncmp(previous_settings, "settings ", 9) == 0) {
+                same_settings = strcmp(previous_settings, settings) == 0;
+            } else {
+                rewind(previous);
+            }
+        }
+        free(previous_settings);
+
+        int next_id = task_table.ntasks;
+        int output_id;
+        long long size;
+        long long mtime;
+        unsigned long long content_hash;
+        char task_path[PATH_MAX];
+
+        while (fscanf(previous, "%d %lld %lld %llx %s", &output_id, &size,
+                      &mtime, &content_hash, task_path) == 5) {
+            if (output_id >= next_id) {
+                next_id = output_id + 1;
+            }
+
+            MapTask *task = NULL;
+            for (int t = 0; t < task_table.ntasks; t++) {
+                if (strcmp(task_table.tasks[t].path, task_path) == 0) {
+                    task = &task_table.tasks[t];
+                }
+            }
+
+            // only hash contents when the file was touched
+            if (same_settings && task != NULL && !task->persisted &&
+                task->size == size &&
+                (task->mtime == mtime ||
+                 hash_file(task->path) == content_hash)) {
+                task->output_id = output_id;
+                task->persisted = 1;
+                task->content_hash = content_hash;
+                write_manifest_entry(task_table.manifest, task);
+            } else {
+                char output_path[PATH_MAX];
+                map_output_path(output_path, output_id);
+                unlink(output_path);
+            }
+        }
+        safe_fclose(previous);
+
+        // new output must not overwrite output of the previous run
+        for (int t = 0; t < task_table.ntasks; t++) {
+            if (!task_table.tasks[t].persisted) {
+                task_table.tasks[t].output_id = next_id++;
+            }
+        }
+    }
+
+    free(settings);
+    fflush(task_table.manifest);
+    if (rename(tmp_path, path) != 0) {
+        safe_fprintf(stderr, "Error renaming %s\n", tmp_path);
+        exit(1);
+    }
+}
+
+/*
+ * Records in the manifest that the output of a task is persisted.
+ *
+ * @param task          task whose output was committed
+ * @exit                1 if error
+ */
+static void record_in_manifest(MapTask *task) {
+    if (task_table.manifest == NULL || task->persisted) {
+        return;
+    }
+
+    write_manifest_entry(task_table.manifest, task);
+    fflush(task_table.manifest);
+    fsync(fileno(task_table.manifest));
+}
+
+/*
+ * Chooses the task for an idle mapper: a task that is not running, or
+ * else a running task that is a straggler and has no backup yet.
+ *
+ * @return              task index, or -1 if there is nothing to run
+ */
+static int choose_map_task() {
+    for (int t = 0; t < task_table.ntasks; t++) {
+        MapTask *task = &task_table.tasks[t];
+        if (!task->done && task->running == 0) {
+            return t;
+        }
+    }
+
+    // every task has started, look for stragglers
+    if (task_table.ndone == 0) {
+        return -1;
+    }
+    double mean = task_table.total_task_seconds / task_table.ndone;
+    double now = now_seconds();
+    for (int i = 0; i < master_pipes.m; i++) {
+        MapSlot *slot = &task_table.mappers[i];
+        if (slot->task == -1 || slot->committing) {
+            continue;
+        }
+
+        MapTask *task = &task_table.tasks[slot->task];
+        double elapsed = now - slot->started;
+        if (task->running == 1 && task->attempts < MAX_TASK_ATTEMPTS &&
+            elapsed > SPECULATE_MIN_SECONDS &&
+            elapsed > SPECULATE_FACTOR * mean) {
+            return slot->task;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Sends a task to the idle mapper in slot i.
+ *
+ * @param i             mapper slot
+ * @param t             task index
+ * @exit                1 if error
+ */
+static void assign_map_task(int i, int t) {
+    MapTask *task = &task_table.tasks[t];
+    MapSlot *slot = &task_table.mappers[i];
+
+    char request[PATH_MAX + 32];
+    int length;
+    if (task->pack != NULL) {
+        length = snprintf(request, sizeof(request), "%c %d %d %s", TASK_PACK,
+                          task->output_id, task->nfiles, task->pack);
+    } else {
+        length = snprintf(request, sizeof(request), "%c %d %s ",
+                          TASK_MAP, task->output_id, task->path);
+    }
+    // a mapper that died idle is handled once its pipe reads end of file
+    safe_write_nonblocking(master_pipes.to_mapper[i], request, length);
+
+    task->attempts++;
+    task->running++;
+    slot->task = t;
+    slot->started = now_seconds();
+    slot->staged_bytes = 0;
+    slot->nspilled = 0;
+}
+
+/*
+ * Closes master's pipes to the mapper in slot i and empties the slot.
+ *
+ * @param i             mapper slot
+ * @exit                1 if error
+ */
+static void release_mapper(int i) {
+    MapSlot *slot = &task_table.mappers[i];
+
+    if (master_pipes.to_mapper[i] != -1) {
+        safe_close(master_pipes.to_mapper[i]);
+        master_pipes.to_mapper[i] = -1;
+    }
+    safe_close(master_pipes.from_mapper[i]);
+    master_pipes.from_mapper[i] = -1;
+
+    if (slot->task != -1) {
+        task_table.tasks[slot->task].running--;
+    }
+    slot->pid = -1;
+    slot->task = -1;
+    slot->staged_bytes = 0;
+    slot->nspilled = 0;
+    slot->committing = 0;
+}
+
+/*
+ * Removes the partial output file of a failed attempt of a task of a
+ * job without reducers.
+ *
+ * @param pid           mapper that ran the attempt
+ * @param t             task of the attempt
+ */
+static void discard_partial_output(pid_t pid, int t) {
+    if (!map_settings.map_only) {
+        return;
+    }
+
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 32];
+    map_only_output_path(path, task_table.tasks[t].output_id);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, pid);
+    unlink(tmp_path);
+}
+
+/*
+ * Handles a mapper that closed its pipe. This is normal once master has
+ * no more tasks for it, otherwise its task is given back to the table.
+ *
+ * @param i             mapper slot
+ * @exit                1 if the task failed too many times
+ */
+static void end_mapper(int i) {
+    MapSlot *slot = &task_table.mappers[i];
+    int finished = (master_pipes.to_mapper[i] == -1 && slot->task == -1);
+    int succeeded = reap_worker(slot->pid, "mapper");
+
+    if (finished && succeeded) {
+        release_mapper(i);
+        return;
+    }
+
+    int t = slot->task;
+    pid_t pid = slot->pid;
+    release_mapper(i);
+
+    if (t != -1) {
+        discard_partial_output(pid, t);
+        MapTask *task = &task_table.tasks[t];
+        safe_fprintf(stderr, "master: map task %s failed (attempt %d)\n",
+                     task->path, task->attempts);
+        if (!task->done && task->running == 0 &&
+            task->attempts >= MAX_TASK_ATTEMPTS) {
+            safe_fprintf(stderr, "master: giving up on %s\n", task->path);
+            abort_job();
+        }
+    }
+}
+
+/*
+ * Kills the other attempts of a task whose output was committed.
+ *
+ * @param t             committed task
+ * @exit                1 if error
+ */
+static void kill_backup_attempts(int t) {
+    for (int i = 0; i < master_pipes.m; i++) {
+        MapSlot *slot = &task_table.mappers[i];
+        if (slot->task == t && !slot->committing) {
+            kill(slot->pid, SIGKILL);
+            if (worker_pool.active) {
+                // the killed worker leaves the pool
+                pool_finish(slot->pid);
+            }
+            waitpid(slot->pid, NULL, 0);
+            discard_partial_output(slot->pid, t);
+            release_mapper(i);
+        }
+    }
+}
+
+/*
+ * Writes Pairs to a file at offset.
+ *
+ * @param fd            file to write to
+ * @param pairs         Pairs to write
+ * @param npairs        number of Pairs
+ * @param offset        where the first Pair goes
+ * @exit                1 if error
+ */
+static void write_pairs_at(int fd, const Pair *pairs, size_t npairs,
+                           off_t offset) {
+    const char *bytes = (const char *) pairs;
+    size_t nbytes = sizeof(Pair) * npairs;
+    while (nbytes > 0) {
+        ssize_t nwritten = pwrite(fd, bytes, nbytes, offset);
+        if (nwritten == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pwrite");
+            exit(1);
+        }
+        bytes += nwritten;
+        nbytes -= nwritten;
+        offset += nwritten;
+    }
+}
+
+/*
+ * Reads Pairs of a run back from disk.
+ *
+ * @param run           run to read
+ * @param from          index in the run of the first Pair to read
+ * @param pairs         buffer of npairs Pairs
+ * @param npairs        number of Pairs
+ * @exit                1 if error
+ */
+static void read_run(const RoutedRun *run, size_t from, Pair *pairs,
+                     size_t npairs) {
+    int fd = run->fd;
+    if (fd == -1) {
+        char path[PATH_MAX];
+        map_output_path(path, run->output_id);
+        fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            perror(path);
+            exit(1);
+        }
+    }
+
+    ssize_t nread = pread(fd, pairs, sizeof(Pair) * npairs,
+                          run->offset + (off_t) (sizeof(Pair) * from));
+    if (nread != (ssize_t) (sizeof(Pair) * npairs)) {
+        safe_fprintf(stderr, "Error reading routed Pairs back\n");
+        exit(1);
+    }
+
+    if (run->fd == -1) {
+        safe_close(fd);
+    }
+}
+
+/*
+ * Adds a run to the runs of the current stage, with nothing routed yet.
+ *
+ * @param fd            file holding the Pairs, -1 for persisted output
+ * @param output_id     id of the persisted output, if fd is -1
+ * @param offset        where the Pairs start in the file
+ * @param npairs        number of Pairs
+ * @exit                1 if error
+ * @return              index of the run
+ */
+static int add_run(int fd, int output_id, off_t offset, size_t npairs) {
+    if (task_table.nruns == task_table.runs_capacity) {
+        task_table.runs_capacity = task_table.runs_capacity == 0 ?
+                                   task_table.ntasks + 1 :
+                                   task_table.runs_capacity * 2;
+        safe_realloc((void **) &(task_table.runs),
+                     sizeof(RoutedRun) * task_table.runs_capacity);
+    }
+
+    RoutedRun *run = &task_table.runs[task_table.nruns];
+    run->fd = fd;
+    run->output_id = output_id;
+    run->offset = offset;
+    run->npairs = npairs;
+    run->nrouted = 0;
+    return task_table.nruns++;
+}
+
+/*
+ * Forgets the runs of a stage whose reducers are done, closing the spill
+ * files that held them.
+ *
+ * @exit                1 if error
+ */
+static void discard_runs() {
+    task_table.nruns = 0;
+    for (int i = 0; i < master_pipes.m; i++) {
+        if (task_table.mappers[i].spill != NULL) {
+            safe_fclose(task_table.mappers[i].spill);
+            task_table.mappers[i].spill = NULL;
+        }
+    }
+    for (int i = 0; task_table.upstream != NULL && i < master_pipes.r; i++) {
+        if (task_table.upstream[i].spill != NULL) {
+            safe_fclose(task_table.upstream[i].spill);
+            task_table.upstream[i].spill = NULL;
+        }
+    }
+}
+
+/*
+ * Adds the output a mapper persisted in the work directory as a run. Its
+ * Pairs follow the header and the counts of its partitions.
+ *
+ * @param output_id     id master gave the task output
+ * @exit                1 if error
+ * @return              index of the run
+ */
+static int add_persisted_run(int output_id) {
+    char path[PATH_MAX];
+    map_output_path(path, output_id);
+
+    FILE *fin = safe_fopen(path, "rb");
+    MapOutputHeader header;
+    if (safe_fread(&header, sizeof(MapOutputHeader), 1, fin) != 1 ||
+        strncmp(header.magic, MAP_OUTPUT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.npartitions <= 0) {
+        safe_fprintf(stderr, "%s is not a map output file\n", path);
+        exit(1);
+    }
+    int *counts;
+    safe_malloc((void **) &counts, sizeof(int) * header.npartitions);
+    if (safe_fread(counts, sizeof(int), header.npartitions, fin) !=
+        (size_t) header.npartitions) {
+        safe_fprintf(stderr, "%s is not a map output file\n", path);
+        exit(1);
+    }
+    safe_fclose(fin);
+
+    size_t npairs = 0;
+    for (int p = 0; p < header.npartitions; p++) {
+        npairs += counts[p];
+    }
+    free(counts);
+    return add_run(-1, output_id, sizeof(MapOutputHeader) +
+                   sizeof(int) * header.npartitions, npairs);
+}
+
+/*
+ * Routes the output a previous run persisted for a task from the idle
+ * mapper slot i. The task needs no mapper, the slot only holds the
+ * window of the run while it is routed.
+ *
+ * @param i             mapper slot
+ * @param t             task index
+ * @exit                1 if error
+ */
+static void commit_persisted(int i, int t) {
+    MapTask *task = &task_table.tasks[t];
+    MapSlot *slot = &task_table.mappers[i];
+
+    task->attempts++;
+    task->running++;
+    task->done = 1;
+    task_table.ndone++;
+    if (task->size > 0) {
+        task_table.done_bytes += task->size;
+    }
+
+    slot->task = t;
+    slot->started = now_seconds();
+    slot->run = add_persisted_run(task->output_id);
+    slot->staged_bytes = 0;
+    slot->nspilled = 0;
+    slot->window = 0;
+    slot->committing = 1;
+}
+
+/*
+ * Empties the full staging buffer of a mapper into the spill file of its
+ * slot. With a work directory the mapper persisted the output before
+ * sending it, so the Pairs are only counted and read back from there.
+ *
+ * @param slot          mapper slot
+ * @exit                1 if error
+ */
+static void spill_staged(MapSlot *slot) {
+    size_t nstaged = slot->staged_bytes / sizeof(Pair);
+    if (map_settings.workdir == NULL) {
+        write_pairs_at(fileno(slot->spill), slot->staged, nstaged,
+                       slot->spill_end +
+                       (off_t) (sizeof(Pair) * slot->nspilled));
+    }
+    slot->nspilled += nstaged;
+    slot->staged_bytes = 0;
+}
+
+/*
+ * Reads what the mapper in slot i sent into its staging buffer, which is
+ * spilled whenever it is full. When the task is finished, its Pairs are
+ * made a run and queued for commit.
+ *
+ * @param i             mapper slot
+ * @exit                1 if error
+ */
+static void read_mapper(int i) {
+    MapSlot *slot = &task_table.mappers[i];
+
+    ssize_t read_result = safe_read(
+                                master_pipes.from_mapper[i],
+                                (char *) slot->staged + slot->staged_bytes,
+                                sizeof(Pair) * STAGED_PAIRS -
+                                                        slot->staged_bytes);
+    if (read_result == 0) {
+        end_mapper(i);
+        return;
+    }
+    slot->staged_bytes += read_result;
+
+    // the mapper sends nothing after the done marker of its task
+    size_t nstaged = slot->staged_bytes / sizeof(Pair);
+    if (slot->task == -1 || nstaged == 0 ||
+        slot->staged_bytes % sizeof(Pair) != 0 ||
+        !is_task_done_marker(&slot->staged[nstaged - 1])) {
+        if (slot->staged_bytes == sizeof(Pair) * STAGED_PAIRS) {
+            spill_staged(slot);
+        }
+        return;
+    }
+
+    int t = slot->task;
+    MapTask *task = &task_table.tasks[t];
+    if (task->done) {
+        // another attempt was committed first, drop this output
+        task->running--;
+        slot->task = -1;
+        slot->staged_bytes = 0;
+        slot->nspilled = 0;
+        return;
+    }
+
+    task->done = 1;
+    task_table.ndone++;
+    if (task->size > 0) {
+        task_table.done_bytes += task->size;
+    }
+    task_done_marker_hash(&slot->staged[nstaged - 1], &task->content_hash);
+    record_in_manifest(task);
+    task_table.total_task_seconds += now_seconds() - slot->started;
+
+    // the Pairs still staged are routed from memory, the rest from disk
+    nstaged--;
+    size_t npairs = slot->nspilled + nstaged;
+    if (map_settings.workdir != NULL) {
+        slot->run = add_persisted_run(task->output_id);
+    } else {
+        // without reducers nothing is replayed, so what fits in memory
+        // is not written out
+        if (master_pipes.r > 0 || slot->nspilled > 0) {
+            write_pairs_at(fileno(slot->spill), slot->staged, nstaged,
+                           slot->spill_end +
+                           (off_t) (sizeof(Pair) * slot->nspilled));
+        }
+        slot->run = add_run(fileno(slot->spill), -1, slot->spill_end, npairs);
+        slot->spill_end += sizeof(Pair) * npairs;
+    }
+    slot->staged_bytes = slot->nspilled == 0 ? sizeof(Pair) * nstaged : 0;
+    slot->window = 0;
+    slot->committing = 1;
+    kill_backup_attempts(t);
+}
+
+/*
+ * Prints one line of progress on stderr, at most every PROGRESS_SECONDS:
+ * the share of the input mapped with throughput and estimated time left,
+ * Pairs routed and reduced, the phase of every worker as a letter (see
+ * stats.c), and the map task running longest, to spot stuck workers.
+ *
+ * @exit                1 if error
+ */
+static void report_progress() {
+    double now = now_seconds();
+    if (!task_table.progress ||
+        now - task_table.last_progress < PROGRESS_SECONDS) {
+        return;
+    }
+    task_table.last_progress = now;
+
+    char mappers[master_pipes.m + 1];
+    long long mapped = task_table.done_bytes;
+    int slowest = -1;
+    for (int i = 0; i < master_pipes.m; i++) {
+        MapSlot *slot = &task_table.mappers[i];
+        WorkerStats *stats = stats_of_mapper(i);
+        mappers[i] = slot->pid == -1 ? ' ' : stats_phase_letter(
+                            __atomic_load_n(&stats->phase, __ATOMIC_RELAXED));
+        if (slot->task != -1 && !slot->committing) {
+            mapped += __atomic_load_n(&stats->task_bytes, __ATOMIC_RELAXED);
+            if (slowest == -1 ||
+                slot->started < task_table.mappers[slowest].started) {
+                slowest = i;
+            }
+        }
+    }
+    mappers[master_pipes.m] = '\0';
+
+    char reducers[master_pipes.r + 1];
+    unsigned long long reduced = 0;
+    for (int i = 0; i < master_pipes.r; i++) {
+        WorkerStats *stats = stats_of_reducer(i);
+        reducers[i] = stats_phase_letter(
+                            __atomic_load_n(&stats->phase, __ATOMIC_RELAXED));
+        reduced += __atomic_load_n(&stats->results, __ATOMIC_RELAXED);
+    }
+    reducers[master_pipes.r] = '\0';
+
+    if (mapped > task_table.input_bytes) {
+        mapped = task_table.input_bytes;
+    }
+    double elapsed = now - task_table.started;
+    double share = task_table.input_bytes > 0 ?
+                   (double) mapped / task_table.input_bytes : 1;
+    double eta = share > 0 ? elapsed * (1 - share) / share : 0;
+
+    safe_fprintf(stderr, "progress: %.0f%% of %.1f MB mapped, %.1f MB/s, "
+                 "eta %.0fs, %d/%d tasks, %llu pairs routed, %llu reduced, "
+                 "mappers [%s] reducers [%s]", share * 100,
+                 task_table.input_bytes / 1e6, mapped / 1e6 / elapsed, eta,
+                 task_table.ndone, task_table.ntasks, task_table.routed,
+                 reduced, mappers, reducers);
+    if (slowest != -1) {
+        safe_fprintf(stderr, ", mapper %d on %s for %.1fs", slowest,
+                     task_table.tasks[task_table.mappers[slowest].task].path,
+                     now - task_table.mappers[slowest].started);
+    }
+    safe_fprintf(stderr, "\n");
+}
+
+/*
+ * Waits for a worker to exit without reaping it, reporting progress
+ * meanwhile. Returns at once if progress is not reported.
+ *
+ * @param pid           worker to wait for
+ * @exit                1 if error
+ */
+static void await_worker(pid_t pid) {
+    while (task_table.progress) {
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == -1 ||
+            info.si_pid != 0) {
+            return;
+        }
+        report_progress();
+        usleep(POLL_SECONDS * 1000000);
+    }
+}
+
+/*
+ * Returns 1 if one more Pair can be routed to a reducer, else 0.
+ * A full channel is asked to ring its doorbell once it has room.
+ *
+ * @param reducer       reducer to route to
+ * @exit                1 if error
+ */
+static int reducer_has_room(ReduceSlot *reducer) {
+    if (reducer->channel != NULL) {
+        return channel_has_room(reducer->channel, ENCODED_PAIR_MAX) ||
+               channel_wait_for_room(reducer->channel, ENCODED_PAIR_MAX);
+    }
+    return reducer->replay_run == -1 &&
+           pair_queue_has_room_for(&reducer->queue, ENCODED_PAIR_MAX);
+}
+
+/*
+ * Routes a Pair to the queue or channel of its reducer, if the reducer
+ * has room.
+ *
+ * @param pair          Pair to route
+ * @exit                1 if error
+ * @return              1 if the Pair was routed, 0 if the reducer is full
+ */
+static int route_pair(const Pair *pair) {
+    int partition = job_partition(pair->key, master_pipes.r);
+    ReduceSlot *reducer = &task_table.reducers[partition];
+    if (!reducer_has_room(reducer)) {
+        return 0;
+    }
+
+    char record[ENCODED_PAIR_MAX];
+    size_t length = key_encoder_encode(&reducer->encoder, pair, record);
+    if (reducer->channel != NULL) {
+        channel_push(reducer->channel, record, length);
+    } else {
+        pair_queue_push_bytes(&reducer->queue, record, length);
+    }
+    task_table.routed++;
+    return 1;
+}
+
+/*
+ * Routes the Pairs of a finished task to reducer queues, as far as the
+ * queues have room, reading them back a window at a time if the task was
+ * spilled. The run keeps them for restarted reducers.
+ *
+ * @param i             mapper slot
+ * @exit                1 if error
+ */
+static void commit_staged(int i) {
+    MapSlot *slot = &task_table.mappers[i];
+    RoutedRun *run = &task_table.runs[slot->run];
+    TRACE_BEGIN(started);
+
+    if (task_table.sketch != NULL) {
+        // no reducers, the Pairs are a sketch of the output of the task
+        Pair *pairs = slot->staged;
+        if (slot->staged_bytes < sizeof(Pair) * run->npairs) {
+            safe_malloc((void **) &pairs, sizeof(Pair) * run->npairs);
+            read_run(run, 0, pairs, run->npairs);
+        }
+        sketch_merge_pairs(task_table.sketch, pairs, run->npairs);
+        if (pairs != slot->staged) {
+            free(pairs);
+        }
+        run->nrouted = run->npairs;
+        task_table.routed += run->npairs;
+    }
+
+    while (run->nrouted < run->npairs) {
+        size_t nstaged = slot->staged_bytes / sizeof(Pair);
+        if (run->nrouted == slot->window + nstaged) {
+            // the task did not fit in memory, read its next window back
+            nstaged = run->npairs - run->nrouted;
+            if (nstaged > STAGED_PAIRS) {
+                nstaged = STAGED_PAIRS;
+            }
+            read_run(run, run->nrouted, slot->staged, nstaged);
+            slot->window = run->nrouted;
+            slot->staged_bytes = sizeof(Pair) * nstaged;
+        }
+
+        const Pair *pair = &slot->staged[run->nrouted - slot->window];
+        if (task_table.aggregate != NULL) {
+            // no reducers, fold the Pair into the results of the job
+            aggregate_add(task_table.aggregate, pair);
+            task_table.routed++;
+        } else if (!route_pair(pair)) {
+            // back-pressure, wait for the reducer to drain
+            TRACE_END(TRACE_ROUTE, started);
+            return;
+        }
+        run->nrouted++;
+    }
+
+    TRACE_END(TRACE_ROUTE, started);
+
+    if (master_pipes.r == 0) {
+        // nothing is replayed without reducers, reuse the spill file
+        slot->spill_end = run->offset;
+    }
+
+    // task fully routed, the mapper becomes idle
+    task_table.tasks[slot->task].running--;
+    slot->task = -1;
+    slot->staged_bytes = 0;
+    slot->nspilled = 0;
+    slot->committing = 0;
+}
+
+/*
+ * Refills the queue of a restarted reducer with its Pairs of every run,
+ * up to what each run routed so far. The reducer has no room until the
+ * replay ends, so no Pair of the reducer is routed past that meanwhile.
+ *
+ * @param i             reducer slot
+ * @exit                1 if error
+ */
+static void replay_runs(int i) {
+    ReduceSlot *reducer = &task_table.reducers[i];
+    Pair pairs[REPLAY_PAIRS];
+    char record[ENCODED_PAIR_MAX];
+
+    while (reducer->replay_run < task_table.nruns) {
+        RoutedRun *run = &task_table.runs[reducer->replay_run];
+        size_t npairs = run->nrouted - reducer->replay_cursor;
+        if (npairs == 0) {
+            reducer->replay_run++;
+            reducer->replay_cursor = 0;
+            continue;
+        }
+        if (npairs > REPLAY_PAIRS) {
+            npairs = REPLAY_PAIRS;
+        }
+
+        read_run(run, reducer->replay_cursor, pairs, npairs);
+        for (size_t p = 0; p < npairs; p++) {
+            if (job_partition(pairs[p].key, master_pipes.r) == i) {
+                if (!pair_queue_has_room_for(&reducer->queue,
+                                             ENCODED_PAIR_MAX)) {
+                    return;
+                }
+                size_t length = key_encoder_encode(&reducer->encoder,
+                                                   &pairs[p], record);
+                pair_queue_push_bytes(&reducer->queue, record, length);
+            }
+            reducer->replay_cursor++;
+        }
+    }
+
+    reducer->replay_run = -1;
+}
+
+/*
+ * Writes a restarted reducer its Pairs of every run with blocking
+ * writes, once nothing more is routed.
+ *
+ * @param i             reducer slot
+ * @exit                1 if error
+ */
+static void resend_runs(int i) {
+    ReduceSlot *reducer = &task_table.reducers[i];
+    Pair pairs[REPLAY_PAIRS];
+    char record[ENCODED_PAIR_MAX];
+
+    for (int n = 0; n < task_table.nruns; n++) {
+        RoutedRun *run = &task_table.runs[n];
+        for (size_t from = 0; from < run->nrouted; from += REPLAY_PAIRS) {
+            size_t npairs = run->nrouted - from;
+            if (npairs > REPLAY_PAIRS) {
+                npairs = REPLAY_PAIRS;
+            }
+            read_run(run, from, pairs, npairs);
+            for (size_t p = 0; p < npairs; p++) {
+                if (job_partition(pairs[p].key, master_pipes.r) == i) {
+                    size_t length = key_encoder_encode(&reducer->encoder,
+                                                       &pairs[p], record);
+                    safe_write(master_pipes.to_reducer[i], record, length);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Replaces a failed reducer with a new one that is fed its Pairs again.
+ *
+ * @param i             reducer slot
+ * @exit                1 if the reducer failed too many times
+ */
+static void restart_reducer(int i) {
+    ReduceSlot *reducer = &task_table.reducers[i];
+
+    kill(reducer->pid, SIGKILL);
+    reap_worker(reducer->pid, "reducer");
+    if (master_pipes.to_reducer[i] != -1) {
+        safe_close(master_pipes.to_reducer[i]);
+        master_pipes.to_reducer[i] = -1;
+    }
+    if (master_pipes.from_reducer[i] != -1) {
+        safe_close(master_pipes.from_reducer[i]);
+        master_pipes.from_reducer[i] = -1;
+    }
+    if (reducer->channel != NULL) {
+        channel_free(reducer->channel);
+        reducer->channel = NULL;
+    }
+
+    // remove any output the failed reducer left behind
+    char filename[MAX_FILENAME] = "";
+    sprintf(filename, "[%d].out", reducer->pid);
+    unlink(filename);
 
+    if (reducer->attempts >= MAX_TASK_ATTEMPTS) {
+        safe_fprintf(stderr, "master: giving up on reducer %d\n", i);
+        reducer->pid = -1;
+        abort_job();
+    }
 
+    safe_fprintf(stderr, "master: restarting reducer %d\n", i);
+    spawn_reducer(i);
+    safe_set_nonblocking(master_pipes.to_reducer[i]);
+    reducer->queue.head = 0;
+    reducer->queue.length = 0;
+    reducer->replay_run = 0;
+    reducer->replay_cursor = 0;
+}
 
-/**
- * Reads filenames located at dirname from stdin (sent by lister)
- * and distributes them evenly to mappers.
+/*
+ * Publishes Pairs pushed to reducer channels and refills the queues of
+ * restarted reducers from the runs.
  *
- * @param dirname                   directory containing the input files.
- * @exit                            1 if error
+ * @exit                1 if error
+ * @return              1 if any reducer has Pairs waiting in master
  */
-void distribute_files(char *dirname) {
-    int m = master_pipes.m;
-
-    int current_worker = 0;         // index of map worker to assign
+static int feed_reducers() {
+    int queued = 0;
+    for (int i = 0; i < master_pipes.r; i++) {
+        ReduceSlot *reducer = &task_table.reducers[i];
+        if (reducer->channel != NULL) {
+            channel_publish(reducer->channel);
+        }
+        if (reducer->replay_run != -1) {
+            replay_runs(i);
+        }
+        if (!pair_queue_is_empty(&reducer->queue) ||
+            reducer->replay_run != -1) {
+            queued = 1;
+        }
+    }
+    return queued;
+}
 
-    char filename[MAX_FILENAME];    // read filename
+/*
+ * Adds the reducers master waits on to the fdsets: the doorbells of
+ * channels, readable when rung or when the reducer dies, and the pipes
+ * of reducers with queued Pairs.
+ *
+ * @param read_set      fdset to add doorbells to
+ * @param write_set     fdset to add pipes to
+ */
+static void watch_reducers(fd_set *read_set, fd_set *write_set) {
+    for (int i = 0; i < master_pipes.r; i++) {
+        ReduceSlot *reducer = &task_table.reducers[i];
+        if (reducer->channel != NULL) {
+            FD_SET(reducer->channel->doorbell[READ_END], read_set);
+        } else if (!pair_queue_is_empty(&reducer->queue)) {
+            FD_SET(master_pipes.to_reducer[i], write_set);
+        }
+    }
+}
 
-    // Read file names from lister
-    // Send to map workers uniformly
-    while (scanf("%s", filename) != EOF) {
-        // Send to mapper
-        safe_write(
-            master_pipes.to_mapper[current_worker],
-            dirname,
-            strlen(dirname) * sizeof(char)
-        );
-        safe_write(
-            master_pipes.to_mapper[current_worker],
-            filename,
-            strlen(filename) * sizeof(char)
-        );
-        safe_write(master_pipes.to_mapper[current_worker], " ", sizeof(char));
-
-        // Distribute uniformly
-        current_worker++;
-        if (current_worker + 1 > m) {
-            current_worker = 0;
-        }
-    }
-    // all files have been given to mappers
-    // close all to mapper pipes
-    for (int i = 0; i < m; i++) {
-        safe_close(master_pipes.to_mapper[i]);
+/*
+ * Answers rung doorbells and drains writable reducer pipes, restarting
+ * reducers that died.
+ *
+ * @param read_set      fdset select returned for watch_reducers
+ * @param write_set     fdset select returned for watch_reducers
+ * @exit                1 if a reducer failed too many times
+ */
+static void serve_reducers(fd_set *read_set, fd_set *write_set) {
+    for (int i = 0; i < master_pipes.r; i++) {
+        ReduceSlot *reducer = &task_table.reducers[i];
+        Channel *channel = reducer->channel;
+        if (channel != NULL &&
+            FD_ISSET(channel->doorbell[READ_END], read_set) &&
+            !channel_answer_doorbell(channel)) {
+            // the reducer died
+            reducer->attempts++;
+            restart_reducer(i);
+        } else if (channel == NULL &&
+            FD_ISSET(master_pipes.to_reducer[i], write_set) &&
+            pair_queue_flush(&reducer->queue,
+                             master_pipes.to_reducer[i]) == -1) {
+            // the reducer died
+            reducer->attempts++;
+            restart_reducer(i);
+        }
     }
 }
 
 /*
- * Read key value Pairs from mappers and
- * assigns by keys to reducer using hash function.
+ * Hands map tasks to idle mappers and routes the key value Pairs of
+ * finished tasks to reducers using hash function.
+ *
+ * Each reducer is fed through a bounded channel, or else a bounded queue
+ * in master drained with non-blocking writes whenever select reports its
+ * pipe writable. Pushed Pairs are published to channels once per pass,
+ * and a full channel rings its doorbell when it has room. A mapper whose
+ * finished task cannot be routed because a reducer queue is full stays
+ * idle until the queue has room, so one slow reducer does not stall
+ * mappers feeding the other reducers.
  *
  * @exit                            1 if error
  */
 void route_mapped_pairs() {
     int m = master_pipes.m;
-    int r = master_pipes.r;
 
-    // read the Pairs from mappers
-    Pair read_pair;                 // Pair to read
-    fd_set from_mapper_set;         // using select to avoid blocking
+    fd_set read_set;                // using select to avoid blocking
+    fd_set to_reducer_set;
 
-    // we need to keep track of closed pipes by index, 1 means closed
-    int num_closed_pipes = 0;
-    int closed_pipes[m];
-    memset(closed_pipes, 0, m);     // set all elements to 0
+    while (1) {
+        report_progress();
 
-    do {
-        // reset the fdset, excluding closed pipes
-        FD_ZERO(&from_mapper_set);
-        for (int i = 0; i < m; i++) {
-            if (closed_pipes[i] != 1) {
-                FD_SET(master_pipes.from_mapper[i], &from_mapper_set);
+        int pending = 0;    // tasks nobody is running
+        for (int t = 0; t < task_table.ntasks; t++) {
+            if (!task_table.tasks[t].done &&
+                task_table.tasks[t].running == 0) {
+                pending = 1;
             }
         }
 
-        // select the pipes ready to read
-        if (safe_select(FD_SETSIZE, &from_mapper_set, NULL, NULL)) {
-            // Process ready pipes
-            for (int j = 0; j < m; j++) {
-                if (closed_pipes[j] != 1 &&
-                    FD_ISSET(master_pipes.from_mapper[j], &from_mapper_set)) {
-                    // read Pair from pipe
-                    int read_result = safe_read(
-                                            master_pipes.from_mapper[j],
-                                            &read_pair,
-                                            sizeof(Pair));
-
-                    if (read_result == 0) {
-                        closed_pipes[j] = 1;
-                        num_closed_pipes++;
-                    } else {
-                        // send to reduce worker
-                        // hash function is uniform, see hash.c for more info
-                        int reduce_id = hash(read_pair.key) % r;
-                        safe_write(master_pipes.to_reducer[reduce_id],
-                                                     &read_pair, sizeof(Pair));
+        int live_mappers = 0;
+        for (int i = 0; i < m; i++) {
+            MapSlot *slot = &task_table.mappers[i];
+
+            // replace dead mappers while there is work left
+            if (slot->pid == -1 && pending) {
+                spawn_mapper(i);
+            }
+            if (slot->pid == -1) {
+                continue;
+            }
+            live_mappers++;
+
+            if (slot->committing) {
+                commit_staged(i);
+            }
+            if (slot->task == -1 && master_pipes.to_mapper[i] != -1) {
+                if (task_table.ndone == task_table.ntasks) {
+                    // all tasks done, let the mapper exit
+                    safe_close(master_pipes.to_mapper[i]);
+                    master_pipes.to_mapper[i] = -1;
+                } else {
+                    int t = choose_map_task();
+                    if (t != -1 && task_table.tasks[t].persisted) {
+                        commit_persisted(i, t);
+                    } else if (t != -1) {
+                        assign_map_task(i, t);
                     }
                 }
             }
         }
-    } while (num_closed_pipes < m); // while pipes are open to read
+
+        int queued = feed_reducers();
+        if (live_mappers == 0 && !queued) {
+            break;
+        }
+
+        // reset the fdsets, excluding closed mapper pipes and mappers
+        // whose finished task is still being routed
+        FD_ZERO(&read_set);
+        FD_ZERO(&to_reducer_set);
+        for (int i = 0; i < m; i++) {
+            if (task_table.mappers[i].pid != -1 &&
+                !task_table.mappers[i].committing) {
+                FD_SET(master_pipes.from_mapper[i], &read_set);
+            }
+        }
+        watch_reducers(&read_set, &to_reducer_set);
+
+        // wake up periodically to look for stragglers
+        struct timeval timeout = {.tv_sec = 0,
+                                  .tv_usec = POLL_SECONDS * 1000000};
+        if (safe_select_timeout(FD_SETSIZE, &read_set,
+                                &to_reducer_set, NULL, &timeout) == 0) {
+            continue;
+        }
+
+        serve_reducers(&read_set, &to_reducer_set);
+
+        // Process ready mapper pipes
+        for (int j = 0; j < m; j++) {
+            if (task_table.mappers[j].pid != -1 &&
+                FD_ISSET(master_pipes.from_mapper[j], &read_set)) {
+                read_mapper(j);
+            }
+        }
+    } // while mappers are running or Pairs are waiting to be written
 
     // all reducers have been written to
     // and all mappers have been read
+}
 
-    // Close mapper->master pipes.
-    for (int i = 0; i < m; i++) {
-        safe_close(master_pipes.from_mapper[i]);
+/*
+ * Tells the reducer in slot i that no more Pairs are coming.
+ *
+ * @param i             reducer slot
+ * @exit                1 if error
+ */
+static void close_reducer_input(int i) {
+    if (task_table.reducers[i].channel != NULL) {
+        channel_close(task_table.reducers[i].channel);
+    } else {
+        safe_close(master_pipes.to_reducer[i]);
+        master_pipes.to_reducer[i] = -1;
     }
+}
 
-    // close reduce pipes
-    for (int i = 0; i < r; i++) {
-        safe_close(master_pipes.to_reducer[i]);
+/*
+ * Reads what a reducer of the previous stage sent and adds the whole
+ * Pairs to its run. It is read only once the Pairs it sent before are
+ * routed. Once the reducer is done, it is reaped. It cannot be
+ * restarted, as part of its output may already have been routed, so its
+ * failure fails the job.
+ *
+ * @param upstream      reducer of the previous stage
+ * @exit                1 if error, or the reducer failed
+ */
+static void read_upstream(UpstreamSlot *upstream) {
+    ssize_t read_result = safe_read(
+                            upstream->fd,
+                            (char *) upstream->received +
+                                                upstream->received_bytes,
+                            sizeof(upstream->received) -
+                                                upstream->received_bytes);
+    if (read_result == 0) {
+        safe_close(upstream->fd);
+        if (!reap_worker(upstream->pid, "reducer")) {
+            upstream->pid = -1;
+            abort_job();
+        }
+        upstream->pid = -1;
+        if (upstream->channel != NULL) {
+            channel_free(upstream->channel);
+            upstream->channel = NULL;
+        }
+        return;
+    }
+    upstream->received_bytes += read_result;
+
+    RoutedRun *run = &task_table.runs[upstream->run];
+    size_t nreceived = upstream->received_bytes / sizeof(Pair);
+    write_pairs_at(fileno(upstream->spill), upstream->received, nreceived,
+                   run->offset + (off_t) (sizeof(Pair) * run->npairs));
+    run->npairs += nreceived;
+}
+
+/*
+ * Routes the Pairs received from a reducer of the previous stage, as far
+ * as the reducers of this stage have room.
+ *
+ * @param upstream      reducer of the previous stage
+ * @exit                1 if error
+ */
+static void route_received(UpstreamSlot *upstream) {
+    size_t nreceived = upstream->received_bytes / sizeof(Pair);
+    while (upstream->route_cursor < nreceived) {
+        if (!route_pair(&upstream->received[upstream->route_cursor])) {
+            // back-pressure, wait for the reducer to drain
+            return;
+        }
+        upstream->route_cursor++;
+        task_table.runs[upstream->run].nrouted++;
     }
+
+    // keep the bytes of a Pair split across reads
+    size_t routed = nreceived * sizeof(Pair);
+    memmove(upstream->received, (char *) upstream->received + routed,
+            upstream->received_bytes - routed);
+    upstream->received_bytes -= routed;
+    upstream->route_cursor = 0;
 }
 
 /**
- * Creates m map workers ready for use.
+ * Routes the Pairs the reducers of the previous stage of a chain send to
+ * the reducers of the current stage, until every reducer of the previous
+ * stage has exited. Intermediate output only touches the disk as the runs
+ * that let reducers of this stage be restarted.
+ *
+ * @exit                            1 if error
+ */
+void route_upstream_pairs() {
+    int r = master_pipes.r;
+
+    fd_set read_set;
+    fd_set to_reducer_set;
+
+    while (1) {
+        report_progress();
+
+        int live_upstream = 0;
+        for (int i = 0; i < r; i++) {
+            if (task_table.upstream[i].pid != -1) {
+                live_upstream++;
+                route_received(&task_table.upstream[i]);
+            }
+        }
+
+        int queued = feed_reducers();
+        if (live_upstream == 0 && !queued) {
+            break;
+        }
+
+        // skip reducers whose Pairs are waiting for room
+        FD_ZERO(&read_set);
+        FD_ZERO(&to_reducer_set);
+        for (int i = 0; i < r; i++) {
+            UpstreamSlot *upstream = &task_table.upstream[i];
+            if (upstream->pid != -1 &&
+                upstream->route_cursor == 0 &&
+                upstream->received_bytes < sizeof(Pair)) {
+                FD_SET(upstream->fd, &read_set);
+            }
+        }
+        watch_reducers(&read_set, &to_reducer_set);
+
+        // wake up periodically to report progress
+        struct timeval timeout = {.tv_sec = 0,
+                                  .tv_usec = POLL_SECONDS * 1000000};
+        if (safe_select_timeout(FD_SETSIZE, &read_set,
+                                &to_reducer_set, NULL, &timeout) == 0) {
+            continue;
+        }
+
+        serve_reducers(&read_set, &to_reducer_set);
+        for (int i = 0; i < r; i++) {
+            UpstreamSlot *upstream = &task_table.upstream[i];
+            if (upstream->pid != -1 && FD_ISSET(upstream->fd, &read_set)) {
+                read_upstream(upstream);
+            }
+        }
+    }
+}
+
+/*
+ * Creates the reducers of the current stage.
  *
- * @param dirname       directory containing the input files.
  * @exit                1 if error
  */
-void create_mappers() {
-    int m = master_pipes.m;
+static void start_reducers() {
+    for (int i = 0; i < master_pipes.r; i++) {
+        ReduceSlot *reducer = &task_table.reducers[i];
+        reducer->attempts = 0;
+        reducer->replay_run = -1;
+        reducer->replay_cursor = 0;
+        pair_queue_init(&reducer->queue, PAIR_QUEUE_PAIRS);
+        key_encoder_init(&reducer->encoder);
+        spawn_reducer(i);
+        if (master_pipes.to_reducer[i] != -1) {
+            safe_set_nonblocking(master_pipes.to_reducer[i]);
+        }
+    }
+}
+
+/*
+ * Ends the input of the reducers of a stage that feeds the next stage of
+ * a chain. They become the upstream of the next stage, which they send
+ * their output to instead of writing files.
+ *
+ * @exit                1 if error
+ */
+static void hand_off_reducers() {
     int r = master_pipes.r;
-    safe_malloc((void **) &(master_pipes.to_mapper), sizeof(int) * m);
-    safe_malloc((void **) &(master_pipes.from_mapper), sizeof(int) * m);
+    // the reducers handed off are never restarted
+    discard_runs();
+    if (task_table.upstream == NULL) {
+        safe_malloc((void **) &(task_table.upstream),
+                    sizeof(UpstreamSlot) * r);
+    }
 
-    // Fork indicator
-    pid_t pid;
+    for (int i = 0; i < r; i++) {
+        ReduceSlot *reducer = &task_table.reducers[i];
+        UpstreamSlot *upstream = &task_table.upstream[i];
 
-    // Fork m times
-    // connect two pipes with each child
-    // one master->mapper pipe to transfer filenames
-    // one mapper->master pipe to transfer mapped key value Pairs
-    for (int i = 0; i < m; i++) {
-        // Create the master->mapper pipe
-        int to_mapper_pipe[2];
-        safe_pipe(to_mapper_pipe);
-
-        // Create the mapper->master pipe
-        int from_mapper_pipe[2];
-        safe_pipe(from_mapper_pipe);
-
-        // fork into map worker
-        pid = safe_fork();
-        if (pid == 0) {
-            // mapper
-            // route stdin from pipe master->mapper
-            safe_close(to_mapper_pipe[WRITE_END]);
-            safe_dup2(to_mapper_pipe[READ_END], STDIN_FILENO);
-
-            // route stdout to pipe mapper->master
-            safe_close(from_mapper_pipe[READ_END]);
-            safe_dup2(from_mapper_pipe[WRITE_END], STDOUT_FILENO);
-
-            // i-1 pipes to sibling mappers exist in this child, close them
-            for (int j = 0; j < i; j++) {
-                safe_close(master_pipes.to_mapper[j]);
-                safe_close(master_pipes.from_mapper[j]);
+        close_reducer_input(i);
+        upstream->pid = reducer->pid;
+        upstream->fd = master_pipes.from_reducer[i];
+        upstream->channel = reducer->channel;
+        upstream->received_bytes = 0;
+        upstream->route_cursor = 0;
+        upstream->spill = tmpfile();
+        if (upstream->spill == NULL) {
+            safe_fprintf(stderr, "Error creating spill file\n");
+            exit(1);
+        }
+        upstream->run = add_run(fileno(upstream->spill), -1, 0, 0);
+
+        master_pipes.from_reducer[i] = -1;
+        reducer->pid = -1;
+        reducer->channel = NULL;
+        pair_queue_free(&reducer->queue);
+        key_encoder_free(&reducer->encoder);
+    }
+}
+
+/*
+ * Closes the pipes to reducers and waits for them to write their output,
+ * restarting any reducer that fails and feeding it its Pairs again.
+ *
+ * @exit                1 if a reducer failed too many times
+ */
+static void finish_reducers() {
+    for (int i = 0; i < master_pipes.r; i++) {
+        ReduceSlot *reducer = &task_table.reducers[i];
+
+        close_reducer_input(i);
+
+        await_worker(reducer->pid);
+        while (!reap_worker(reducer->pid, "reducer")) {
+            reducer->attempts++;
+            if (reducer->attempts >= MAX_TASK_ATTEMPTS) {
+                safe_fprintf(stderr, "master: giving up on reducer %d\n", i);
+                reducer->pid = -1;
+                abort_job();
             }
 
-            // close all the pipes to reducers in mapper child process
-            for (int j = 0; j < r; j++) {
-                safe_close(master_pipes.to_reducer[j]);
+            char filename[MAX_FILENAME] = "";
+            sprintf(filename, "[%d].out", reducer->pid);
+            unlink(filename);
+
+            if (reducer->channel != NULL) {
+                channel_free(reducer->channel);
+                reducer->channel = NULL;
             }
 
-            // don't spawn children for child
-            break;
-        } else {
-            // master
-            // Store master->mapper pipe
-            safe_close(to_mapper_pipe[READ_END]);
-            master_pipes.to_mapper[i] = to_mapper_pipe[WRITE_END];
+            // map phase is over, replay the runs with blocking writes
+            safe_fprintf(stderr, "master: restarting reducer %d\n", i);
+            spawn_reducer(i);
+            resend_runs(i);
+            safe_close(master_pipes.to_reducer[i]);
+            master_pipes.to_reducer[i] = -1;
+        }
+
+        if (reducer->channel != NULL) {
+            channel_free(reducer->channel);
+            reducer->channel = NULL;
+        }
+        pair_queue_free(&reducer->queue);
+        key_encoder_free(&reducer->encoder);
+    }
+    discard_runs();
+}
+
+/*
+ * Merges the K best results of each reducer, or of the results master
+ * aggregated, into the K best of the job. They are written best first to
+ * master's [pid].out, which replaces the files of the reducers.
+ *
+ * @param k             number of results to keep
+ * @exit                1 if error
+ */
+static void merge_top_k(int k) {
+    TopK top;
+    top_k_init(&top, k);
+    char filename[MAX_FILENAME] = "";
+
+    if (task_table.aggregate != NULL) {
+        Pair *results;
+        safe_malloc((void **) &results,
+                    sizeof(Pair) * (task_table.aggregate->count + 1));
+        size_t nresults = aggregate_collect(task_table.aggregate, results);
+        for (size_t i = 0; i < nresults; i++) {
+            top_k_offer(&top, &results[i]);
+        }
+        free(results);
+    }
 
-            // Store mapper->master pipe
-            safe_close(from_mapper_pipe[WRITE_END]);
-            master_pipes.from_mapper[i] = from_mapper_pipe[READ_END];
+    for (int i = 0; i < master_pipes.r; i++) {
+        sprintf(filename, "[%d].out", task_table.reducers[i].pid);
+        FILE *fin = safe_fopen(filename, "rb");
+        Pair pair;
+        while (safe_fread(&pair, sizeof(Pair), 1, fin) == 1) {
+            top_k_offer(&top, &pair);
         }
+        safe_fclose(fin);
+        unlink(filename);
+    }
+
+    sprintf(filename, "[%d].out", getpid());
+    FILE *fout = safe_fopen(filename, "wb");
+    safe_fwrite(top.heap, sizeof(Pair), top_k_sort(&top), fout);
+    safe_fclose(fout);
+    top_k_free(&top);
+}
+
+/*
+ * Writes the heavy hitters of an approximate job, best first, to master's
+ * [pid].out, and the estimated number of distinct keys on stderr.
+ *
+ * @param k             number of heavy hitters to write, 0 for all of the
+ *                      candidates
+ * @exit                1 if error
+ */
+static void write_heavy_hitters(int k) {
+    if (k == 0 || k > SKETCH_CANDIDATES) {
+        k = SKETCH_CANDIDATES;
     }
-    // Finished creating map workers
+    Pair hitters[SKETCH_CANDIDATES];
+    int nhitters = sketch_heavy_hitters(task_table.sketch, hitters, k);
+
+    char filename[MAX_FILENAME] = "";
+    sprintf(filename, "[%d].out", getpid());
+    FILE *fout = safe_fopen(filename, "wb");
+    safe_fwrite(hitters, sizeof(Pair), nhitters, fout);
+    safe_fclose(fout);
+
+    safe_fprintf(stderr, "approx: about %.0f distinct keys, %llu counted\n",
+                 sketch_distinct(task_table.sketch),
+                 task_table.sketch->counters.total);
+}
+
+/**
+ * Creates a map worker in slot i.
+ * Connect two pipes with the child, one master->mapper pipe to transfer
+ * filenames and one mapper->master pipe to transfer mapped key value Pairs.
+ *
+ * @param i             mapper slot
+ * @exit                1 if error
+ */
+void spawn_mapper(int i) {
+    // Create the master->mapper pipe
+    int to_mapper_pipe[2];
+    safe_pipe(to_mapper_pipe);
+
+    // Create the mapper->master pipe
+    int from_mapper_pipe[2];
+    safe_pipe(from_mapper_pipe);
 
+    // buffered output would otherwise be flushed by the child as well
+    fflush(NULL);
+
+    // fork into map worker, or hand the pipes to a warm worker of the
+    // job server
+    stats_reset(stats_of_mapper(i));
+    pid_t pid = worker_pool.active ?
+                pool_assign(POOL_MAPPER, to_mapper_pipe[READ_END],
+                            from_mapper_pipe[WRITE_END]) :
+                safe_fork();
     if (pid == 0) {
-        // continuing after break from for loop
-        // end of process, free malloced memory
-        free(master_pipes.from_mapper);
-        free(master_pipes.to_mapper);
-        free(master_pipes.to_reducer);
+        // mapper
+        worker_stats = stats_of_mapper(i);
+        TRACE_START_WORKER(TRACE_MAPPER);
+        if (placement.mapper_cpus != NULL) {
+            pin_to_cpu(placement.mapper_cpus[i]);
+        }
 
-        // mapper blocks trying to read the Pairs from its stdin
+        // route stdin from pipe master->mapper
+        safe_close(to_mapper_pipe[WRITE_END]);
+        safe_dup2(to_mapper_pipe[READ_END], STDIN_FILENO);
+        // master already read the lister's stdin to its end
+        clearerr(stdin);
+
+        // route stdout to pipe mapper->master
+        safe_close(from_mapper_pipe[READ_END]);
+        safe_dup2(from_mapper_pipe[WRITE_END], STDOUT_FILENO);
+
+        // pipes to sibling workers exist in this child, close them
+        close_master_pipes();
+
+        // mapper blocks trying to read the filenames from its stdin
         map_digest_files();
+        exit(0);
     }
+
+    // master
+    // Store master->mapper pipe
+    safe_close(to_mapper_pipe[READ_END]);
+    master_pipes.to_mapper[i] = to_mapper_pipe[WRITE_END];
+
+    // Store mapper->master pipe
+    safe_close(from_mapper_pipe[WRITE_END]);
+    master_pipes.from_mapper[i] = from_mapper_pipe[READ_END];
+
+    task_table.mappers[i].pid = pid;
+    task_table.mappers[i].task = -1;
 }
 
+/**
+ * Creates a reduce worker in slot i.
+ * Make one master->reducer channel to provide mapped keys, or a pipe if
+ * shared memory is not used. A restarted reducer is always fed through
+ * a pipe, as its Pairs are replayed with the pipe's queue. If another stage
+ * of the chain follows, a reducer->master pipe carries its output.
+ *
+ * @param i             reducer slot
+ * @exit                1 if error
+ */
+void spawn_reducer(int i) {
+    ReduceSlot *reducer = &task_table.reducers[i];
+    reducer->channel = NULL;
+    // a new reducer process knows no keys yet
+    key_encoder_reset(&reducer->encoder);
+    if (task_table.shared_memory && reducer->attempts == 0) {
+        reducer->channel = channel_create(CHANNEL_PAIRS);
+    }
+
+    // Create the master->reducer pipe
+    int to_reducer_pipe[2] = {-1, -1};
+    if (reducer->channel == NULL) {
+        safe_pipe(to_reducer_pipe);
+    }
+
+    // Create the reducer->master pipe
+    int from_reducer_pipe[2] = {-1, -1};
+    if (next_stage_job() != NULL) {
+        safe_pipe(from_reducer_pipe);
+    }
+
+    // buffered output would otherwise be flushed by the child as well
+    fflush(NULL);
+
+    // Fork into reduce worker, or hand the pipes to a warm worker of the
+    // job server
+    stats_reset(stats_of_reducer(i));
+    pid_t master_pid = getpid();
+    pid_t pid = worker_pool.active ?
+                pool_assign(POOL_REDUCER, to_reducer_pipe[READ_END],
+                            from_reducer_pipe[WRITE_END]) :
+                safe_fork();
+    if (pid == 0) {
+        // reducer
+        worker_stats = stats_of_reducer(i);
+        TRACE_START_WORKER(TRACE_REDUCER);
+        if (placement.reducer_cpus != NULL) {
+            pin_to_cpu(placement.reducer_cpus[i]);
+        }
+
+        if (reducer->channel != NULL) {
+            channel_become_consumer(reducer->channel);
+
+            // a sleeping reducer would not notice master is gone
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            if (getppid() != master_pid) {
+                exit(1);
+            }
+        } else {
+            safe_close(to_reducer_pipe[WRITE_END]);
+
+            // change stdin to read end of pipe
+            safe_dup2(to_reducer_pipe[READ_END], STDIN_FILENO);
+        }
+
+        if (from_reducer_pipe[WRITE_END] != -1) {
+            // route stdout to pipe reducer->master
+            safe_close(from_reducer_pipe[READ_END]);
+            safe_dup2(from_reducer_pipe[WRITE_END], STDOUT_FILENO);
+        }
+
+        // pipes to sibling workers exist in this child, close them
+        close_master_pipes();
 
+        // reduce blocked trying to read key value Pairs given by master
+        reduce_process_pairs(reducer->channel);
+        exit(0);
+    }
+
+    // master
+    if (reducer->channel != NULL) {
+        channel_become_producer(reducer->channel);
+    } else {
+        // Store master->reducer pipe
+        safe_close(to_reducer_pipe[READ_END]);
+        master_pipes.to_reducer[i] = to_reducer_pipe[WRITE_END];
+    }
+    if (from_reducer_pipe[READ_END] != -1) {
+        // Store reducer->master pipe
+        safe_close(from_reducer_pipe[WRITE_END]);
+        master_pipes.from_reducer[i] = from_reducer_pipe[READ_END];
+    }
+    reducer->pid = pid;
+}
 
 /*
  * Creates m mappers and r reducers ready to use.
  *
- * @param  dirname      directory containing the input files.
+ * @param  logistics    settings of the job.
  * @exit                1 if error
  */
-void create_workers(char *dirname) {
+void create_workers(const MapReduceLogistics *logistics) {
+    TRACE_START_MASTER();
+
+    // Read stdin for filenames
+    task_table.pack_bytes = logistics->pack_bytes;
+    read_map_tasks(logistics->dirname);
+
+    for (int t = 0; t < task_table.ntasks; t++) {
+        if (task_table.tasks[t].size > 0) {
+            task_table.input_bytes += task_table.tasks[t].size;
+        }
+    }
+
+    if (logistics->auto_tune) {
+        // size the workers for this input and machine, then pin them
+        discover_cpus();
+        size_workers(&master_pipes.m, &master_pipes.r,
+                     task_table.input_bytes, task_table.ntasks);
+        plan_placement(master_pipes.m, master_pipes.r);
+    }
+
+    int m = master_pipes.m;
     int r = master_pipes.r;
+    safe_malloc((void **) &(master_pipes.to_mapper), sizeof(int) * m);
+    safe_malloc((void **) &(master_pipes.from_mapper), sizeof(int) * m);
     safe_malloc((void **) &(master_pipes.to_reducer), sizeof(int) * r);
+    safe_malloc((void **) &(master_pipes.from_reducer), sizeof(int) * r);
+    safe_malloc((void **) &(task_table.mappers), sizeof(MapSlot) * m);
+    safe_malloc((void **) &(task_table.reducers), sizeof(ReduceSlot) * r);
 
-    // fork indicator
-    pid_t pid;
+    for (int i = 0; i < m; i++) {
+        master_pipes.to_mapper[i] = -1;
+        master_pipes.from_mapper[i] = -1;
 
-    // fork r times for reducers
-    // make one master->reducer pipe to provide mapped keys
+        MapSlot *slot = &task_table.mappers[i];
+        slot->pid = -1;
+        slot->task = -1;
+        safe_malloc((void **) &(slot->staged), sizeof(Pair) * STAGED_PAIRS);
+        slot->staged_bytes = 0;
+        slot->spill = tmpfile();
+        if (slot->spill == NULL) {
+            safe_fprintf(stderr, "Error creating spill file\n");
+            exit(1);
+        }
+        slot->spill_end = 0;
+        slot->nspilled = 0;
+        slot->committing = 0;
+    }
     for (int i = 0; i < r; i++) {
-        // Create the master->reducer pipe
-        int to_reducer_pipe[2];
-        safe_pipe(to_reducer_pipe);
+        master_pipes.to_reducer[i] = -1;
+        master_pipes.from_reducer[i] = -1;
+        task_table.reducers[i].pid = -1;
+        task_table.reducers[i].channel = NULL;
+    }
 
-        // Fork into reduce worker
-        pid = safe_fork();
-        if (pid == 0) {
-            // reducer
-            safe_close(to_reducer_pipe[WRITE_END]);
+    // mappers inherit their settings when forked
+    map_settings.r = r;
+    map_settings.workdir = logistics->workdir;
+    map_settings.combine = logistics->combine;
+    map_settings.map_only = (r == 0 && !logistics->aggregate &&
+                             !logistics->approx);
+    map_settings.aggregate = logistics->aggregate;
+    map_settings.approx = logistics->approx;
+    // loaded before any mapper is forked, mappers share it
+    map_settings.join = logistics->join_dir != NULL ?
+                        join_table_load(logistics->join_dir) : NULL;
+    reduce_settings.top_k = logistics->top_k;
+    reduce_settings.threads = logistics->reduce_threads;
+    // reducers of daemons in distributed mode still read plain Pairs
+    reduce_settings.encoded_keys = 1;
+    task_table.shared_memory = !logistics->pipes;
+    if (logistics->progress) {
+        // workers publish their counters in a segment they inherit
+        stats_create(m, r);
+        task_table.progress = 1;
+        task_table.started = now_seconds();
+        task_table.last_progress = task_table.started;
+    }
+    Aggregate results;
+    if (logistics->aggregate) {
+        aggregate_init(&results);
+        task_table.aggregate = &results;
+    }
+    if (logistics->approx) {
+        task_table.sketch = sketch_create();
+    }
+    if (logistics->workdir != NULL) {
+        open_manifest(logistics);
+    }
 
-            // change stdin to read end of pipe
-            safe_dup2(to_reducer_pipe[READ_END], STDIN_FILENO);
+    // a write to a dead reducer fails with EPIPE and the reducer is
+    // restarted, instead of master being killed
+    signal(SIGPIPE, SIG_IGN);
 
-            // i-1 pipes to sibling reducers exist in this child, close them
-            for (int j = 0; j < i; j++) {
-                safe_close(master_pipes.to_reducer[j]);
-            }
+    // reducer children are blocked trying to read
+    start_reducers();
 
-            // break because child PC is still in for loop
-            break;
-        } else if (pid > 0) {
-            // master
-            // Store master->reducer pipe
-            safe_close(to_reducer_pipe[READ_END]);
-            master_pipes.to_reducer[i] = to_reducer_pipe[WRITE_END];
-        }
+    // map workers are spawned and given tasks by the routing loop
+    route_mapped_pairs();
+
+    // the reducers of each stage of a chain are the mappers of the next
+    for (int stage = 1; stage < job_chain.nstages; stage++) {
+        hand_off_reducers();
+        enter_stage(stage);
+        start_reducers();
+        route_upstream_pairs();
     }
+    finish_reducers();
 
-    // all pipes to reducers have been connected
-    if (pid == 0) {
-        // reducer, continuing after breaking from for loop
-        // before reducer process, free memory
-        free(master_pipes.to_reducer);
+    if (task_table.progress) {
+        safe_fprintf(stderr, "progress: done, %.1f MB mapped and %llu pairs "
+                     "routed in %.1fs\n", task_table.input_bytes / 1e6,
+                     task_table.routed, now_seconds() - task_table.started);
+    }
 
-        // reduce blocked trying to read key value Pairs from stdin given
-        // by master
-        reduce_process_pairs();
-    } else {
-        // master
+    if (task_table.sketch != NULL) {
+        write_heavy_hitters(logistics->top_k);
+    } else if (logistics->top_k > 0) {
+        merge_top_k(logistics->top_k);
+    } else if (task_table.aggregate != NULL) {
+        // master did the reducing, write to file [pid].out
+        char filename[MAX_FILENAME] = "";
+        sprintf(filename, "[%d].out", getpid());
+        FILE *fout = safe_fopen(filename, "wb");
+        aggregate_write(task_table.aggregate, fout);
+        safe_fclose(fout);
+    }
+    if (task_table.aggregate != NULL) {
+        aggregate_free(task_table.aggregate);
+        task_table.aggregate = NULL;
+    }
+    if (task_table.sketch != NULL) {
+        sketch_free(task_table.sketch);
+        task_table.sketch = NULL;
+    }
+    if (map_settings.join != NULL) {
+        join_table_free((JoinTable *) map_settings.join);
+        map_settings.join = NULL;
+    }
 
-        // finished creating reduce workers
-        // reducer children are blocked trying to read
-        // create map workers
-        create_mappers();
-        // map workers are blocked trying to read files
-        // Read stdin for filenames, write to map workers
-        distribute_files(dirname);
-        // read and write mapped Pairs
-        route_mapped_pairs();
+    if (task_table.manifest != NULL) {
+        safe_fclose(task_table.manifest);
+    }
 
-        while(waitpid(-1, NULL, 0) >= 0) {
-            // waits for all children of master process to terminate
-        }
+    TRACE_COLLECT();
 
-        // end of master process, free malloced memory
-        free(master_pipes.from_mapper);
-        free(master_pipes.to_mapper);
-        free(master_pipes.to_reducer);
+    // end of master process, free malloced memory
+    for (int i = 0; i < m; i++) {
+        free(task_table.mappers[i].staged);
+    }
+    free(task_table.mappers);
+    free(task_table.reducers);
+    free(task_table.runs);
+    free(task_table.upstream);
+    for (int t = 0; t < task_table.ntasks; t++) {
+        free(task_table.tasks[t].pack);
     }
+    free(task_table.tasks);
+    free(master_pipes.from_mapper);
+    free(master_pipes.to_mapper);
+    free(master_pipes.to_reducer);
+    free(master_pipes.from_reducer);
+    free_placement();
+    stats_free();
 }
 
 /**
  * Creates a master worker that spawns m map children
  * and r reduce children, initiating MapReduce.
  *
- * @param  dirname      directory containing the input files.
- * @param  m            number of map children.
- * @param  r            number of reduce children.
+ * @param  logistics    settings of the job: input directory, number of
+ *                      map and reduce children and work directory.
  * @exit                1 if error
- * @return              zero on success, and a non-zero value on error.
  */
-int create_master(char *dirname, int m, int r) {
+void create_master(const MapReduceLogistics *logistics) {
 
     // master_pipes is a global variable of type PipeSet
-    master_pipes.m = m;
-    master_pipes.r = r;
+    master_pipes.m = logistics->nmapworkers;
+    master_pipes.r = logistics->nreduceworkers;
 
     // Create the lister->master pipe
     int lister_pipe[2];
@@ -318,7 +2065,7 @@ int create_master(char *dirname, int m, int r) {
     // Fork into lister worker
     // Communication:  lister writes to stdout, master reads stdin
     pid_t pid = safe_fork();
-    if (pid > 0) {
+    if (pid == 0) {
         // lister
         safe_close(lister_pipe[READ_END]);
 
@@ -327,21 +2074,25 @@ int create_master(char *dirname, int m, int r) {
 
         // NOTE: there is no way to free malloced memory dirname before
         // end of process (calling execvp in list)
-        list(dirname);
+        list(logistics->dirname);
     } else {
         // master
+        // stays the parent so the caller waits for the job to finish
         safe_close(lister_pipe[WRITE_END]);
 
         // change stdin to read end of pipe
         safe_dup2(lister_pipe[READ_END], STDIN_FILENO);
+        safe_close(lister_pipe[READ_END]);
+        task_table.lister = pid;
+        // a job master of the job server read its last lister to the end
+        clearerr(stdin);
 
-        // no need to wait for lister child, program counter
-        // for that process will start at fork point
-
-        // create map and reduce workers
-        create_workers(dirname);
+        if (logistics->workers != NULL) {
+            // map and reduce on the worker daemons
+            run_coordinator(logistics);
+        } else {
+            // create map and reduce workers
+            create_workers(logistics);
+        }
     }
-
-    return 0;
 }
-
@@ -1,11 +1,34 @@
 #ifndef MASTER_H
 #define MASTER_H
 
-#define READ_END 0
-#define WRITE_END 1
+#include <linux/limits.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "aggregate.h"
+#include "channel.h"
+#include "keydict.h"
+#include "mapreduce.h"
+#include "pairqueue.h"
+#include "sketch.h"
+#include "utils.h"
+
+#define MAX_TASK_ATTEMPTS 3         // attempts of a task before the job fails
+#define SPECULATE_FACTOR 3.0        // slower than the mean task this many times
+#define SPECULATE_MIN_SECONDS 1.0   // and running at least this long
+#define POLL_SECONDS 0.1            // how often master checks for stragglers
+
+#define MANIFEST_NAME "MANIFEST"    // committed tasks in the work directory
+
+#define PACK_REQUEST_BYTES (PIPE_BUF - 32)  // paths of a packed task, so its
+                                            //   request is one atomic write
+
+#define UPSTREAM_PAIRS 64           // Pairs read at once from a reducer
+                                    //   feeding the next stage of a chain
 
 /*
  * This struct holds all array of pipes / fds interfacing with master.
+ * Closed fds are set to -1.
  */
 typedef struct pipe_set {
     int m;
@@ -13,35 +36,178 @@ typedef struct pipe_set {
     int *from_mapper;
     int *to_mapper;
     int *to_reducer;
+    int *from_reducer;  // output of reducers feeding the next stage
 } PipeSet;
 
+/*
+ * A map task is one input file, or a pack of small files mapped together.
+ * Several attempts of a task may run at once when it is speculatively
+ * re-run, the first to finish is committed.
+ */
+typedef struct map_task {
+    char path[PATH_MAX];    // input file, the first of a pack
+    int nfiles;             // input files, more than 1 if packed
+    char *pack;             // paths of the files of a pack, each followed
+                            //   by a space, NULL if not packed
+    int attempts;           // attempts started
+    int running;            // attempts currently running
+    int done;               // 1 once the output of an attempt was committed
+    int output_id;          // names the persisted output in the work dir
+    int persisted;          // 1 if a previous run persisted the output
+    long long size;         // fingerprint of the input file, to reuse
+    long long mtime;        //   output persisted by a previous run, size
+                            //   is the total of a pack
+    unsigned long long content_hash;
+} MapTask;
+
+/*
+ * Pairs routed to the reducers of the current stage, kept on disk in the
+ * order they are routed so that a failed reducer can be fed again: the
+ * output of a map task, in the spill file of its mapper slot or in the
+ * work directory, or what a reducer of the previous stage sent.
+ */
+typedef struct routed_run {
+    int fd;                 // file holding the Pairs, -1 for the persisted
+    int output_id;          //   output with this id in the work directory
+    off_t offset;           // where the Pairs start in the file
+    size_t npairs;
+    size_t nrouted;         // Pairs routed so far, always the first ones
+} RoutedRun;
+
+/*
+ * Master's view of one map worker.
+ * Pairs of the current task are staged until the mapper reports the task
+ * done, so the output of a failed attempt never reaches a reducer. At
+ * most STAGED_PAIRS are held in memory, the rest is spilled to disk, or
+ * dropped if the mapper persists the output in the work directory.
+ */
+typedef struct map_slot {
+    pid_t pid;              // -1 if no mapper runs in this slot
+    int task;               // index of the task being mapped, -1 if idle
+    double started;         // time the task was assigned, in seconds
+    Pair *staged;           // Pairs read for the current task, or the
+                            //   Pairs of the run being routed from window
+    size_t staged_bytes;
+    FILE *spill;            // output of the tasks committed from this slot,
+    off_t spill_end;        //   which ends here, then of the current task
+    size_t nspilled;        // Pairs of the current task spilled or dropped
+    int committing;         // 1 while Pairs of a finished task are routed
+    int run;                // index in task_table.runs of the finished task
+    size_t window;          // index in the run of the first staged Pair
+} MapSlot;
+
+/*
+ * Master's view of one reduce worker.
+ * A failed reducer is restarted and fed its Pairs of every run again.
+ * Pairs are sent with their keys dictionary encoded, straight into the
+ * reducer's channel if it has one, else through the queue and a pipe.
+ */
+typedef struct reduce_slot {
+    pid_t pid;
+    int attempts;
+    int replay_run;         // run being replayed, -1 if not replaying
+    size_t replay_cursor;   // next Pair of the run to replay
+    PairQueue queue;
+    Channel *channel;       // NULL if the reducer is fed through a pipe
+    KeyEncoder encoder;     // keys sent to the reducer process
+} ReduceSlot;
+
+/*
+ * Master's view of a reducer of the previous stage of a job chain. It
+ * maps its reduced Pairs with the job of the current stage and sends
+ * them to master, which routes them to the reducers of this stage.
+ */
+typedef struct upstream_slot {
+    pid_t pid;              // -1 once it exited
+    int fd;                 // Pairs sent by the reducer
+    Channel *channel;       // input of the reducer, freed once it exits
+    Pair received[UPSTREAM_PAIRS];
+    size_t received_bytes;
+    size_t route_cursor;    // Pairs of received already routed
+    FILE *spill;            // every Pair received, for restarted reducers
+    int run;                // index in task_table.runs of the Pairs
+} UpstreamSlot;
+
+/*
+ * Tasks and workers tracked by master while the job runs.
+ */
+typedef struct task_table {
+    int ntasks;
+    int ndone;
+    MapTask *tasks;
+    long long pack_bytes;       // small files are packed into tasks of up
+                                //   to this many bytes, 0 to not pack
+    MapSlot *mappers;
+    ReduceSlot *reducers;
+    RoutedRun *runs;            // Pairs routed in the current stage
+    int nruns;
+    int runs_capacity;
+    double total_task_seconds;  // of committed tasks, to spot stragglers
+    FILE *manifest;             // committed tasks, NULL if not persisted
+    int shared_memory;          // 1 to feed reducers through channels
+    UpstreamSlot *upstream;     // reducers of the previous stage of a
+                                //   chain, NULL in the first stage
+    Aggregate *aggregate;       // results of a job aggregated by master
+                                //   without reducers, else NULL
+    Sketch *sketch;             // merged sketches of an approximate job,
+                                //   else NULL
+    pid_t lister;               // lists the input directory
+    int progress;               // 1 to report progress on stderr
+    double started;             // time the job started, in seconds
+    double last_progress;       // time progress was last reported
+    long long input_bytes;      // of all input files
+    long long done_bytes;       // of the input files of committed tasks
+    unsigned long long routed;  // Pairs of committed tasks routed
+} TaskTable;
+
+extern TaskTable task_table;
+
 /*
  * Reads filenames located at dirname from stdin (sent by lister)
- * and distributes them evenly to mappers.
+ * into the table of map tasks.
+ */
+void read_map_tasks(char *dirname);
+
+/*
+ * Opens the manifest of persisted map output in the job's workdir,
+ * marking the tasks a previous run of the same jobs and combine setting
+ * completed when resuming.
  */
-void distribute_files(char *dirname);
+void open_manifest(const MapReduceLogistics *logistics);
 
 /*
- * Read key value Pairs from mappers and
- * assigns by keys to reducer using hash function.
+ * Hands map tasks to idle mappers and routes the key value Pairs of
+ * finished tasks to reducers using hash function, re-running failed
+ * and straggling tasks.
  */
 void route_mapped_pairs();
+
+/*
+ * Routes the Pairs the reducers of the previous stage of a chain send to
+ * the reducers of the current stage.
+ */
+void route_upstream_pairs();
+
 /*
- * Creates m map workers ready for use.
+ * Creates a map worker in slot i.
  */
-void create_map_workers();
+void spawn_mapper(int i);
+
+/*
+ * Creates a reduce worker in slot i.
+ */
+void spawn_reducer(int i);
 
 /*
  * Creates m mappers and r reducers ready for use.
  */
-void create_workers(char *dirname);
+void create_workers(const MapReduceLogistics *logistics);
 
 
 /**
  * Creates a master worker that spawns m map children
  * and r reduce children, initiating MapReduce.
  */
-int create_master(char *dirname, int m, int r);
+void create_master(const MapReduceLogistics *logistics);
 
 #endif
-
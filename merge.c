@@ -0,0 +1,434 @@
+/*
+ * K-way merges of the sorted [pid].out files of the reducers into one
+ * sorted file. Inputs are mapped into memory and merged with a loser tree,
+ * and merged Pairs are written MERGE_BUFFER_PAIRS at a time.
+ *
+ * With several threads, the keys are split into ranges at keys sampled
+ * evenly from the largest input. A range starts at the same key in every
+ * input, so Pairs of one key are never split between ranges, and each
+ * thread merges one range. Without combining, every range writes exactly
+ * the Pairs it reads, so each thread writes straight to its place in the
+ * output. With combining, ranges are merged into spill files first and
+ * copied into the output in order.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "job.h"
+#include "merge.h"
+#include "utils.h"
+
+/*
+ * Maps a file of Pairs and checks it is sorted by key.
+ *
+ * @param input         input to fill
+ * @param path          path of the file
+ * @exit                1 if error, or if the file is not sorted
+ */
+static void map_input(MergeInput *input, const char *path) {
+    input->path = path;
+    input->pairs = NULL;
+    input->npairs = 0;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1) {
+        safe_fprintf(stderr, "Error opening file '%s'\n", path);
+        exit(1);
+    }
+    if (info.st_size % sizeof(Pair) != 0) {
+        safe_fprintf(stderr, "%s is not a file of Pairs\n", path);
+        exit(1);
+    }
+    input->npairs = info.st_size / sizeof(Pair);
+    if (input->npairs > 0) {
+        input->pairs = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (input->pairs == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        madvise((void *) input->pairs, info.st_size, MADV_SEQUENTIAL);
+    }
+    safe_close(fd);
+
+    // top K results are ranked, not sorted, and cannot be merged
+    for (size_t i = 1; i < input->npairs; i++) {
+        if (strcmp(input->pairs[i - 1].key, input->pairs[i].key) > 0) {
+            safe_fprintf(stderr, "%s is not sorted by key\n", path);
+            exit(1);
+        }
+    }
+}
+
+/*
+ * Returns the index of the first Pair of an input whose key is not less
+ * than key.
+ *
+ * @param input         input to search
+ * @param key           key to look for
+ */
+static size_t lower_bound(const MergeInput *input, const char *key) {
+    size_t low = 0;
+    size_t high = input->npairs;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (strcmp(input->pairs[middle].key, key) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/*
+ * Returns 1 if the next Pair of cursor a comes before the next Pair of
+ * cursor b, else 0. An ended cursor comes after every other, and of two
+ * equal keys the one of the earlier input comes first, so the merge is
+ * stable.
+ *
+ * @param tree          tree of the cursors
+ * @param a             index of a cursor
+ * @param b             index of another cursor
+ */
+static int comes_before(const LoserTree *tree, int a, int b) {
+    const MergeCursor *ca = &tree->cursors[a];
+    const MergeCursor *cb = &tree->cursors[b];
+    if (ca->cursor == ca->end) {
+        return 0;
+    }
+    if (cb->cursor == cb->end) {
+        return 1;
+    }
+    int order = strcmp(ca->pairs[ca->cursor].key, cb->pairs[cb->cursor].key);
+    return order < 0 || (order == 0 && a < b);
+}
+
+/*
+ * Plays the matches of the subtree under node, recording the loser of
+ * each, and returns the winner. Leaves are the nodes k to 2k - 1.
+ *
+ * @param tree          tree to build
+ * @param node          root of the subtree
+ */
+static int play_matches(LoserTree *tree, int node) {
+    if (node >= tree->k) {
+        return node - tree->k;
+    }
+    int left = play_matches(tree, 2 * node);
+    int right = play_matches(tree, 2 * node + 1);
+    if (comes_before(tree, left, right)) {
+        tree->losers[node] = right;
+        return left;
+    }
+    tree->losers[node] = left;
+    return right;
+}
+
+/*
+ * Builds the tree of k cursors.
+ *
+ * @param tree          tree to build
+ * @param cursors       cursors to merge
+ * @param k             number of cursors, at least 1
+ * @exit                1 if error
+ */
+static void loser_tree_init(LoserTree *tree, MergeCursor *cursors, int k) {
+    tree->cursors = cursors;
+    tree->k = k;
+    safe_malloc((void **) &(tree->losers), sizeof(int) * k);
+    tree->winner = play_matches(tree, 1);
+}
+
+/*
+ * Returns the next Pair of the merge and moves past it, or NULL once
+ * every cursor has ended.
+ *
+ * @param tree          tree of the cursors
+ */
+static const Pair *loser_tree_pop(LoserTree *tree) {
+    int winner = tree->winner;
+    MergeCursor *cursor = &tree->cursors[winner];
+    if (cursor->cursor == cursor->end) {
+        return NULL;
+    }
+    const Pair *pair = &cursor->pairs[cursor->cursor++];
+
+    // replay the matches on the path from the winner's leaf to the root
+    for (int node = (winner + tree->k) / 2; node > 0; node /= 2) {
+        if (comes_before(tree, tree->losers[node], winner)) {
+            int loser = winner;
+            winner = tree->losers[node];
+            tree->losers[node] = loser;
+        }
+    }
+    tree->winner = winner;
+    return pair;
+}
+
+/*
+ * Writes Pairs at the end of what a range has written so far.
+ *
+ * @param range         range being merged
+ * @param pairs         Pairs to write
+ * @param npairs        number of Pairs
+ * @exit                1 if error
+ */
+static void write_range_pairs(MergeRange *range, const Pair *pairs,
+                              size_t npairs) {
+    const char *bytes = (const char *) pairs;
+    size_t nbytes = sizeof(Pair) * npairs;
+    off_t offset = range->offset + sizeof(Pair) * range->written;
+    while (nbytes > 0) {
+        ssize_t nwritten = pwrite(range->fd, bytes, nbytes, offset);
+        if (nwritten == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pwrite");
+            exit(1);
+        }
+        bytes += nwritten;
+        nbytes -= nwritten;
+        offset += nwritten;
+    }
+    range->written += npairs;
+}
+
+/*
+ * Merges a range into its place in the output, or into its spill file
+ * with combine. The Pairs of one key are combined only if there are
+ * several, a lone Pair is written as it was reduced.
+ *
+ * @param arg           the MergeRange
+ * @exit                1 if error
+ * @return              NULL
+ */
+static void *merge_range(void *arg) {
+    MergeRange *range = arg;
+    LoserTree tree;
+    loser_tree_init(&tree, range->cursors, range->ninputs);
+
+    Pair *buffer;
+    safe_malloc((void **) &buffer, sizeof(Pair) * MERGE_BUFFER_PAIRS);
+    size_t nbuffered = 0;
+
+    // values of the key being combined, linked in input order
+    LLValues *values = NULL;
+    size_t nvalues = 0;
+    size_t values_capacity = 0;
+    const Pair *first = NULL;
+
+    const Pair *pair;
+    do {
+        pair = loser_tree_pop(&tree);
+        if (range->combine && pair != NULL && first != NULL &&
+            strcmp(pair->key, first->key) == 0) {
+            if (nvalues == values_capacity) {
+                values_capacity = values_capacity * 2 + 16;
+                safe_realloc((void **) &values,
+                             sizeof(LLValues) * values_capacity);
+            }
+            if (nvalues == 0) {
+                strncpy(values[nvalues++].value, first->value, MAX_VALUE);
+            }
+            strncpy(values[nvalues++].value, pair->value, MAX_VALUE);
+            continue;
+        }
+
+        // the Pair before this one is complete
+        if (first != NULL) {
+            if (nbuffered == MERGE_BUFFER_PAIRS) {
+                write_range_pairs(range, buffer, nbuffered);
+                nbuffered = 0;
+            }
+            if (nvalues > 0) {
+                for (size_t v = 0; v + 1 < nvalues; v++) {
+                    values[v].next = &values[v + 1];
+                }
+                values[nvalues - 1].next = NULL;
+                buffer[nbuffered] = job_combine(first->key, values);
+                nvalues = 0;
+            } else {
+                buffer[nbuffered] = *first;
+            }
+            nbuffered++;
+        }
+        first = pair;
+    } while (pair != NULL);
+
+    write_range_pairs(range, buffer, nbuffered);
+    free(buffer);
+    free(values);
+    free(tree.losers);
+    return NULL;
+}
+
+/*
+ * Copies the Pairs a range merged into its spill file to the end of the
+ * output, and closes the spill file.
+ *
+ * @param range         range merged
+ * @param fd            output file
+ * @param offset        where the range goes in the output
+ * @exit                1 if error
+ */
+static void copy_spill(MergeRange *range, int fd, off_t offset) {
+    Pair *buffer;
+    safe_malloc((void **) &buffer, sizeof(Pair) * MERGE_BUFFER_PAIRS);
+    MergeRange out = {.fd = fd, .offset = offset, .written = 0};
+    off_t spilled = 0;
+    while (out.written < range->written) {
+        size_t npairs = range->written - out.written;
+        if (npairs > MERGE_BUFFER_PAIRS) {
+            npairs = MERGE_BUFFER_PAIRS;
+        }
+        ssize_t nread = pread(range->fd, buffer, sizeof(Pair) * npairs,
+                              spilled);
+        if (nread != (ssize_t) (sizeof(Pair) * npairs)) {
+            safe_fprintf(stderr, "Error reading a merge spill file\n");
+            exit(1);
+        }
+        spilled += nread;
+        write_range_pairs(&out, buffer, npairs);
+    }
+    free(buffer);
+    safe_close(range->fd);
+}
+
+/**
+ * Merges files of Pairs sorted by key into out_path, sorted by key, with
+ * nthreads threads. Pairs of equal keys are written in the order of the
+ * files they came from.
+ *
+ * @param paths         files to merge
+ * @param npaths        number of files, at least 1
+ * @param out_path      file to write, replaced if it exists
+ * @param combine       1 to combine the Pairs of a key into one with the
+ *                      job's combine(), or reduce() if it has none
+ * @param nthreads      threads to merge with, the caller included
+ * @exit                1 if error, or if a file is not sorted
+ * @return              number of Pairs written
+ */
+size_t merge_sorted_files(char **paths, int npaths, const char *out_path,
+                          int combine, int nthreads) {
+    MergeInput *inputs;
+    safe_malloc((void **) &inputs, sizeof(MergeInput) * npaths);
+    int largest = 0;
+    for (int i = 0; i < npaths; i++) {
+        map_input(&inputs[i], paths[i]);
+        if (inputs[i].npairs > inputs[largest].npairs) {
+            largest = i;
+        }
+    }
+
+    // fewer ranges than threads if there are too few Pairs to split
+    int nranges = nthreads < 1 ? 1 : nthreads;
+    if (nranges > MERGE_MAX_THREADS) {
+        nranges = MERGE_MAX_THREADS;
+    }
+    while (nranges > 1 && inputs[largest].npairs < (size_t) nranges *
+           MERGE_BUFFER_PAIRS) {
+        nranges--;
+    }
+
+    // range r starts at the key sampled at r / nranges of the largest input
+    MergeRange ranges[nranges];
+    MergeCursor *cursors;
+    safe_malloc((void **) &cursors, sizeof(MergeCursor) * npaths * nranges);
+    for (int r = 0; r < nranges; r++) {
+        ranges[r].cursors = cursors + r * npaths;
+        ranges[r].ninputs = npaths;
+        ranges[r].combine = combine;
+        ranges[r].written = 0;
+        const char *start = NULL;
+        if (r > 0) {
+            start = inputs[largest].pairs[inputs[largest].npairs * r /
+                                          nranges].key;
+        }
+        for (int i = 0; i < npaths; i++) {
+            MergeCursor *cursor = &ranges[r].cursors[i];
+            cursor->pairs = inputs[i].pairs;
+            cursor->cursor = start == NULL ? 0 : lower_bound(&inputs[i], start);
+            cursor->end = inputs[i].npairs;
+            if (r > 0) {
+                ranges[r - 1].cursors[i].end = cursor->cursor;
+            }
+        }
+    }
+
+    // truncating an input would pull its Pairs from under the merge
+    struct stat out_info;
+    if (stat(out_path, &out_info) == 0) {
+        for (int i = 0; i < npaths; i++) {
+            struct stat info;
+            if (stat(paths[i], &info) == 0 && info.st_dev == out_info.st_dev &&
+                info.st_ino == out_info.st_ino) {
+                safe_fprintf(stderr, "%s is also merged\n", out_path);
+                exit(1);
+            }
+        }
+    }
+
+    int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        safe_fprintf(stderr, "Error opening file '%s'\n", out_path);
+        exit(1);
+    }
+    off_t offset = 0;
+    for (int r = 0; r < nranges; r++) {
+        if (combine) {
+            FILE *spill = tmpfile();
+            if (spill == NULL) {
+                perror("tmpfile");
+                exit(1);
+            }
+            ranges[r].fd = dup(fileno(spill));
+            fclose(spill);
+            ranges[r].offset = 0;
+        } else {
+            ranges[r].fd = fd;
+            ranges[r].offset = offset;
+            for (int i = 0; i < npaths; i++) {
+                offset += sizeof(Pair) * (ranges[r].cursors[i].end -
+                                          ranges[r].cursors[i].cursor);
+            }
+        }
+    }
+
+    pthread_t threads[nranges];
+    for (int r = 1; r < nranges; r++) {
+        if (pthread_create(&threads[r], NULL, merge_range, &ranges[r]) != 0) {
+            safe_fprintf(stderr, "Error starting a thread\n");
+            exit(1);
+        }
+    }
+    merge_range(&ranges[0]);
+    for (int r = 1; r < nranges; r++) {
+        pthread_join(threads[r], NULL);
+    }
+
+    size_t written = 0;
+    for (int r = 0; r < nranges; r++) {
+        if (combine) {
+            copy_spill(&ranges[r], fd, sizeof(Pair) * written);
+        }
+        written += ranges[r].written;
+    }
+    safe_close(fd);
+
+    for (int i = 0; i < npaths; i++) {
+        if (inputs[i].pairs != NULL) {
+            munmap((void *) inputs[i].pairs, sizeof(Pair) * inputs[i].npairs);
+        }
+    }
+    free(inputs);
+    free(cursors);
+    return written;
+}
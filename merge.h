@@ -0,0 +1,63 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "mapreduce.h"
+
+#define MERGE_BUFFER_PAIRS 4096     // Pairs written out at once
+#define MERGE_MAX_THREADS 64        // threads of a merge at most
+
+/*
+ * A sorted file of Pairs being merged, mapped into memory.
+ */
+typedef struct merge_input {
+    const char *path;
+    const Pair *pairs;      // NULL if the file is empty
+    size_t npairs;
+} MergeInput;
+
+/*
+ * A file's part of a key range of a merge: its Pairs from cursor to end.
+ */
+typedef struct merge_cursor {
+    const Pair *pairs;
+    size_t cursor;
+    size_t end;
+} MergeCursor;
+
+/*
+ * Tournament tree of the next Pairs of k cursors. Each internal node
+ * holds the cursor that lost the match played there, and winner the
+ * cursor with the smallest key, so the next winner is found by replaying
+ * the log2(k) matches on the path of the last one.
+ */
+typedef struct loser_tree {
+    MergeCursor *cursors;
+    int k;
+    int *losers;            // losers[n] for internal node n, 1 to k - 1
+    int winner;
+} LoserTree;
+
+/*
+ * A key range of a merge, merged by one thread into the output file.
+ */
+typedef struct merge_range {
+    MergeCursor *cursors;   // one per input file
+    int ninputs;
+    int fd;                 // output file, or a spill file with combine
+    off_t offset;           // where the range starts in fd
+    int combine;            // 1 to combine the Pairs of a key into one
+    size_t written;         // Pairs written
+} MergeRange;
+
+/*
+ * Merges files of Pairs sorted by key into out_path, sorted by key, with
+ * nthreads threads. With combine, Pairs of one key are combined into one
+ * with the job's combine() or reduce(). Returns the Pairs written.
+ */
+size_t merge_sorted_files(char **paths, int npaths, const char *out_path,
+                          int combine, int nthreads);
+
+#endif
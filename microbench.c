@@ -0,0 +1,485 @@
+/*
+ * Microbenchmarks of the engine's hot kernels, run with "make microbench".
+ *
+ * Each benchmark is calibrated to run for at least BENCH_SAMPLE_SECONDS per
+ * sample, warmed up with one sample, then timed over BENCH_SAMPLES samples.
+ * The median, minimum and spread of the time per operation are reported,
+ * with throughput for kernels that move bytes. Inputs are generated from a
+ * fixed seed or read from the texts directory, so runs are repeatable.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "channel.h"
+#include "hash.h"
+#include "linkedlist.h"
+#include "mapreduce.h"
+#include "utils.h"
+
+#define BENCH_SAMPLES 7             // timed samples per benchmark
+#define BENCH_SAMPLE_SECONDS 0.05   // shortest sample after calibration
+#define BENCH_SEED 12345            // of generated words
+#define CORPUS_DIR "texts/"         // fixed corpus mapped by word_freq
+#define TRANSPORT_PAIRS 65536       // Pairs sent per transport operation
+#define VOCABULARY 65536            // distinct words generated
+
+/*
+ * A kernel to time. run() performs iterations operations on state.
+ */
+typedef struct bench {
+    const char *name;
+    void (*run)(void *state, long iterations);
+    void *state;
+    size_t bytes_per_op;        // bytes an operation moves, 0 if none
+} Bench;
+
+static char words[VOCABULARY][MAX_KEY];
+static volatile unsigned long long sink;    // keeps results alive
+
+/*
+ * Seconds on a monotonic clock.
+ */
+static double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Compares doubles, for use with qsort.
+ */
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Times a benchmark and prints one line: median, minimum and relative
+ * standard deviation of nanoseconds per operation, and the median
+ * throughput if operations move bytes.
+ *
+ * @param bench         benchmark to run
+ */
+static void run_bench(const Bench *bench) {
+    // double the iterations until a sample is long enough to time
+    long iterations = 1;
+    double elapsed;
+    while (1) {
+        double started = now_seconds();
+        bench->run(bench->state, iterations);
+        elapsed = now_seconds() - started;
+        if (elapsed >= BENCH_SAMPLE_SECONDS) {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    // the calibration warmed caches up, time the samples
+    double ns_per_op[BENCH_SAMPLES];
+    double mean = 0;
+    for (int i = 0; i < BENCH_SAMPLES; i++) {
+        double started = now_seconds();
+        bench->run(bench->state, iterations);
+        ns_per_op[i] = (now_seconds() - started) * 1e9 / iterations;
+        mean += ns_per_op[i] / BENCH_SAMPLES;
+    }
+    double variance = 0;
+    for (int i = 0; i < BENCH_SAMPLES; i++) {
+        variance += (ns_per_op[i] - mean) * (ns_per_op[i] - mean) /
+                    (BENCH_SAMPLES - 1);
+    }
+    qsort(ns_per_op, BENCH_SAMPLES, sizeof(double), compare_doubles);
+    double median = ns_per_op[BENCH_SAMPLES / 2];
+
+    printf("%-36s %12.1f %12.1f %7.1f%%", bench->name, median, ns_per_op[0],
+           100 * sqrt(variance) / mean);
+    if (bench->bytes_per_op > 0) {
+        printf(" %10.1f", bench->bytes_per_op / median * 1e3);
+    }
+    printf("\n");
+}
+
+/*
+ * Fills words with distinct lowercase words of 3 to 12 letters, made
+ * from a fixed seed.
+ */
+static void generate_words() {
+    unsigned int state = BENCH_SEED;
+    for (int i = 0; i < VOCABULARY; i++) {
+        int length = 3 + i % 10;
+        for (int j = 0; j < length; j++) {
+            state = state * 1103515245 + 12345;
+            words[i][j] = 'a' + (state >> 16) % 26;
+        }
+        // a numeric suffix keeps the words distinct
+        snprintf(words[i] + length, MAX_KEY - length, "%d", i);
+    }
+}
+
+/*
+ * hash() of the words, one word per operation.
+ */
+static void run_hash(void *state, long iterations) {
+    unsigned long long total = 0;
+    for (long i = 0; i < iterations; i++) {
+        total += hash(words[i % VOCABULARY]);
+    }
+    sink = total;
+}
+
+/*
+ * Prints how evenly hash() spreads the words over r reduce partitions,
+ * for r from 2 to 1024: the fullest and emptiest partition relative to
+ * the mean, and the chi-squared statistic divided by its r - 1 degrees
+ * of freedom, which is close to 1 for a uniform hash.
+ */
+static void report_hash_distribution() {
+    printf("\nhash() over %d distinct words\n", VOCABULARY);
+    printf("%-12s %12s %12s %14s\n", "partitions", "max/mean", "min/mean",
+           "chi2/df");
+
+    for (int r = 2; r <= 1024; r *= 2) {
+        int counts[r];
+        memset(counts, 0, sizeof(counts));
+        for (int i = 0; i < VOCABULARY; i++) {
+            counts[hash(words[i]) % r]++;
+        }
+
+        double mean = (double) VOCABULARY / r;
+        int most = counts[0];
+        int least = counts[0];
+        double chi2 = 0;
+        for (int i = 0; i < r; i++) {
+            most = counts[i] > most ? counts[i] : most;
+            least = counts[i] < least ? counts[i] : least;
+            chi2 += (counts[i] - mean) * (counts[i] - mean) / mean;
+        }
+        printf("%-12d %12.2f %12.2f %14.2f\n", r, most / mean, least / mean,
+               chi2 / (r - 1));
+    }
+    printf("\n");
+}
+
+/*
+ * State of benchmarks building the list of keys and values.
+ */
+typedef struct list_state {
+    int vocabulary;         // distinct keys among the inserted Pairs
+    int npairs;             // Pairs inserted per operation
+    Pair *pairs;
+} ListState;
+
+/*
+ * Makes npairs Pairs cycling over the first vocabulary words.
+ */
+static void make_list_state(ListState *state, int vocabulary, int npairs) {
+    state->vocabulary = vocabulary;
+    state->npairs = npairs;
+    safe_malloc((void **) &(state->pairs), sizeof(Pair) * npairs);
+    for (int i = 0; i < npairs; i++) {
+        // a prime stride scatters the keys over the vocabulary
+        strcpy(state->pairs[i].key, words[(i * 7919L) % vocabulary]);
+        strcpy(state->pairs[i].value, "1");
+    }
+}
+
+/*
+ * insert_into_keys() of every Pair into a new list, one Pair per operation.
+ */
+static void run_insert_into_keys(void *state, long iterations) {
+    ListState *list = state;
+    LLKeyValues *head = NULL;
+    for (long i = 0; i < iterations; i++) {
+        if (i % list->npairs == 0) {
+            free_key_values_list(head);
+            head = NULL;
+        }
+        insert_into_keys(&head, list->pairs[i % list->npairs]);
+    }
+    free_key_values_list(head);
+}
+
+/*
+ * build_sorted_run() of all the Pairs, as reducers group them, one Pair
+ * per operation.
+ */
+static void run_build_sorted_run(void *state, long iterations) {
+    ListState *list = state;
+    Pair *batch;
+    safe_malloc((void **) &batch, sizeof(Pair) * list->npairs);
+    for (long done = 0; done < iterations; done += list->npairs) {
+        memcpy(batch, list->pairs, sizeof(Pair) * list->npairs);
+        free_key_values_list(build_sorted_run(batch, list->npairs));
+    }
+    free(batch);
+}
+
+/*
+ * State of the map() benchmark.
+ */
+typedef struct corpus {
+    char *text;
+    size_t length;
+    int devnull;            // where map() writes its Pairs
+} Corpus;
+
+/*
+ * Reads every file of CORPUS_DIR into memory.
+ *
+ * @exit                1 if error
+ */
+static void read_corpus(Corpus *corpus) {
+    DIR *dir = opendir(CORPUS_DIR);
+    if (dir == NULL) {
+        safe_fprintf(stderr, "Error opening %s\n", CORPUS_DIR);
+        exit(1);
+    }
+
+    corpus->length = 0;
+    corpus->text = NULL;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char path[PATH_MAX];
+        snprintf(path, PATH_MAX, "%s%s", CORPUS_DIR, entry->d_name);
+        FILE *fin = safe_fopen(path, "r");
+        fseek(fin, 0, SEEK_END);
+        long size = ftell(fin);
+        rewind(fin);
+        safe_realloc((void **) &(corpus->text), corpus->length + size + 1);
+        corpus->length += safe_fread(corpus->text + corpus->length, 1, size,
+                                     fin);
+        safe_fclose(fin);
+    }
+    closedir(dir);
+
+    corpus->devnull = open("/dev/null", O_WRONLY);
+    if (corpus->devnull == -1) {
+        perror("open");
+        exit(1);
+    }
+}
+
+/*
+ * map() of the corpus in READSIZE chunks, as mappers call it, writing
+ * to /dev/null. One chunk per operation.
+ */
+static void run_map(void *state, long iterations) {
+    Corpus *corpus = state;
+    char chunk[READSIZE + 1];
+    size_t offset = 0;
+    for (long i = 0; i < iterations; i++) {
+        if (offset + READSIZE > corpus->length) {
+            offset = 0;
+        }
+        memcpy(chunk, corpus->text + offset, READSIZE);
+        chunk[READSIZE] = '\0';
+        map(chunk, corpus->devnull);
+        offset += READSIZE;
+    }
+}
+
+/*
+ * State of the Pair serialization benchmarks.
+ */
+typedef struct codec_state {
+    Pair *pairs;
+    char *wire;             // Pairs as sent through pipes
+    int npairs;
+} CodecState;
+
+/*
+ * Copies Pairs into a byte buffer as they are sent, one Pair per operation.
+ */
+static void run_serialize(void *state, long iterations) {
+    CodecState *codec = state;
+    for (long i = 0; i < iterations; i++) {
+        int slot = i % codec->npairs;
+        memcpy(codec->wire + sizeof(Pair) * slot, &codec->pairs[slot],
+               sizeof(Pair));
+    }
+}
+
+/*
+ * Reads Pairs out of a byte buffer into value nodes, as the reducer's
+ * lists copy them, one Pair per operation.
+ */
+static void run_deserialize(void *state, long iterations) {
+    CodecState *codec = state;
+    LLKeyValues node;
+    LLValues value;
+    unsigned long long total = 0;
+    for (long i = 0; i < iterations; i++) {
+        const Pair *pair = (const Pair *) (codec->wire +
+                                           sizeof(Pair) * (i % codec->npairs));
+        strncpy(node.key, pair->key, MAX_KEY - 1);
+        node.key[MAX_KEY - 1] = '\0';
+        strncpy(value.value, pair->value, MAX_VALUE - 1);
+        value.value[MAX_VALUE - 1] = '\0';
+        total += node.key[0] + value.value[0];
+    }
+    sink = total;
+}
+
+/*
+ * Forks a child that reads Pairs from a pipe until it is closed.
+ *
+ * @param fd            where the write end of the pipe is stored
+ * @return              pid of the child
+ */
+static pid_t start_pipe_reader(int *fd) {
+    int fds[2];
+    safe_pipe(fds);
+    pid_t pid = safe_fork();
+    if (pid == 0) {
+        safe_close(fds[WRITE_END]);
+        char buffer[sizeof(Pair) * 64];
+        while (safe_read(fds[READ_END], buffer, sizeof(buffer)) > 0) {
+        }
+        _exit(0);
+    }
+    safe_close(fds[READ_END]);
+    *fd = fds[WRITE_END];
+    return pid;
+}
+
+/*
+ * State of the transport benchmarks.
+ */
+typedef struct transport {
+    int batch;              // Pairs per write
+    Pair *pairs;
+} Transport;
+
+/*
+ * Sends Pairs through a pipe to another process, batch Pairs per write.
+ * One Pair per operation.
+ */
+static void run_pipe(void *state, long iterations) {
+    Transport *transport = state;
+    int fd;
+    pid_t pid = start_pipe_reader(&fd);
+    for (long sent = 0; sent < iterations; sent += transport->batch) {
+        safe_write(fd, transport->pairs, sizeof(Pair) * transport->batch);
+    }
+    safe_close(fd);
+    waitpid(pid, NULL, 0);
+}
+
+/*
+ * Sends Pairs through a shared memory channel to another process, as
+ * master feeds reducers. One Pair per operation.
+ */
+static void run_channel(void *state, long iterations) {
+    Transport *transport = state;
+    Channel *channel = channel_create(CHANNEL_PAIRS);
+    if (channel == NULL) {
+        return;
+    }
+
+    pid_t pid = safe_fork();
+    if (pid == 0) {
+        channel_become_consumer(channel);
+        char buffer[sizeof(Pair) * 64];
+        while (channel_read(channel, buffer, sizeof(buffer)) > 0) {
+        }
+        _exit(0);
+    }
+    channel_become_producer(channel);
+
+    for (long sent = 0; sent < iterations; sent++) {
+        while (!channel_has_room(channel, sizeof(Pair))) {
+            if (!channel_wait_for_room(channel, sizeof(Pair))) {
+                channel_answer_doorbell(channel);
+            }
+        }
+        channel_push(channel, &transport->pairs[sent % transport->batch],
+                     sizeof(Pair));
+        if (sent % transport->batch == transport->batch - 1) {
+            channel_publish(channel);
+        }
+    }
+    channel_close(channel);
+    waitpid(pid, NULL, 0);
+    channel_free(channel);
+}
+
+/*
+ * Runs every benchmark.
+ */
+int main() {
+    generate_words();
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%-36s %12s %12s %8s %10s\n", "benchmark", "median ns/op",
+           "min ns/op", "stddev", "MB/s");
+
+    Bench hash_bench = {"hash()", run_hash, NULL, 0};
+    run_bench(&hash_bench);
+
+    int vocabularies[] = {100, 1000, 10000};
+    for (int i = 0; i < 3; i++) {
+        ListState list;
+        make_list_state(&list, vocabularies[i], 2 * vocabularies[i]);
+        char name[2][64];
+        snprintf(name[0], 64, "insert_into_keys() %d keys",
+                 vocabularies[i]);
+        snprintf(name[1], 64, "build_sorted_run() %d keys",
+                 vocabularies[i]);
+        Bench insert = {name[0], run_insert_into_keys, &list, sizeof(Pair)};
+        Bench sorted = {name[1], run_build_sorted_run, &list, sizeof(Pair)};
+        run_bench(&insert);
+        run_bench(&sorted);
+        free(list.pairs);
+    }
+
+    Corpus corpus;
+    read_corpus(&corpus);
+    Bench map_bench = {"map() word_freq, " CORPUS_DIR, run_map, &corpus,
+                       READSIZE};
+    run_bench(&map_bench);
+    safe_close(corpus.devnull);
+    free(corpus.text);
+
+    CodecState codec = {.npairs = 1024};
+    ListState source;
+    make_list_state(&source, 1024, 1024);
+    codec.pairs = source.pairs;
+    safe_malloc((void **) &(codec.wire), sizeof(Pair) * codec.npairs);
+    Bench serialize = {"Pair serialize", run_serialize, &codec, sizeof(Pair)};
+    Bench deserialize = {"Pair deserialize", run_deserialize, &codec,
+                         sizeof(Pair)};
+    run_bench(&serialize);
+    run_bench(&deserialize);
+    free(codec.wire);
+
+    int batches[] = {1, 64};
+    for (int i = 0; i < 2; i++) {
+        Transport transport = {.batch = batches[i], .pairs = source.pairs};
+        char name[2][64];
+        snprintf(name[0], 64, "pipe transport, %d Pairs/write", batches[i]);
+        snprintf(name[1], 64, "channel transport, %d Pairs/publish",
+                 batches[i]);
+        Bench pipe_bench = {name[0], run_pipe, &transport, sizeof(Pair)};
+        Bench channel_bench = {name[1], run_channel, &transport,
+                               sizeof(Pair)};
+        run_bench(&pipe_bench);
+        run_bench(&channel_bench);
+    }
+    free(source.pairs);
+
+    report_hash_distribution();
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Merges the [pid].out files a job leaves, one per reducer, into one file
+ * sorted by key:
+ *
+ *     ./mrmerge -o result.out \[*\].out
+ *
+ * With -c, the Pairs of a key found in several files, as when the outputs
+ * of several jobs are merged, are combined into one with the job's
+ * combine() or reduce(). The job is the one linked in, or the last loaded
+ * with -j.
+ */
+
+#define _GNU_SOURCE
+
+#include <getopt.h>
+
+#include "job.h"
+#include "merge.h"
+#include "utils.h"
+
+/*
+ * Prints the usage and exits.
+ *
+ * @param program       name the program was run as
+ * @exit                1
+ */
+static void usage(const char *program) {
+    safe_fprintf(stderr, "usage: %s [-j job.so ...] [-c] [-t threads] "
+                 "-o outfile file ...\n", program);
+    safe_fprintf(stderr,
+     "\t-j job.so: combine with the job built as this plugin\n");
+    safe_fprintf(stderr,
+     "\t-c: combine the Pairs of a key with combine() or reduce()\n");
+    safe_fprintf(stderr,
+     "\t-t threads: threads to merge with (default the number of cpus)\n");
+    safe_fprintf(stderr,
+     "\t-o outfile: file to write the merged Pairs to\n");
+    exit(1);
+}
+
+/*
+ * Merges the files given on the command line.
+ */
+int main(int argc, char *argv[]) {
+    const char *out_path = NULL;
+    int combine = 0;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > MERGE_MAX_THREADS) {
+        nthreads = MERGE_MAX_THREADS;
+    }
+
+    int option;
+    while ((option = getopt(argc, argv, "j:ct:o:")) != -1) {
+        switch (option) {
+            case 'j':
+                load_job(optarg);
+                break;
+            case 'c':
+                combine = 1;
+                break;
+            case 't':
+                nthreads = strtol(optarg, NULL, 10);
+                if (nthreads <= 0 || nthreads > MERGE_MAX_THREADS) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (out_path == NULL || optind == argc) {
+        usage(argv[0]);
+    }
+
+    // a chain combines with its last job, which reduced the files
+    if (job_chain.nstages > 0) {
+        enter_stage(job_chain.nstages - 1);
+    }
+
+    size_t npairs = merge_sorted_files(argv + optind, argc - optind, out_path,
+                                       combine, nthreads);
+    safe_fprintf(stderr, "merged %d files into %zu pairs\n", argc - optind,
+                 npairs);
+    return 0;
+}
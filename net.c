@@ -0,0 +1,235 @@
+
+/*
+ * TCP helpers used by the coordinator and the worker daemons.
+ * Messages are a type and a payload length, both in network byte order,
+ * followed by the payload.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "net.h"
+#include "utils.h"
+
+/*
+ * Splits "host:port" into its parts.
+ *
+ * @param address       address to split
+ * @param host          buffer of MAX_HOST bytes for the host
+ * @param port          where to store the port
+ * @exit                1 if the address has no port
+ */
+void parse_address(const char *address, char *host, int *port) {
+    const char *colon = strrchr(address, ':');
+    if (colon == NULL || colon - address >= MAX_HOST) {
+        safe_fprintf(stderr, "Invalid address %s, expected host:port\n",
+                     address);
+        exit(1);
+    }
+
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+    *port = strtol(colon + 1, NULL, 10);
+}
+
+/*
+ * Listens for TCP connections on port.
+ *
+ * @param port          port to listen on, 0 for any free port
+ * @exit                1 if error
+ * @return              the listening socket
+ */
+int net_listen(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        exit(1);
+    }
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+        listen(fd, SOMAXCONN) == -1) {
+        safe_fprintf(stderr, "Error listening on port %d\n", port);
+        perror("bind");
+        exit(1);
+    }
+
+    return fd;
+}
+
+/*
+ * Returns the port a listening socket is bound to.
+ *
+ * @param fd            listening socket
+ * @exit                1 if error
+ */
+int net_local_port(int fd) {
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    if (getsockname(fd, (struct sockaddr *) &address, &length) == -1) {
+        perror("getsockname");
+        exit(1);
+    }
+
+    return ntohs(address.sin_port);
+}
+
+/*
+ * Disables batching of small writes, messages are sent as they are.
+ */
+static void set_nodelay(int fd) {
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+/*
+ * Connects to a TCP port on host.
+ *
+ * @param host          host name or address
+ * @param port          port to connect to
+ * @exit                1 if error
+ * @return              the connected socket
+ */
+int net_connect(const char *host, int port) {
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *addresses;
+    if (getaddrinfo(host, service, &hints, &addresses) != 0) {
+        safe_fprintf(stderr, "Cannot resolve %s\n", host);
+        exit(1);
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1 ||
+        connect(fd, addresses->ai_addr, addresses->ai_addrlen) == -1) {
+        safe_fprintf(stderr, "Cannot connect to %s:%d\n", host, port);
+        exit(1);
+    }
+    freeaddrinfo(addresses);
+
+    set_nodelay(fd);
+    return fd;
+}
+
+/*
+ * Accepts a connection on a listening socket.
+ *
+ * @param listen_fd     listening socket
+ * @exit                1 if error
+ * @return              the connected socket
+ */
+int net_accept(int listen_fd) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1) {
+        perror("accept");
+        exit(1);
+    }
+
+    set_nodelay(fd);
+    return fd;
+}
+
+/*
+ * Writes all bytes, a socket may accept only part of a write.
+ *
+ * @exit                1 if error
+ */
+static void send_all(int fd, const void *buf, size_t nbyte) {
+    const char *bytes = buf;
+    while (nbyte > 0) {
+        ssize_t written = write(fd, bytes, nbyte);
+        if (written <= 0) {
+            safe_fprintf(stderr, "Error sending to %d\n", fd);
+            exit(1);
+        }
+        bytes += written;
+        nbyte -= written;
+    }
+}
+
+/*
+ * Reads exactly nbyte bytes, a socket may return fewer per read.
+ *
+ * @exit                1 if error, or the stream ends mid-way
+ * @return              0 if the stream ended before any byte, else 1
+ */
+static int recv_all(int fd, void *buf, size_t nbyte) {
+    char *bytes = buf;
+    size_t total = 0;
+    while (total < nbyte) {
+        ssize_t nread = safe_read(fd, bytes + total, nbyte - total);
+        if (nread == 0) {
+            if (total == 0) {
+                return 0;
+            }
+            safe_fprintf(stderr, "Connection %d closed mid-message\n", fd);
+            exit(1);
+        }
+        total += nread;
+    }
+
+    return 1;
+}
+
+/*
+ * Sends a message of the given type and payload.
+ *
+ * @param fd            connected socket
+ * @param type          one of the MSG_ types
+ * @param payload       bytes of the message, may be NULL if length is 0
+ * @param length        bytes in payload
+ * @exit                1 if error
+ */
+void net_send_message(int fd, int type, const void *payload, size_t length) {
+    uint32_t header[2] = {htonl(type), htonl(length)};
+    send_all(fd, header, sizeof(header));
+    send_all(fd, payload, length);
+}
+
+/*
+ * Receives a message, allocating its payload. The caller frees it.
+ *
+ * @param fd            connected socket
+ * @param type          where to store the type
+ * @param payload       where to store the payload
+ * @param length        where to store the bytes in payload
+ * @exit                1 if error
+ * @return              0 if the peer closed the connection, else 1
+ */
+int net_recv_message(int fd, int *type, void **payload, size_t *length) {
+    uint32_t header[2];
+    if (!recv_all(fd, header, sizeof(header))) {
+        return 0;
+    }
+
+    *type = ntohl(header[0]);
+    *length = ntohl(header[1]);
+    // one spare byte so string payloads can be null-terminated
+    safe_malloc(payload, *length + 1);
+    ((char *) *payload)[*length] = '\0';
+    if (*length > 0 && !recv_all(fd, *payload, *length)) {
+        safe_fprintf(stderr, "Connection %d closed mid-message\n", fd);
+        exit(1);
+    }
+
+    return 1;
+}
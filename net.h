@@ -0,0 +1,72 @@
+#ifndef NET_H
+#define NET_H
+
+#include <stddef.h>
+
+#define MAX_HOST 64             // Max length of a host name, including null.
+
+// Types of messages between coordinator and worker daemons
+#define MSG_JOB 1               // coordinator -> worker: JobSpec
+#define MSG_JOB_ACK 2           // worker -> coordinator: shuffle port
+#define MSG_PEERS 3             // coordinator -> worker: PeerAddress list
+#define MSG_MAP_TASK 4          // coordinator -> worker: input file path
+#define MSG_TASK_DONE 5         // worker -> coordinator: task mapped
+#define MSG_MAP_END 6           // coordinator -> worker: no more tasks
+#define MSG_RESULT 7            // worker -> coordinator: reduced Pairs
+#define MSG_RESULT_END 8        // worker -> coordinator: job finished
+
+/*
+ * A job as the coordinator describes it to one worker.
+ * Fields are sent in network byte order.
+ */
+typedef struct job_spec {
+    int index;                  // partition the worker reduces
+    int nworkers;
+    int combine;                // 1 to combine map output per file
+    unsigned int job_hash[2];   // job_identity(), high word first
+} JobSpec;
+
+/*
+ * Where a worker accepts shuffle connections from its peers.
+ */
+typedef struct peer_address {
+    char host[MAX_HOST];
+    int port;                   // network byte order
+} PeerAddress;
+
+/*
+ * Splits "host:port" into its parts.
+ */
+void parse_address(const char *address, char *host, int *port);
+
+/*
+ * Listens for TCP connections on port, 0 for any free port.
+ */
+int net_listen(int port);
+
+/*
+ * Returns the port a listening socket is bound to.
+ */
+int net_local_port(int fd);
+
+/*
+ * Connects to a TCP port on host.
+ */
+int net_connect(const char *host, int port);
+
+/*
+ * Accepts a connection on a listening socket.
+ */
+int net_accept(int listen_fd);
+
+/*
+ * Sends a message of the given type and payload.
+ */
+void net_send_message(int fd, int type, const void *payload, size_t length);
+
+/*
+ * Receives a message, allocating its payload. Returns 0 at end of stream.
+ */
+int net_recv_message(int fd, int *type, void **payload, size_t *length);
+
+#endif
@@ -0,0 +1,124 @@
+
+/*
+ * Bounded queues used by master to buffer Pairs for each reducer,
+ * so a slow reducer does not block the routing of every other Pair.
+ */
+
+#include "pairqueue.h"
+#include "utils.h"
+
+/*
+ * Allocates an empty queue able to hold npairs Pairs.
+ *
+ * @param queue         queue to initialize
+ * @param npairs        capacity in Pairs
+ * @exit                1 if error
+ */
+void pair_queue_init(PairQueue *queue, int npairs) {
+    queue->capacity = sizeof(Pair) * npairs;
+    queue->head = 0;
+    queue->length = 0;
+    safe_malloc((void **) &(queue->buffer), queue->capacity);
+}
+
+/*
+ * Returns 1 if one more Pair fits in the queue, else 0.
+ *
+ * @param queue         queue to check
+ */
+int pair_queue_has_room(const PairQueue *queue) {
+    return pair_queue_has_room_for(queue, sizeof(Pair));
+}
+
+/*
+ * Returns 1 if nbyte more bytes fit in the queue, else 0.
+ *
+ * @param queue         queue to check
+ * @param nbyte         bytes to fit
+ */
+int pair_queue_has_room_for(const PairQueue *queue, size_t nbyte) {
+    return queue->capacity - queue->length >= nbyte;
+}
+
+/*
+ * Returns 1 if no bytes are waiting in the queue, else 0.
+ *
+ * @param queue         queue to check
+ */
+int pair_queue_is_empty(const PairQueue *queue) {
+    return queue->length == 0;
+}
+
+/*
+ * Appends a Pair to the queue, wrapping around the end of the buffer.
+ * The queue must have room.
+ *
+ * @param queue         queue to append to
+ * @param pair          Pair to copy into the queue
+ */
+void pair_queue_push(PairQueue *queue, const Pair *pair) {
+    pair_queue_push_bytes(queue, pair, sizeof(Pair));
+}
+
+/*
+ * Appends bytes to the queue, wrapping around the end of the buffer.
+ * The queue must have room.
+ *
+ * @param queue         queue to append to
+ * @param buf           bytes to copy into the queue
+ * @param nbyte         number of bytes
+ */
+void pair_queue_push_bytes(PairQueue *queue, const void *buf, size_t nbyte) {
+    size_t tail = (queue->head + queue->length) % queue->capacity;
+    size_t first = queue->capacity - tail;
+    if (first > nbyte) {
+        first = nbyte;
+    }
+
+    memcpy(queue->buffer + tail, buf, first);
+    memcpy(queue->buffer, (const char *) buf + first, nbyte - first);
+    queue->length += nbyte;
+}
+
+/*
+ * Writes as many queued bytes as fd accepts without blocking.
+ *
+ * @param queue         queue to drain
+ * @param fd            non-blocking file descriptor to write to
+ * @exit                1 if error
+ * @return              -1 if the reader of fd is gone, else 0
+ */
+int pair_queue_flush(PairQueue *queue, int fd) {
+    while (queue->length > 0) {
+        // write the contiguous bytes up to the end of the buffer
+        size_t contiguous = queue->capacity - queue->head;
+        if (contiguous > queue->length) {
+            contiguous = queue->length;
+        }
+
+        ssize_t written = safe_write_nonblocking(
+                                    fd, queue->buffer + queue->head, contiguous);
+        if (written == -1) {
+            return -1;
+        }
+        queue->head = (queue->head + written) % queue->capacity;
+        queue->length -= written;
+
+        if (written < contiguous) {
+            // fd is full
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Frees memory held by the queue.
+ *
+ * @param queue         queue to free
+ */
+void pair_queue_free(PairQueue *queue) {
+    free(queue->buffer);
+    queue->buffer = NULL;
+}
@@ -0,0 +1,63 @@
+#ifndef PAIRQUEUE_H
+#define PAIRQUEUE_H
+
+#include <stddef.h>
+
+#include "mapreduce.h"
+
+#define PAIR_QUEUE_PAIRS 256    // Pairs buffered by master for each reducer.
+
+/*
+ * Bounded FIFO of bytes of Pairs waiting to be written to a reducer.
+ * A Pair may be only partially written, so the queue tracks bytes.
+ */
+typedef struct pair_queue {
+    char *buffer;
+    size_t capacity;    // bytes
+    size_t head;        // offset of the first unwritten byte
+    size_t length;      // bytes queued
+} PairQueue;
+
+/*
+ * Allocates an empty queue able to hold npairs Pairs.
+ */
+void pair_queue_init(PairQueue *queue, int npairs);
+
+/*
+ * Returns 1 if one more Pair fits in the queue, else 0.
+ */
+int pair_queue_has_room(const PairQueue *queue);
+
+/*
+ * Returns 1 if nbyte more bytes fit in the queue, else 0.
+ */
+int pair_queue_has_room_for(const PairQueue *queue, size_t nbyte);
+
+/*
+ * Returns 1 if no bytes are waiting in the queue, else 0.
+ */
+int pair_queue_is_empty(const PairQueue *queue);
+
+/*
+ * Appends a Pair to the queue. The queue must have room.
+ */
+void pair_queue_push(PairQueue *queue, const Pair *pair);
+
+/*
+ * Appends nbyte bytes to the queue, such as an encoded Pair. The queue
+ * must have room.
+ */
+void pair_queue_push_bytes(PairQueue *queue, const void *buf, size_t nbyte);
+
+/*
+ * Writes as many queued bytes as fd accepts without blocking.
+ * Returns -1 if the reader of fd is gone, else 0.
+ */
+int pair_queue_flush(PairQueue *queue, int fd);
+
+/*
+ * Frees memory held by the queue.
+ */
+void pair_queue_free(PairQueue *queue);
+
+#endif
@@ -0,0 +1,237 @@
+
+/*
+ * Placement of master and its workers on CPUs. With --auto, master sizes
+ * the mappers and reducers from the CPUs it may run on and the size of
+ * the input, and pins every process to a CPU of its own where there are
+ * enough. Reducers are placed on master's NUMA node, as they read the
+ * shared memory rings master fills, and mappers on the CPUs left, which
+ * may be on other nodes. A pinned process first touches its own buffers,
+ * so they are allocated on its node.
+ */
+
+#define _GNU_SOURCE
+
+#include <linux/limits.h>
+#include <sched.h>
+
+#include "placement.h"
+#include "utils.h"
+
+// global variable
+Placement placement = {
+    .ncpus = 0,
+    .cpus = NULL,
+    .nodes = NULL,
+    .nnodes = 0,
+    .mapper_cpus = NULL,
+    .reducer_cpus = NULL
+};
+
+/*
+ * Marks the CPUs of a NUMA node, listed by the kernel as ranges such as
+ * "0-3,8-11". A missing node is skipped.
+ *
+ * @param node          NUMA node
+ * @param node_of       node of each CPU, indexed by CPU
+ * @return              1 if the node exists, else 0
+ */
+static int read_node_cpus(int node, int *node_of) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *cpulist = fopen(path, "r");
+    if (cpulist == NULL) {
+        return 0;
+    }
+
+    int first;
+    int last;
+    while (fscanf(cpulist, "%d", &first) == 1) {
+        last = first;
+        int separator = fgetc(cpulist);
+        if (separator == '-') {
+            if (fscanf(cpulist, "%d", &last) != 1) {
+                break;
+            }
+            separator = fgetc(cpulist);
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            node_of[cpu] = node;
+        }
+        if (separator != ',') {
+            break;
+        }
+    }
+
+    fclose(cpulist);
+    return 1;
+}
+
+/*
+ * Finds the CPUs master may run on and their NUMA nodes. Systems that do
+ * not report nodes are taken as a single node.
+ *
+ * @exit                1 if error
+ */
+void discover_cpus() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == -1) {
+        perror("sched_getaffinity");
+        exit(1);
+    }
+
+    int node_of[CPU_SETSIZE];
+    memset(node_of, 0, sizeof(node_of));
+    for (int node = 0; node < MAX_NODES; node++) {
+        read_node_cpus(node, node_of);
+    }
+    int current = sched_getcpu();
+    int home = (current >= 0 && current < CPU_SETSIZE) ? node_of[current] : 0;
+
+    placement.ncpus = CPU_COUNT(&allowed);
+    safe_malloc((void **) &(placement.cpus), sizeof(int) * placement.ncpus);
+    safe_malloc((void **) &(placement.nodes), sizeof(int) * placement.ncpus);
+
+    // the CPUs of master's node, then those of the other nodes
+    int seen[MAX_NODES] = {0};
+    int ncpus = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            int node = node_of[cpu];
+            if (!CPU_ISSET(cpu, &allowed) || (pass == 0) != (node == home)) {
+                continue;
+            }
+            placement.cpus[ncpus] = cpu;
+            placement.nodes[ncpus] = node;
+            ncpus++;
+            if (!seen[node]) {
+                seen[node] = 1;
+                placement.nnodes++;
+            }
+        }
+    }
+}
+
+/*
+ * Sizes the mappers and reducers left to AUTO_NWORKERS. There is one
+ * mapper per CPU, but no more than there are files, nor than the input
+ * keeps busy. Reducers sort while mappers map, so they get half of the
+ * CPUs at most, fewer for a small input.
+ *
+ * @param m             number of mappers, updated if AUTO_NWORKERS
+ * @param r             number of reducers, updated if AUTO_NWORKERS
+ * @param input_bytes   total size of the input files
+ * @param ntasks        number of input files
+ */
+void size_workers(int *m, int *r, long long input_bytes, int ntasks) {
+    if (*m == AUTO_NWORKERS) {
+        long long wanted = 1 + input_bytes / AUTO_MAP_BYTES;
+        *m = placement.ncpus;
+        if (*m > ntasks) {
+            *m = ntasks;
+        }
+        if (*m > wanted) {
+            *m = wanted;
+        }
+        if (*m < 1) {
+            *m = 1;
+        }
+    }
+    if (*r == AUTO_NWORKERS) {
+        long long wanted = 1 + input_bytes / AUTO_REDUCE_BYTES;
+        *r = placement.ncpus / 2;
+        if (*r > wanted) {
+            *r = wanted;
+        }
+        if (*r < 1) {
+            *r = 1;
+        }
+    }
+}
+
+/*
+ * Prints the CPUs and nodes of the workers of one role.
+ *
+ * @param role          name of the workers
+ * @param cpus          CPU of each worker
+ * @param n             number of workers
+ * @exit                1 if error
+ */
+static void report_cpus(const char *role, const int *cpus, int n) {
+    if (n == 0) {
+        return;
+    }
+
+    safe_fprintf(stderr, "master: %s on cpu/node", role);
+    for (int i = 0; i < n; i++) {
+        int node = 0;
+        for (int j = 0; j < placement.ncpus; j++) {
+            if (placement.cpus[j] == cpus[i]) {
+                node = placement.nodes[j];
+            }
+        }
+        safe_fprintf(stderr, " %d/%d", cpus[i], node);
+    }
+    safe_fprintf(stderr, "\n");
+}
+
+/**
+ * Assigns master, m mappers and r reducers to CPUs in the order of
+ * placement.cpus, wrapping around when there are more processes than
+ * CPUs. Master is pinned to its CPU, workers pin themselves once forked.
+ *
+ * @param m             number of mappers
+ * @param r             number of reducers
+ * @exit                1 if error
+ */
+void plan_placement(int m, int r) {
+    safe_malloc((void **) &(placement.mapper_cpus), sizeof(int) * (m + 1));
+    safe_malloc((void **) &(placement.reducer_cpus), sizeof(int) * (r + 1));
+
+    int next = 0;
+    int master_cpu = placement.cpus[next++ % placement.ncpus];
+    for (int i = 0; i < r; i++) {
+        placement.reducer_cpus[i] = placement.cpus[next++ % placement.ncpus];
+    }
+    for (int i = 0; i < m; i++) {
+        placement.mapper_cpus[i] = placement.cpus[next++ % placement.ncpus];
+    }
+    pin_to_cpu(master_cpu);
+
+    safe_fprintf(stderr, "master: %d mappers and %d reducers on %d cpus "
+                 "in %d NUMA nodes\n", m, r, placement.ncpus,
+                 placement.nnodes);
+    report_cpus("master", &master_cpu, 1);
+    report_cpus("reducers", placement.reducer_cpus, r);
+    report_cpus("mappers", placement.mapper_cpus, m);
+}
+
+/*
+ * Pins the calling process to a CPU.
+ *
+ * @param cpu           CPU to run on, -1 to leave the process unpinned
+ * @exit                1 if error
+ */
+void pin_to_cpu(int cpu) {
+    if (cpu == -1) {
+        return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &set) == -1) {
+        perror("sched_setaffinity");
+        exit(1);
+    }
+}
+
+/*
+ * Frees memory held by the placement.
+ */
+void free_placement() {
+    free(placement.cpus);
+    free(placement.nodes);
+    free(placement.mapper_cpus);
+    free(placement.reducer_cpus);
+}
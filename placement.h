@@ -0,0 +1,51 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#define AUTO_NWORKERS -1                // -m or -r sized by --auto
+#define AUTO_MAP_BYTES (1LL << 20)      // input worth one more mapper
+#define AUTO_REDUCE_BYTES (4LL << 20)   // input worth one more reducer
+#define MAX_NODES 64                    // NUMA nodes told apart
+
+/*
+ * Where master and its workers run. CPUs are listed starting with the
+ * NUMA node master runs on, so workers placed first are closest to it.
+ */
+typedef struct placement {
+    int ncpus;              // CPUs master may run on
+    int *cpus;              // those CPUs, master's node first
+    int *nodes;             // NUMA node of each of cpus
+    int nnodes;
+    int *mapper_cpus;       // CPU each mapper slot is pinned to, and
+    int *reducer_cpus;      //   of each reducer slot, NULL if not pinned
+} Placement;
+
+extern Placement placement;
+
+/*
+ * Finds the CPUs master may run on and their NUMA nodes.
+ */
+void discover_cpus();
+
+/*
+ * Sizes the mappers and reducers left to AUTO_NWORKERS from the CPUs
+ * and the input.
+ */
+void size_workers(int *m, int *r, long long input_bytes, int ntasks);
+
+/*
+ * Assigns master, m mappers and r reducers to CPUs, pins master to its
+ * CPU and reports the layout on stderr.
+ */
+void plan_placement(int m, int r);
+
+/*
+ * Pins the calling process to cpu, if it is not -1.
+ */
+void pin_to_cpu(int cpu);
+
+/*
+ * Frees memory held by the placement.
+ */
+void free_placement();
+
+#endif
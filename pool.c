@@ -0,0 +1,368 @@
+/*
+ * A pool of warm workers lets a job master of the job server run job
+ * after job without forking a mapper or reducer for each. A warm worker
+ * is forked once, then waits on its control socket for an assignment:
+ * the role, directory, plugins and settings of a job, along with the
+ * pipes master would have given a freshly forked worker. It runs the
+ * role as that worker would, until master ends its input, then drops
+ * the pipes, tells master it is done and waits for the next assignment.
+ *
+ * Master reads a worker's status where it would have reaped the worker.
+ * A worker that fails exits instead, and is reaped as usual.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "job.h"
+#include "mapper.h"
+#include "pool.h"
+#include "reducer.h"
+#include "utils.h"
+
+// global variable
+WorkerPool worker_pool = {
+    .active = 0,
+    .workers = NULL,
+    .nworkers = 0,
+    .capacity = 0,
+    .jobs = NULL,
+    .njobs = 0
+};
+
+
+/*
+ * Sends an assignment with the descriptors of the worker's stdin and
+ * stdout.
+ *
+ * @param control_fd    control socket of the worker
+ * @param assignment    assignment to send
+ * @param in_fd         becomes the worker's stdin
+ * @param out_fd        becomes the worker's stdout, -1 if none
+ * @return              1 if sent, 0 if the worker is gone
+ */
+static int send_assignment(int control_fd, const PoolAssignment *assignment,
+                           int in_fd, int out_fd) {
+    int fds[2] = {in_fd, out_fd};
+    int nfds = out_fd == -1 ? 1 : 2;
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+
+    struct iovec iov = {.iov_base = (void *) assignment,
+                        .iov_len = sizeof(PoolAssignment)};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1,
+                             .msg_control = control,
+                             .msg_controllen = CMSG_SPACE(sizeof(int) * nfds)};
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(header), fds, sizeof(int) * nfds);
+
+    return sendmsg(control_fd, &message, 0) == sizeof(PoolAssignment);
+}
+
+/*
+ * Receives an assignment and the descriptors sent with it.
+ *
+ * @param control_fd    control socket of this worker
+ * @param assignment    where to store the assignment
+ * @param in_fd         where to store the descriptor of stdin
+ * @param out_fd        where to store the descriptor of stdout, -1 if none
+ * @exit                1 if the assignment is malformed
+ * @return              1 if received, 0 if master is gone
+ */
+static int receive_assignment(int control_fd, PoolAssignment *assignment,
+                              int *in_fd, int *out_fd) {
+    int fds[2];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {.iov_base = assignment,
+                        .iov_len = sizeof(PoolAssignment)};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1,
+                             .msg_control = control,
+                             .msg_controllen = sizeof(control)};
+
+    ssize_t nread;
+    do {
+        nread = recvmsg(control_fd, &message, 0);
+    } while (nread == -1 && errno == EINTR);
+    if (nread <= 0) {
+        return 0;
+    }
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    int nfds = assignment->has_output ? 2 : 1;
+    if (nread != sizeof(PoolAssignment) || header == NULL ||
+        header->cmsg_type != SCM_RIGHTS ||
+        header->cmsg_len != CMSG_LEN(sizeof(int) * nfds)) {
+        safe_fprintf(stderr, "Malformed assignment of a warm worker\n");
+        exit(1);
+    }
+    memcpy(fds, CMSG_DATA(header), sizeof(int) * nfds);
+    *in_fd = fds[0];
+    *out_fd = nfds == 2 ? fds[1] : -1;
+    return 1;
+}
+
+/*
+ * Closes every descriptor a worker inherited from master but stderr and
+ * the ones it keeps, so it holds no end of the pipes of other workers.
+ *
+ * @param keep          descriptor to keep
+ * @param keep_too      another descriptor to keep
+ */
+static void close_inherited_fds(int keep, int keep_too) {
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir == NULL) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int fd = strtol(entry->d_name, NULL, 10);
+        if (entry->d_name[0] != '.' && fd > STDERR_FILENO && fd != keep &&
+            fd != keep_too && fd != dirfd(dir)) {
+            close(fd);
+        }
+    }
+    closedir(dir);
+}
+
+/*
+ * Runs the assignments master sends a warm worker, one after another.
+ *
+ * @param control_fd    control socket of this worker
+ * @exit                0 once master is gone, 1 if error
+ */
+static void serve_assignments(int control_fd) {
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd == -1) {
+        perror("open");
+        exit(1);
+    }
+    safe_dup2(null_fd, STDIN_FILENO);
+    safe_dup2(null_fd, STDOUT_FILENO);
+    close_inherited_fds(control_fd, null_fd);
+
+    PoolAssignment assignment;
+    int in_fd;
+    int out_fd;
+    while (receive_assignment(control_fd, &assignment, &in_fd, &out_fd)) {
+        if (chdir(assignment.cwd) == -1) {
+            perror("chdir");
+            exit(1);
+        }
+
+        // the same jobs and settings a worker forked by master inherits
+        reset_job_chain();
+        for (int j = 0; j < assignment.njobs; j++) {
+            load_job(assignment.jobs[j]);
+        }
+        if (assignment.njobs > 0) {
+            enter_stage(assignment.stage);
+        }
+        map_settings = assignment.map_settings;
+        map_settings.workdir = NULL;
+        reduce_settings = assignment.reduce_settings;
+
+        safe_dup2(in_fd, STDIN_FILENO);
+        safe_close(in_fd);
+        clearerr(stdin);
+        if (out_fd != -1) {
+            safe_dup2(out_fd, STDOUT_FILENO);
+            safe_close(out_fd);
+        }
+
+        if (assignment.role == POOL_MAPPER) {
+            map_digest_files();
+        } else {
+            reduce_process_pairs(NULL);
+        }
+
+        // master sees the end of the worker's output before its status
+        fflush(NULL);
+        safe_dup2(null_fd, STDIN_FILENO);
+        safe_dup2(null_fd, STDOUT_FILENO);
+        char status = 0;
+        if (send(control_fd, &status, 1, 0) != 1) {
+            break;
+        }
+    }
+
+    exit(0);
+}
+
+/*
+ * Forks a warm worker into the pool, idle.
+ *
+ * @exit                1 if error
+ * @return              index of the worker in the pool
+ */
+static int spawn_warm_worker() {
+    int control[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, control) == -1) {
+        perror("socketpair");
+        exit(1);
+    }
+
+    // buffered output would otherwise be flushed by the child as well
+    fflush(NULL);
+    pid_t pid = safe_fork();
+    if (pid == 0) {
+        serve_assignments(control[1]);
+    }
+    safe_close(control[1]);
+
+    if (worker_pool.nworkers == worker_pool.capacity) {
+        worker_pool.capacity = worker_pool.capacity > 0 ?
+                               worker_pool.capacity * 2 : POOL_WARM_WORKERS;
+        safe_realloc((void **) &(worker_pool.workers),
+                     sizeof(PooledWorker) * worker_pool.capacity);
+    }
+    PooledWorker *worker = &worker_pool.workers[worker_pool.nworkers];
+    worker->pid = pid;
+    worker->control_fd = control[0];
+    worker->idle = 1;
+    return worker_pool.nworkers++;
+}
+
+/*
+ * Removes a worker from the pool, closing its control socket.
+ *
+ * @param i             index of the worker
+ * @exit                1 if error
+ */
+static void remove_worker(int i) {
+    safe_close(worker_pool.workers[i].control_fd);
+    worker_pool.workers[i] = worker_pool.workers[--worker_pool.nworkers];
+}
+
+/*
+ * Makes master take its workers from a pool, forking the first warm
+ * workers.
+ *
+ * @exit                1 if error
+ */
+void pool_init() {
+    worker_pool.active = 1;
+    for (int i = 0; i < POOL_WARM_WORKERS; i++) {
+        spawn_warm_worker();
+    }
+}
+
+/*
+ * Sets the directory and plugins of the job the next assignments are for.
+ *
+ * @param cwd           directory the job was submitted from
+ * @param jobs          plugins of the chain
+ * @param njobs         0 to run the linked job
+ */
+void pool_begin_job(const char *cwd, char **jobs, int njobs) {
+    strncpy(worker_pool.cwd, cwd, PATH_MAX - 1);
+    worker_pool.cwd[PATH_MAX - 1] = '\0';
+    worker_pool.jobs = jobs;
+    worker_pool.njobs = njobs;
+}
+
+/**
+ * Gives a role to an idle warm worker, forking one if none is idle. The
+ * worker runs the stage of the chain master is in, with master's settings.
+ *
+ * @param role          POOL_MAPPER or POOL_REDUCER
+ * @param in_fd         becomes the worker's stdin
+ * @param out_fd        becomes the worker's stdout, -1 if none
+ * @exit                1 if error
+ * @return              pid of the worker
+ */
+pid_t pool_assign(int role, int in_fd, int out_fd) {
+    PoolAssignment assignment;
+    memset(&assignment, 0, sizeof(assignment));
+    assignment.role = role;
+    assignment.has_output = out_fd != -1;
+    strcpy(assignment.cwd, worker_pool.cwd);
+    assignment.njobs = worker_pool.njobs;
+    for (int j = 0; j < worker_pool.njobs; j++) {
+        strncpy(assignment.jobs[j], worker_pool.jobs[j], PATH_MAX - 1);
+    }
+    assignment.stage = job_chain.stage;
+    assignment.map_settings = map_settings;
+    assignment.reduce_settings = reduce_settings;
+
+    while (1) {
+        int i = 0;
+        while (i < worker_pool.nworkers && !worker_pool.workers[i].idle) {
+            i++;
+        }
+        if (i == worker_pool.nworkers) {
+            i = spawn_warm_worker();
+        }
+
+        PooledWorker *worker = &worker_pool.workers[i];
+        if (send_assignment(worker->control_fd, &assignment, in_fd, out_fd)) {
+            worker->idle = 0;
+            return worker->pid;
+        }
+
+        // the worker died while idle
+        pid_t pid = worker->pid;
+        remove_worker(i);
+        waitpid(pid, NULL, 0);
+    }
+}
+
+/**
+ * Waits for a worker to be done with its role. A worker that succeeded
+ * is idle again, unless the pool already keeps enough idle workers.
+ *
+ * @param pid           worker given a role
+ * @exit                1 if error
+ * @return              1 if the worker succeeded, else 0 once it exited,
+ *                      left for the caller to reap
+ */
+int pool_finish(pid_t pid) {
+    int i = 0;
+    while (i < worker_pool.nworkers && worker_pool.workers[i].pid != pid) {
+        i++;
+    }
+    if (i == worker_pool.nworkers) {
+        return 0;
+    }
+
+    char status;
+    ssize_t nread;
+    do {
+        nread = recv(worker_pool.workers[i].control_fd, &status, 1, 0);
+    } while (nread == -1 && errno == EINTR);
+    if (nread != 1) {
+        remove_worker(i);
+        return 0;
+    }
+
+    int nidle = 0;
+    for (int j = 0; j < worker_pool.nworkers; j++) {
+        nidle += worker_pool.workers[j].idle;
+    }
+    if (nidle >= POOL_MAX_IDLE) {
+        // the worker exits once its control socket is closed
+        remove_worker(i);
+        waitpid(pid, NULL, 0);
+    } else {
+        worker_pool.workers[i].idle = 1;
+    }
+    return 1;
+}
+
+/*
+ * Kills every worker of the pool.
+ */
+void pool_kill() {
+    for (int i = 0; i < worker_pool.nworkers; i++) {
+        kill(worker_pool.workers[i].pid, SIGKILL);
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <linux/limits.h>
+#include <sys/types.h>
+
+#include "job.h"
+#include "mapper.h"
+#include "reducer.h"
+#include "utils.h"
+
+#define POOL_WARM_WORKERS (2 * DEFAULT_NWORKERS)  // forked before any job
+#define POOL_MAX_IDLE 32            // idle workers kept between jobs
+
+// Roles master gives a warm worker
+#define POOL_MAPPER 'M'
+#define POOL_REDUCER 'R'
+
+/*
+ * What a warm worker runs next. It is sent with the descriptors that
+ * become the worker's stdin and, if has_output is set, its stdout.
+ */
+typedef struct pool_assignment {
+    int role;
+    int has_output;
+    char cwd[PATH_MAX];             // directory the job was submitted from
+    int njobs;                      // plugins of the chain, 0 for the
+    char jobs[MAX_STAGES][PATH_MAX];    //   linked job
+    int stage;                      // of the chain the worker runs
+    MapSettings map_settings;       // without a work directory
+    ReduceSettings reduce_settings;
+} PoolAssignment;
+
+/*
+ * A worker forked once and given one role after another, as master's
+ * mappers and reducers of successive jobs.
+ */
+typedef struct pooled_worker {
+    pid_t pid;
+    int control_fd;         // assignments go out, a status byte comes back
+                            //   once the worker is done with one
+    int idle;
+} PooledWorker;
+
+/*
+ * Warm workers of a job master of the job server.
+ */
+typedef struct worker_pool {
+    int active;             // 1 if master takes its workers from the pool
+    PooledWorker *workers;
+    int nworkers;
+    int capacity;
+    char cwd[PATH_MAX];     // of the job being run
+    char **jobs;
+    int njobs;
+} WorkerPool;
+
+extern WorkerPool worker_pool;
+
+/*
+ * Makes master take its workers from a pool, forking the first warm
+ * workers.
+ */
+void pool_init();
+
+/*
+ * Sets the directory and plugins of the job the next assignments are for.
+ */
+void pool_begin_job(const char *cwd, char **jobs, int njobs);
+
+/*
+ * Gives a role to an idle warm worker, forking one if none is idle.
+ * in_fd becomes its stdin and out_fd, unless -1, its stdout. Returns the
+ * pid of the worker.
+ */
+pid_t pool_assign(int role, int in_fd, int out_fd);
+
+/*
+ * Waits for the worker to be done with its role. Returns 1 if it succeeded
+ * and is idle again, else 0 once it exited, left for the caller to reap.
+ */
+int pool_finish(pid_t pid);
+
+/*
+ * Kills every worker of the pool.
+ */
+void pool_kill();
+
+#endif
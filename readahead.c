@@ -0,0 +1,403 @@
+
+/*
+ * Read-ahead of mapper input. A file is read in blocks of
+ * READ_AHEAD_BLOCK bytes, READ_AHEAD_DEPTH of them in flight, so that a
+ * mapper maps a block while the next ones are read from disk. Reads are
+ * queued to io_uring, set up once per mapper. Where io_uring is missing
+ * or forbidden, a thread per file reads the blocks ahead instead.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "readahead.h"
+#include "utils.h"
+
+/*
+ * io_uring of this process, shared by the files it reads one at a time.
+ */
+static struct {
+    int fd;                         // -1 until set up
+    int unavailable;                // 1 if io_uring could not be set up
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring = {.fd = -1, .unavailable = 0};
+
+/*
+ * Sets up the io_uring of this process, if not yet done.
+ *
+ * @return              1 if io_uring is available, else 0
+ */
+static int setup_uring() {
+    if (uring.fd != -1) {
+        return 1;
+    }
+    if (uring.unavailable) {
+        return 0;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(SYS_io_uring_setup, READ_AHEAD_DEPTH, &params);
+    if (fd == -1) {
+        uring.unavailable = 1;
+        return 0;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes +
+                     params.cq_entries * sizeof(struct io_uring_cqe);
+    int single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && cq_size > sq_size) {
+        sq_size = cq_size;
+    }
+
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (!single_mmap && sq != MAP_FAILED) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                      IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(fd);
+        uring.unavailable = 1;
+        return 0;
+    }
+
+    uring.fd = fd;
+    uring.sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    uring.sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    uring.sq_array = (unsigned *) (sq + params.sq_off.array);
+    uring.sqes = sqes;
+    uring.cq_head = (unsigned *) (cq + params.cq_off.head);
+    uring.cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    uring.cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return 1;
+}
+
+/*
+ * Submits queued reads, and sleeps until min_complete reads completed.
+ *
+ * @exit                1 if error
+ */
+static void enter_uring(unsigned to_submit, unsigned min_complete) {
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (syscall(SYS_io_uring_enter, uring.fd, to_submit, min_complete,
+                   flags, NULL, 0) == -1) {
+        if (errno != EINTR) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+    }
+}
+
+/*
+ * Queues a read of what is left of a block to io_uring and submits it.
+ *
+ * @param input         file being read
+ * @param slot          index of the block in input->blocks
+ * @exit                1 if error
+ */
+static void submit_read(ReadAhead *input, int slot) {
+    ReadBlock *block = &input->blocks[slot];
+    block->iov.iov_base = block->data + block->length;
+    block->iov.iov_len = READ_AHEAD_BLOCK - block->length;
+
+    unsigned tail = *uring.sq_tail;
+    unsigned index = tail & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = input->fd;
+    sqe->off = block->offset + block->length;
+    sqe->addr = (unsigned long) &block->iov;
+    sqe->len = 1;
+    sqe->user_data = slot;
+    uring.sq_array[index] = index;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    input->inflight++;
+    enter_uring(1, 0);
+}
+
+/*
+ * Starts reading every block whose slot is free, up to READ_AHEAD_DEPTH
+ * blocks past the one the mapper reads next, and none past the end of
+ * the file once it is known.
+ *
+ * @param input         file being read
+ * @exit                1 if error
+ */
+static void submit_reads(ReadAhead *input) {
+    while (input->submitted < input->next + READ_AHEAD_DEPTH &&
+           (input->last == -1 || input->submitted <= input->last)) {
+        int slot = input->submitted % READ_AHEAD_DEPTH;
+        ReadBlock *block = &input->blocks[slot];
+        block->offset = (off_t) input->submitted * READ_AHEAD_BLOCK;
+        block->length = 0;
+        block->state = BLOCK_READING;
+        input->submitted++;
+        submit_read(input, slot);
+    }
+}
+
+/*
+ * Handles the completed reads of io_uring. A short read is continued
+ * until the block is full or the file ends.
+ *
+ * @param input         file being read
+ * @param wait          1 to sleep until at least one read completes
+ * @exit                1 if error
+ */
+static void complete_reads(ReadAhead *input, int wait) {
+    unsigned head = *uring.cq_head;
+    if (wait && head == __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+        enter_uring(0, 1);
+    }
+
+    while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+        int slot = cqe->user_data;
+        int result = cqe->res;
+        head++;
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+        input->inflight--;
+
+        ReadBlock *block = &input->blocks[slot];
+        if (result == -EINTR || result == -EAGAIN) {
+            submit_read(input, slot);
+            continue;
+        }
+        if (result < 0) {
+            errno = -result;
+            perror("read");
+            exit(1);
+        }
+
+        block->length += result;
+        if (result > 0 && block->length < READ_AHEAD_BLOCK && !input->stop) {
+            submit_read(input, slot);
+            continue;
+        }
+        block->state = BLOCK_READY;
+        long index = block->offset / READ_AHEAD_BLOCK;
+        if (block->length < READ_AHEAD_BLOCK &&
+            (input->last == -1 || index < input->last)) {
+            input->last = index;
+        }
+    }
+}
+
+/*
+ * Reads the blocks of a file ahead of the mapper, waiting for it to free
+ * their slots, until the file ends or the mapper stops reading.
+ *
+ * @param arg           the ReadAhead of the file
+ * @exit                1 if error
+ * @return              NULL
+ */
+static void *read_blocks(void *arg) {
+    ReadAhead *input = arg;
+
+    pthread_mutex_lock(&input->lock);
+    for (long next = 0; input->last == -1; next++) {
+        ReadBlock *block = &input->blocks[next % READ_AHEAD_DEPTH];
+        while (block->state != BLOCK_FREE && !input->stop) {
+            pthread_cond_wait(&input->changed, &input->lock);
+        }
+        if (input->stop) {
+            break;
+        }
+        block->offset = (off_t) next * READ_AHEAD_BLOCK;
+        block->length = 0;
+        block->state = BLOCK_READING;
+        pthread_mutex_unlock(&input->lock);
+
+        while (block->length < READ_AHEAD_BLOCK) {
+            ssize_t nread = pread(input->fd, block->data + block->length,
+                                  READ_AHEAD_BLOCK - block->length,
+                                  block->offset + block->length);
+            if (nread == -1 && errno == EINTR) {
+                continue;
+            }
+            if (nread == -1) {
+                perror("pread");
+                exit(1);
+            }
+            if (nread == 0) {
+                break;
+            }
+            block->length += nread;
+        }
+
+        pthread_mutex_lock(&input->lock);
+        block->state = BLOCK_READY;
+        if (block->length < READ_AHEAD_BLOCK) {
+            input->last = next;
+        }
+        pthread_cond_broadcast(&input->changed);
+    }
+    pthread_mutex_unlock(&input->lock);
+    return NULL;
+}
+
+/**
+ * Opens a file and starts reading its first blocks ahead.
+ *
+ * @param path          path of the file
+ * @exit                1 if error
+ * @return              the file being read
+ */
+ReadAhead *read_ahead_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        safe_fprintf(stderr, "Error opening file '%s'\n", path);
+        exit(1);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    ReadAhead *input;
+    safe_malloc((void **) &input, sizeof(ReadAhead));
+    memset(input, 0, sizeof(ReadAhead));
+    input->fd = fd;
+    input->last = -1;
+
+    char *data;
+    safe_malloc((void **) &data, READ_AHEAD_BLOCK * READ_AHEAD_DEPTH);
+    for (int i = 0; i < READ_AHEAD_DEPTH; i++) {
+        input->blocks[i].data = data + i * READ_AHEAD_BLOCK;
+        input->blocks[i].state = BLOCK_FREE;
+    }
+
+    if (setup_uring()) {
+        submit_reads(input);
+        return input;
+    }
+
+    input->threaded = 1;
+    pthread_mutex_init(&input->lock, NULL);
+    pthread_cond_init(&input->changed, NULL);
+    int error = pthread_create(&input->reader, NULL, read_blocks, input);
+    if (error != 0) {
+        errno = error;
+        perror("pthread_create");
+        exit(1);
+    }
+    return input;
+}
+
+/*
+ * Frees the block the mapper read last and makes the next one current,
+ * waiting for it to be read.
+ *
+ * @param input         file being read
+ * @exit                1 if error
+ * @return              0 at the end of the file, else 1
+ */
+static int next_block(ReadAhead *input) {
+    if (input->threaded) {
+        pthread_mutex_lock(&input->lock);
+    }
+
+    if (input->next > 0) {
+        input->blocks[(input->next - 1) % READ_AHEAD_DEPTH].state = BLOCK_FREE;
+    }
+    if (input->threaded) {
+        pthread_cond_broadcast(&input->changed);
+    } else {
+        submit_reads(input);
+    }
+
+    int more = input->last == -1 || input->next <= input->last;
+    if (more) {
+        ReadBlock *block = &input->blocks[input->next % READ_AHEAD_DEPTH];
+        while (block->state != BLOCK_READY) {
+            if (input->threaded) {
+                pthread_cond_wait(&input->changed, &input->lock);
+            } else {
+                complete_reads(input, 1);
+            }
+        }
+        input->current = block->data;
+        input->current_length = block->length;
+        input->current_offset = 0;
+        input->next++;
+    }
+
+    if (input->threaded) {
+        pthread_mutex_unlock(&input->lock);
+    }
+    return more;
+}
+
+/**
+ * Copies the next nbyte bytes of a file to buf, waiting for them to be
+ * read if they are not yet.
+ *
+ * @param input         file being read
+ * @param buf           where to copy the bytes
+ * @param nbyte         bytes to copy
+ * @exit                1 if error
+ * @return              bytes copied, fewer than nbyte only at the end of
+ *                      the file
+ */
+size_t read_ahead_read(ReadAhead *input, char *buf, size_t nbyte) {
+    size_t copied = 0;
+    while (copied < nbyte) {
+        if (input->current_offset == input->current_length &&
+            !next_block(input)) {
+            break;
+        }
+
+        size_t available = input->current_length - input->current_offset;
+        size_t count = nbyte - copied < available ? nbyte - copied : available;
+        memcpy(buf + copied, input->current + input->current_offset, count);
+        input->current_offset += count;
+        copied += count;
+    }
+    return copied;
+}
+
+/**
+ * Stops reading a file ahead, waiting for reads in flight, and closes it.
+ *
+ * @param input         file being read
+ * @exit                1 if error
+ */
+void read_ahead_close(ReadAhead *input) {
+    if (input->threaded) {
+        pthread_mutex_lock(&input->lock);
+        input->stop = 1;
+        pthread_cond_broadcast(&input->changed);
+        pthread_mutex_unlock(&input->lock);
+        pthread_join(input->reader, NULL);
+        pthread_mutex_destroy(&input->lock);
+        pthread_cond_destroy(&input->changed);
+    } else {
+        // the kernel may still be writing to the blocks
+        input->stop = 1;
+        while (input->inflight > 0) {
+            complete_reads(input, 1);
+        }
+    }
+
+    close(input->fd);
+    free(input->blocks[0].data);
+    free(input);
+}
@@ -0,0 +1,65 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define READ_AHEAD_BLOCK (64 * 1024)    // bytes read at once, a multiple
+                                        //   of READSIZE
+#define READ_AHEAD_DEPTH 4              // blocks in flight per file
+
+// States of a block of a read-ahead buffer
+#define BLOCK_FREE 0        // read by the mapper, may be refilled
+#define BLOCK_READING 1     // being read from the file
+#define BLOCK_READY 2       // filled, waiting for the mapper
+
+/*
+ * A block of a file read ahead of the mapper.
+ */
+typedef struct read_block {
+    char *data;
+    size_t length;          // bytes read so far
+    off_t offset;           // of the block in the file
+    int state;
+    struct iovec iov;       // what is left to read, for io_uring
+} ReadBlock;
+
+/*
+ * A file read sequentially, with the next READ_AHEAD_DEPTH blocks read by
+ * io_uring or a reader thread while the mapper maps the current one.
+ */
+typedef struct read_ahead {
+    int fd;
+    ReadBlock blocks[READ_AHEAD_DEPTH];   // block i in blocks[i % DEPTH]
+    long next;              // block the mapper reads next
+    long submitted;         // blocks handed to io_uring so far
+    long last;              // block ending the file, -1 until read
+    int inflight;           // io_uring reads not yet completed
+    const char *current;    // block the mapper is reading, NULL if none
+    size_t current_offset;  // bytes of it already read
+    size_t current_length;
+    int threaded;           // 1 if read by a thread, 0 if by io_uring
+    pthread_t reader;
+    pthread_mutex_t lock;   // of the block states, with a reader thread
+    pthread_cond_t changed;
+    int stop;               // tells the reader thread to exit
+} ReadAhead;
+
+/*
+ * Opens a file and starts reading it ahead.
+ */
+ReadAhead *read_ahead_open(const char *path);
+
+/*
+ * Copies the next nbyte bytes of the file to buf, as fread does.
+ * Returns fewer than nbyte only at the end of the file.
+ */
+size_t read_ahead_read(ReadAhead *input, char *buf, size_t nbyte);
+
+/*
+ * Stops reading ahead and closes the file.
+ */
+void read_ahead_close(ReadAhead *input);
+
+#endif
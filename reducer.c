@@ -1,39 +1,352 @@
 /*
- A Map Worker receives file names via standard input,
- and outputs <key, value> Pairs through standard output
- using the currently defined map() function.
+ A Reduce Worker receives <key, value> Pairs via a shared memory channel
+ or standard input, and writes reduce() of every key to [pid].out. In a
+ chain of jobs, the reduced Pairs are instead mapped by the next job and
+ sent to master on standard output, which routes them to the reducers of
+ the next stage. For a top K query only the K best ranked results of the
+ partition are written, best first, for master to merge.
+
+ A reducer gathers its Pairs in one of two ways, depending on how master
+ sends them.
+
+ Master of a local job sends its Pairs with their keys dictionary
+ encoded (see keydict.c), and the reducer groups their values by the id
+ of their key as they arrive. Nothing is sorted while the map phase
+ runs. The distinct keys are sorted once, after master closes the input,
+ by several threads if the reducer has them (see keysort.c).
+
+ A reducer of a worker daemon in distributed mode reads plain Pairs. It
+ sorts each batch read into a run while the map phase is still
+ producing, and merges runs of equal size as they pile up (like carrying
+ in a binary counter), so once the input ends only a few runs are left
+ to merge.
+
+ Either way the sorted keys are then reduced a block at a time, each
+ thread reducing one range of the block, and the results are written in
+ order.
 */
 
+#include <pthread.h>
 #include <stdlib.h>
 
+#include "job.h"
+#include "keydict.h"
+#include "keysort.h"
 #include "linkedlist.h"
+#include "reducer.h"
+#include "stats.h"
+#include "topk.h"
+#include "trace.h"
 #include "utils.h"
 
+#define RUN_PAIRS 1024      // Pairs sorted together into one run.
+#define MAX_RUN_LEVELS 32   // run at level i holds about RUN_PAIRS * 2^i Pairs
+#define REDUCE_BLOCK_KEYS 8192  // keys reduced at once, split between
+                                //   the threads of the reducer
+
+// global variable
+ReduceSettings reduce_settings = {
+    .top_k = 0,
+    .encoded_keys = 0,
+    .threads = 1
+};
+
+/*
+ * Merge a newly sorted run into the pending runs, merging runs of
+ * equal level until an empty level is found.
+ *
+ * @param runs          pending runs indexed by level
+ * @param run           newly sorted run
+ */
+static void push_run(LLKeyValues **runs, LLKeyValues *run) {
+    int level = 0;
+    while (level < MAX_RUN_LEVELS - 1 && runs[level] != NULL) {
+        run = merge_key_values_lists(runs[level], run);
+        runs[level] = NULL;
+        level++;
+    }
+    runs[level] = merge_key_values_lists(runs[level], run);
+}
+
+/*
+ * Reads bytes master sent from input, or stdin if input is NULL.
+ *
+ * @param input         channel master feeds, NULL if it uses a pipe
+ * @param buf           where to read to
+ * @param nbyte         room in buf
+ * @exit                1 if error
+ * @return              bytes read, 0 once master is done
+ */
+static ssize_t read_input(Channel *input, void *buf, size_t nbyte) {
+    ssize_t read_result;
+    if (input != NULL) {
+        read_result = channel_read(input, buf, nbyte);
+    } else {
+        read_result = safe_read(STDIN_FILENO, buf, nbyte);
+    }
+    stats_add_input(read_result);
+    return read_result;
+}
+
 /*
- * Read Pairs from stdin and process as reduce worker.
+ * Reads Pairs from input and sorts them into runs merged as they pile
+ * up.
+ *
+ * @param input         channel master feeds, NULL if it uses a pipe
+ * @exit                1 if error, or if input ends within a Pair
+ * @return              sorted list of keys and their values
  */
-void reduce_process_pairs() {
-    Pair read_pair;
+static LLKeyValues *sort_pairs(Channel *input) {
+    Pair *batch;
+    safe_malloc((void **) &batch, sizeof(Pair) * RUN_PAIRS);
+    LLKeyValues *runs[MAX_RUN_LEVELS] = {NULL};
+
+    // read whole batches, a Pair may arrive split across reads
+    size_t filled = 0;
+    ssize_t read_result;
+    do {
+        read_result = read_input(input, (char *) batch + filled,
+                                 sizeof(Pair) * RUN_PAIRS - filled);
+        filled += read_result;
+
+        if (filled == sizeof(Pair) * RUN_PAIRS ||
+            (read_result == 0 && filled >= sizeof(Pair))) {
+            int npairs = filled / sizeof(Pair);
+            TRACE_BEGIN(sort_started);
+            LLKeyValues *run = build_sorted_run(batch, npairs);
+            TRACE_END(TRACE_SORT, sort_started);
+
+            TRACE_BEGIN(merge_started);
+            push_run(runs, run);
+            TRACE_END(TRACE_MERGE, merge_started);
+            filled -= npairs * sizeof(Pair);
+        }
+    } while (read_result > 0);
+
+    free(batch);
+    if (filled != 0) {
+        safe_fprintf(stderr, "Reducer input ends in a truncated Pair\n");
+        exit(1);
+    }
+
+    // finished reading all the Pairs input by master
+    // merge the remaining runs
+    stats_set_phase(PHASE_MERGING);
+    TRACE_BEGIN(merge_started);
     LLKeyValues *input_KV_list = NULL;
-    while (safe_read(STDIN_FILENO, &read_pair, sizeof(Pair)) > 0) {
-        insert_into_keys(&input_KV_list, read_pair);
+    for (int i = 0; i < MAX_RUN_LEVELS; i++) {
+        input_KV_list = merge_key_values_lists(runs[i], input_KV_list);
     }
+    TRACE_END(TRACE_MERGE, merge_started);
+    return input_KV_list;
+}
+
+/*
+ * Reads dictionary encoded Pairs from input and groups their values by
+ * the id of their key, in the order they arrive. The distinct keys are
+ * sorted once all are read.
+ *
+ * @param input         channel master feeds, NULL if it uses a pipe
+ * @exit                1 if error, or if input ends within a record
+ * @return              sorted list of keys and their values
+ */
+static LLKeyValues *group_encoded_pairs(Channel *input) {
+    size_t size = sizeof(Pair) * RUN_PAIRS;
+    char *buffer;
+    safe_malloc((void **) &buffer, size);
+
+    KeyDecoder decoder;
+    key_decoder_init(&decoder);
+    LLKeyValues **groups = NULL;    // values of each key id
+    LLValues **tails = NULL;        // last value of each key id
+    int ngroups = 0;
+    LLValues *value = NULL;         // decoded into, then linked
+
+    // a record may arrive split across reads
+    size_t filled = 0;
+    ssize_t read_result;
+    do {
+        read_result = read_input(input, buffer + filled, size - filled);
+        filled += read_result;
+
+        size_t used = 0;
+        while (1) {
+            if (value == NULL) {
+                safe_malloc((void **) &value, sizeof(LLValues));
+            }
+            int id;
+            size_t length = key_decoder_decode(&decoder, buffer + used,
+                                               filled - used, &id,
+                                               value->value);
+            if (length == 0) {
+                break;
+            }
+            used += length;
+
+            value->next = NULL;
+            if (id == ngroups) {
+                safe_realloc((void **) &groups,
+                             sizeof(LLKeyValues *) * decoder.nkeys);
+                safe_realloc((void **) &tails,
+                             sizeof(LLValues *) * decoder.nkeys);
+                safe_malloc((void **) &groups[id], sizeof(LLKeyValues));
+                strcpy(groups[id]->key, decoder.keys[id]);
+                groups[id]->head_value = value;
+                groups[id]->next = NULL;
+                ngroups++;
+            } else {
+                tails[id]->next = value;
+            }
+            tails[id] = value;
+            value = NULL;
+        }
 
-    // write to file [pid].out
-    char filename[MAX_FILENAME] = "";
-    sprintf(filename, "[%d].out", getpid());
-    FILE *fout = safe_fopen(filename, "wb");
+        memmove(buffer, buffer + used, filled - used);
+        filled -= used;
+    } while (read_result > 0);
 
-    // finished reading all the Pairs input from stdin by master
-    // process them
-    for (LLKeyValues *cur = input_KV_list; cur != NULL; cur = cur->next) {
-        Pair result = reduce(cur->key, cur->head_value);
-        safe_fwrite(&result, sizeof(Pair), 1, fout);
+    free(value);
+    free(buffer);
+    free(tails);
+    key_decoder_free(&decoder);
+    if (filled != 0) {
+        safe_fprintf(stderr, "Reducer input ends in a truncated record\n");
+        exit(1);
     }
 
-    safe_fclose(fout);
-    free_key_values_list(input_KV_list);
+    stats_set_phase(PHASE_MERGING);
+    TRACE_BEGIN(sort_started);
+    sort_groups(groups, ngroups, reduce_settings.threads);
+    for (int i = 0; i + 1 < ngroups; i++) {
+        groups[i]->next = groups[i + 1];
+    }
+    TRACE_END(TRACE_SORT, sort_started);
+
+    LLKeyValues *input_KV_list = ngroups > 0 ? groups[0] : NULL;
+    free(groups);
+    return input_KV_list;
+}
 
-    exit(0);
+/*
+ * Reduces a range of the keys of a block, in a thread of its own.
+ *
+ * @param arg           the ReduceRange
+ * @return              NULL
+ */
+static void *reduce_range(void *arg) {
+    ReduceRange *range = arg;
+    for (size_t i = 0; i < range->ngroups; i++) {
+        range->results[i] = job_reduce(range->groups[i]->key,
+                                       &range->groups[i]->head_value);
+    }
+    return NULL;
 }
 
+/*
+ * Reduces a block of keys into results, in order, splitting the block
+ * into one range per thread of the reducer.
+ *
+ * @param groups        keys of the block and their values
+ * @param results       room for ngroups results
+ * @param ngroups       number of keys
+ * @exit                1 if error
+ */
+static void reduce_block(LLKeyValues **groups, Pair *results,
+                         size_t ngroups) {
+    size_t nthreads = reduce_settings.threads;
+    if (nthreads > ngroups) {
+        nthreads = ngroups;
+    }
+    if (nthreads <= 1) {
+        ReduceRange range = {groups, results, ngroups};
+        reduce_range(&range);
+        return;
+    }
+
+    ReduceRange ranges[nthreads];
+    pthread_t threads[nthreads];
+    size_t start = 0;
+    for (size_t t = 0; t < nthreads; t++) {
+        size_t count = ngroups / nthreads + (t < ngroups % nthreads);
+        ranges[t].groups = groups + start;
+        ranges[t].results = results + start;
+        ranges[t].ngroups = count;
+        start += count;
+    }
+    // the first range is reduced by this thread, which is traced
+    for (size_t t = 1; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, reduce_range, &ranges[t]) != 0) {
+            safe_fprintf(stderr, "Error starting a thread\n");
+            exit(1);
+        }
+    }
+    reduce_range(&ranges[0]);
+    for (size_t t = 1; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+/*
+ * Read Pairs from input, or stdin if input is NULL, and process as
+ * reduce worker, until master ends the input.
+ *
+ * @param input         channel master feeds, NULL if it uses a pipe
+ * @exit                1 if error
+ */
+void reduce_process_pairs(Channel *input) {
+    stats_set_phase(PHASE_RECEIVING);
+    LLKeyValues *input_KV_list = reduce_settings.encoded_keys ?
+                                 group_encoded_pairs(input) :
+                                 sort_pairs(input);
+
+    stats_set_phase(PHASE_REDUCING);
+    // a chain hands the output to the next stage without writing a file
+    const Job *next_job = next_stage_job();
+    FILE *fout = NULL;
+    TopK top;
+    if (next_job == NULL) {
+        char filename[MAX_FILENAME] = "";
+        sprintf(filename, "[%d].out", getpid());
+        fout = safe_fopen(filename, "wb");
+        if (reduce_settings.top_k > 0) {
+            top_k_init(&top, reduce_settings.top_k);
+        }
+    }
+
+    LLKeyValues *block[REDUCE_BLOCK_KEYS];
+    Pair *results;
+    safe_malloc((void **) &results, sizeof(Pair) * REDUCE_BLOCK_KEYS);
+    LLKeyValues *cur = input_KV_list;
+    while (cur != NULL) {
+        size_t ngroups = 0;
+        for (; cur != NULL && ngroups < REDUCE_BLOCK_KEYS; cur = cur->next) {
+            block[ngroups++] = cur;
+        }
+        reduce_block(block, results, ngroups);
+
+        if (next_job != NULL) {
+            for (size_t i = 0; i < ngroups; i++) {
+                job_map_pair(next_job, &results[i], STDOUT_FILENO);
+            }
+        } else if (reduce_settings.top_k > 0) {
+            for (size_t i = 0; i < ngroups; i++) {
+                top_k_offer(&top, &results[i]);
+            }
+        } else {
+            safe_fwrite(results, sizeof(Pair), ngroups, fout);
+        }
+        stats_add_results(ngroups);
+    }
+    free(results);
+
+    if (fout != NULL) {
+        if (reduce_settings.top_k > 0) {
+            safe_fwrite(top.heap, sizeof(Pair), top_k_sort(&top), fout);
+            top_k_free(&top);
+        }
+        safe_fclose(fout);
+    }
+    free_key_values_list(input_KV_list);
+
+    stats_set_phase(PHASE_DONE);
+}
@@ -1,9 +1,38 @@
 #ifndef REDUCER_H
 #define REDUCER_H
 
+#include <stddef.h>
+
+#include "channel.h"
+#include "mapreduce.h"
+
+/*
+ * Settings of reduce workers, set by master before any reducer is forked.
+ */
+typedef struct reduce_settings {
+    int top_k;              // Pairs of the best ranked results to write,
+                            //   0 to write every result
+    int encoded_keys;       // 1 if master sends dictionary encoded Pairs,
+                            //   see keydict.c
+    int threads;            // threads sorting and reducing the keys of
+                            //   a reducer
+} ReduceSettings;
+
+/*
+ * A range of the keys of a block, reduced by one thread of a reducer.
+ */
+typedef struct reduce_range {
+    LLKeyValues **groups;
+    Pair *results;          // of the keys, in order
+    size_t ngroups;
+} ReduceRange;
+
+extern ReduceSettings reduce_settings;
+
 /*
- * Read Pairs from stdin and process as a reduce worker.
+ * Read Pairs from input, or stdin if input is NULL, and process as a
+ * reduce worker.
  */
-void reduce_process_pairs();
+void reduce_process_pairs(Channel *input);
 
 #endif
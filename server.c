@@ -0,0 +1,272 @@
+/*
+ * The job server runs the jobs submitted on a Unix socket, so many small
+ * jobs do not each pay for starting master and forking its workers.
+ *
+ * The server forks SERVER_MASTERS job masters that take turns accepting
+ * submissions. A job master runs one job at a time as master would, in
+ * the directory the job was submitted from, but takes its mappers and
+ * reducers from its pool of warm workers (see pool.c), which outlive the
+ * job. A job that fails ends its job master and the workers of its pool,
+ * the client sees its connection close, and the server forks another
+ * job master in its place.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "job.h"
+#include "master.h"
+#include "pool.h"
+#include "server.h"
+#include "utils.h"
+
+/*
+ * Fills the address of the Unix socket at path.
+ *
+ * @param address       address to fill
+ * @param path          path of the socket
+ * @exit                1 if the path is too long
+ */
+static void socket_address(struct sockaddr_un *address, const char *path) {
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        safe_fprintf(stderr, "Socket path %s is too long\n", path);
+        exit(1);
+    }
+    strcpy(address->sun_path, path);
+}
+
+/*
+ * Reads exactly nbyte bytes from a socket.
+ *
+ * @param fd            connected socket
+ * @param buf           where to read to
+ * @param nbyte         bytes to read
+ * @return              1 if read, 0 if the peer closed the connection
+ *                      or it failed
+ */
+static int read_fully(int fd, void *buf, size_t nbyte) {
+    size_t total = 0;
+    while (total < nbyte) {
+        ssize_t nread = read(fd, (char *) buf + total, nbyte - total);
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            return 0;
+        }
+        total += nread;
+    }
+    return 1;
+}
+
+/*
+ * Runs a submitted job in the job master, as master runs a local job.
+ *
+ * @param submission    job to run
+ * @exit                1 if the job fails
+ * @return              0 if the job succeeded, else 1
+ */
+static int run_submission(JobSubmission *submission) {
+    if (chdir(submission->cwd) == -1) {
+        perror("chdir");
+        return 1;
+    }
+
+    char *jobs[MAX_STAGES];
+    for (int j = 0; j < submission->njobs; j++) {
+        jobs[j] = submission->jobs[j];
+    }
+    MapReduceLogistics logistics = {
+        .nmapworkers = submission->nmapworkers,
+        .nreduceworkers = submission->nreduceworkers,
+        .reduce_threads = submission->reduce_threads,
+        .dirname = submission->dirname,
+        .workdir = NULL,
+        .resume = 0,
+        .combine = submission->combine,
+        .aggregate = submission->aggregate,
+        .approx = submission->approx,
+        .top_k = submission->top_k,
+        .auto_tune = 0,
+        .progress = 0,
+        .pack_bytes = submission->pack_bytes,
+        // warm reducers cannot map a channel created after their fork
+        .pipes = 1,
+        .jobs = jobs,
+        .njobs = submission->njobs,
+        .workers = NULL,
+        .daemon_port = 0
+    };
+
+    // forget the tasks of the last job, a new table is all zeros
+    memset(&task_table, 0, sizeof(task_table));
+    reset_job_chain();
+    for (int j = 0; j < submission->njobs; j++) {
+        load_job(jobs[j]);
+    }
+    pool_begin_job(submission->cwd, jobs, submission->njobs);
+
+    create_master(&logistics);
+    return 0;
+}
+
+/*
+ * Runs the jobs of the submissions a job master accepts, one at a time.
+ *
+ * @param listen_fd     socket clients connect to
+ * @exit                1 if error or a job fails
+ */
+static void serve_jobs(int listen_fd) {
+    // a client that went away is noticed by a failing write
+    signal(SIGPIPE, SIG_IGN);
+    pool_init();
+
+    JobSubmission submission;
+    while (1) {
+        int client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            exit(1);
+        }
+
+        if (read_fully(client_fd, &submission, sizeof(submission))) {
+            int status = run_submission(&submission);
+            if (write(client_fd, &status, sizeof(status)) == -1) {
+                // the client is gone, its output is written anyway
+            }
+        }
+        safe_close(client_fd);
+    }
+}
+
+/*
+ * Forks a job master.
+ *
+ * @param listen_fd     socket clients connect to
+ * @exit                1 if error
+ * @return              pid of the job master
+ */
+static pid_t spawn_job_master(int listen_fd) {
+    fflush(NULL);
+    pid_t pid = safe_fork();
+    if (pid == 0) {
+        serve_jobs(listen_fd);
+    }
+    return pid;
+}
+
+/**
+ * Serves jobs submitted on the Unix socket at socket_path, replacing
+ * any socket left there, and forks a new job master whenever one exits.
+ *
+ * @param socket_path   path of the socket
+ * @exit                1 if error
+ */
+void run_job_server(const char *socket_path) {
+    struct sockaddr_un address;
+    socket_address(&address, socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        perror("socket");
+        exit(1);
+    }
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+        listen(listen_fd, SOMAXCONN) == -1) {
+        safe_fprintf(stderr, "Error listening on %s\n", socket_path);
+        perror("bind");
+        exit(1);
+    }
+
+    pid_t masters[SERVER_MASTERS];
+    for (int i = 0; i < SERVER_MASTERS; i++) {
+        masters[i] = spawn_job_master(listen_fd);
+    }
+
+    while (1) {
+        pid_t pid = wait(NULL);
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("wait");
+            exit(1);
+        }
+        for (int i = 0; i < SERVER_MASTERS; i++) {
+            if (masters[i] == pid) {
+                masters[i] = spawn_job_master(listen_fd);
+            }
+        }
+    }
+}
+
+/**
+ * Runs a job on the job server listening at socket_path and waits for it.
+ * The output is written where a local run writes it.
+ *
+ * @param socket_path   path of the server's socket
+ * @param logistics     settings of the job
+ * @exit                1 if the server cannot be reached
+ * @return              0 if the job succeeded, else 1
+ */
+int submit_job(const char *socket_path, const MapReduceLogistics *logistics) {
+    JobSubmission submission;
+    memset(&submission, 0, sizeof(submission));
+    if (getcwd(submission.cwd, PATH_MAX) == NULL) {
+        perror("getcwd");
+        exit(1);
+    }
+    if (strlen(logistics->dirname) >= PATH_MAX) {
+        safe_fprintf(stderr, "Directory name %s is too long\n",
+                     logistics->dirname);
+        exit(1);
+    }
+    strcpy(submission.dirname, logistics->dirname);
+    submission.nmapworkers = logistics->nmapworkers;
+    submission.nreduceworkers = logistics->nreduceworkers;
+    submission.reduce_threads = logistics->reduce_threads;
+    submission.combine = logistics->combine;
+    submission.aggregate = logistics->aggregate;
+    submission.approx = logistics->approx;
+    submission.top_k = logistics->top_k;
+    submission.pack_bytes = logistics->pack_bytes;
+    submission.njobs = logistics->njobs;
+    for (int j = 0; j < logistics->njobs; j++) {
+        if (j == MAX_STAGES || strlen(logistics->jobs[j]) >= PATH_MAX) {
+            safe_fprintf(stderr, "Cannot submit job %s\n", logistics->jobs[j]);
+            exit(1);
+        }
+        strcpy(submission.jobs[j], logistics->jobs[j]);
+    }
+
+    struct sockaddr_un address;
+    socket_address(&address, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 ||
+        connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        safe_fprintf(stderr, "Error connecting to the job server at %s\n",
+                     socket_path);
+        perror("connect");
+        exit(1);
+    }
+
+    safe_write(fd, &submission, sizeof(submission));
+    int status;
+    if (!read_fully(fd, &status, sizeof(status))) {
+        safe_fprintf(stderr, "server: the job failed\n");
+        status = 1;
+    }
+    safe_close(fd);
+    return status;
+}
@@ -0,0 +1,41 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <linux/limits.h>
+
+#include "job.h"
+#include "utils.h"
+
+#define SERVER_MASTERS 4        // jobs the server runs at once
+
+/*
+ * A job sent to the job server, with the options a local run takes.
+ * Relative paths are relative to cwd.
+ */
+typedef struct job_submission {
+    char cwd[PATH_MAX];         // directory the job was submitted from
+    char dirname[PATH_MAX];
+    int nmapworkers;
+    int nreduceworkers;
+    int reduce_threads;
+    int combine;
+    int aggregate;
+    int approx;
+    int top_k;
+    long long pack_bytes;
+    int njobs;
+    char jobs[MAX_STAGES][PATH_MAX];
+} JobSubmission;
+
+/*
+ * Serves jobs submitted on the Unix socket at socket_path.
+ */
+void run_job_server(const char *socket_path);
+
+/*
+ * Runs a job on the job server listening at socket_path and waits for it.
+ * Returns 0 if the job succeeded.
+ */
+int submit_job(const char *socket_path, const MapReduceLogistics *logistics);
+
+#endif
@@ -0,0 +1,344 @@
+/*
+ * Sketches for approximate jobs, which count keys in fixed memory instead
+ * of keeping every distinct key. Each mapper counts the output of its
+ * task in a sketch and sends master the sketch instead of its Pairs, and
+ * master merges the sketches of all tasks.
+ *
+ * Frequencies come from a count-min sketch of SKETCH_DEPTH rows of
+ * SKETCH_WIDTH counters: a key adds its count to one counter per row, and
+ * its estimate is the smallest of them, which overestimates it by at most
+ * e / SKETCH_WIDTH of the total count with probability 1 - e^-DEPTH. The
+ * keys with the largest estimates are kept as heavy hitter candidates.
+ * Distinct keys are estimated with HyperLogLog, to within about
+ * 1.04 / sqrt(SKETCH_REGISTERS), 1.6%.
+ */
+
+#include <math.h>
+
+#include "hash.h"
+#include "sketch.h"
+#include "utils.h"
+
+/*
+ * Hashes a key to 64 well mixed bits. FNV-1a leaves the high bits of
+ * short keys poorly mixed, so its result is finished as splitmix64 does.
+ *
+ * @param key           key to hash
+ * @return              hash of the key
+ */
+static unsigned long long hash_key(const char *key) {
+    unsigned long long h = hash_content(CONTENT_HASH_SEED, key, strlen(key));
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+/*
+ * Returns the counter of a key in a row. Rows index by h1 + row * h2,
+ * two halves of the hash, which is as good as a hash per row.
+ *
+ * @param hash          hash of the key
+ * @param row           row of the count-min sketch
+ */
+static size_t counter_index(unsigned long long hash, int row) {
+    unsigned int h1 = hash;
+    unsigned int h2 = (hash >> 32) | 1;
+    return (h1 + row * h2) & (SKETCH_WIDTH - 1);
+}
+
+/*
+ * Estimates the count of a key from its hash.
+ *
+ * @param counters      counters to read
+ * @param hash          hash of the key
+ * @return              smallest counter of the key
+ */
+static unsigned long long estimate_hash(const SketchCounters *counters,
+                                        unsigned long long hash) {
+    unsigned long long estimate = counters->counts[0][counter_index(hash, 0)];
+    for (int row = 1; row < SKETCH_DEPTH; row++) {
+        unsigned long long count = counters->counts[row]
+                                                   [counter_index(hash, row)];
+        if (count < estimate) {
+            estimate = count;
+        }
+    }
+    return estimate;
+}
+
+/*
+ * Keeps a key as a heavy hitter candidate if it is one already, there is
+ * room, or its count beats the smallest candidate, which it replaces.
+ *
+ * @param sketch        sketch to update
+ * @param key           key offered
+ * @param hash          hash of the key
+ * @param count         estimated count of the key
+ */
+static void offer_candidate(Sketch *sketch, const char *key,
+                            unsigned long long hash,
+                            unsigned long long count) {
+    int smallest = 0;
+    for (int i = 0; i < sketch->ncandidates; i++) {
+        SketchCandidate *candidate = &sketch->candidates[i];
+        if (candidate->hash == hash && strcmp(candidate->key, key) == 0) {
+            candidate->count = count;
+            return;
+        }
+        if (candidate->count < sketch->candidates[smallest].count) {
+            smallest = i;
+        }
+    }
+
+    SketchCandidate *replaced;
+    if (sketch->ncandidates < SKETCH_CANDIDATES) {
+        replaced = &sketch->candidates[sketch->ncandidates++];
+    } else if (count > sketch->candidates[smallest].count) {
+        replaced = &sketch->candidates[smallest];
+    } else {
+        return;
+    }
+    strncpy(replaced->key, key, MAX_KEY - 1);
+    replaced->key[MAX_KEY - 1] = '\0';
+    replaced->hash = hash;
+    replaced->count = count;
+}
+
+/**
+ * Allocates an empty sketch.
+ *
+ * @exit                1 if error
+ * @return              the sketch
+ */
+Sketch *sketch_create() {
+    Sketch *sketch;
+    safe_malloc((void **) &sketch, sizeof(Sketch));
+    memset(&sketch->counters, 0, sizeof(SketchCounters));
+    sketch->ncandidates = 0;
+    return sketch;
+}
+
+/**
+ * Counts a Pair, by its value if it is a number, else as 1.
+ *
+ * @param sketch        sketch to count in
+ * @param pair          Pair to count
+ */
+void sketch_add_pair(Sketch *sketch, const Pair *pair) {
+    char *end;
+    unsigned long long count = strtoull(pair->value, &end, 10);
+    if (end == pair->value) {
+        count = 1;
+    }
+
+    SketchCounters *counters = &sketch->counters;
+    unsigned long long hash = hash_key(pair->key);
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        counters->counts[row][counter_index(hash, row)] += count;
+    }
+    counters->total += count;
+
+    // the register picked by the top bits keeps the longest run of
+    // leading zeros seen in the rest
+    size_t reg = hash >> (64 - SKETCH_REGISTER_BITS);
+    unsigned long long rest = hash << SKETCH_REGISTER_BITS;
+    unsigned char rank = 1;
+    while (rank <= 64 - SKETCH_REGISTER_BITS && !(rest >> 63)) {
+        rest <<= 1;
+        rank++;
+    }
+    if (rank > counters->registers[reg]) {
+        counters->registers[reg] = rank;
+    }
+
+    offer_candidate(sketch, pair->key, hash, estimate_hash(counters, hash));
+}
+
+/**
+ * Estimates the count of key, never less than the true count.
+ *
+ * @param sketch        sketch to read
+ * @param key           key to estimate
+ * @return              estimated count
+ */
+unsigned long long sketch_estimate(const Sketch *sketch, const char *key) {
+    return estimate_hash(&sketch->counters, hash_key(key));
+}
+
+/**
+ * Estimates the number of distinct keys counted, with the HyperLogLog
+ * harmonic mean, or by linear counting of empty registers while it is
+ * small enough for that to be more accurate.
+ *
+ * @param sketch        sketch to read
+ * @return              estimated number of distinct keys
+ */
+double sketch_distinct(const Sketch *sketch) {
+    double m = SKETCH_REGISTERS;
+    double sum = 0;
+    int empty = 0;
+    for (int i = 0; i < SKETCH_REGISTERS; i++) {
+        sum += ldexp(1, -sketch->counters.registers[i]);
+        if (sketch->counters.registers[i] == 0) {
+            empty++;
+        }
+    }
+
+    double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    if (estimate <= 2.5 * m && empty > 0) {
+        estimate = m * log(m / empty);
+    }
+    return estimate;
+}
+
+/**
+ * Writes the sketch to fd as Pairs: its counters, SKETCH_RECORD_BYTES at
+ * a time after SKETCH_RECORD_TAG in place of a key, then its candidates
+ * as Pairs of key and count.
+ *
+ * @param sketch        sketch to write
+ * @param fd            where to write it
+ * @exit                1 if error
+ */
+void sketch_write(const Sketch *sketch, int fd) {
+    size_t nrecords = (sizeof(SketchCounters) + SKETCH_RECORD_BYTES - 1) /
+                      SKETCH_RECORD_BYTES;
+    Pair *records;
+    safe_malloc((void **) &records,
+                sizeof(Pair) * (nrecords + sketch->ncandidates));
+    memset(records, 0, sizeof(Pair) * (nrecords + sketch->ncandidates));
+
+    const char *bytes = (const char *) &sketch->counters;
+    for (size_t i = 0; i < nrecords; i++) {
+        size_t offset = i * SKETCH_RECORD_BYTES;
+        size_t length = sizeof(SketchCounters) - offset;
+        if (length > SKETCH_RECORD_BYTES) {
+            length = SKETCH_RECORD_BYTES;
+        }
+        char *record = (char *) &records[i];
+        record[0] = SKETCH_RECORD_TAG;
+        memcpy(record + 1, bytes + offset, length);
+    }
+
+    for (int i = 0; i < sketch->ncandidates; i++) {
+        Pair *pair = &records[nrecords + i];
+        strcpy(pair->key, sketch->candidates[i].key);
+        snprintf(pair->value, MAX_VALUE, "%llu", sketch->candidates[i].count);
+    }
+
+    safe_write(fd, records, sizeof(Pair) * (nrecords + sketch->ncandidates));
+    free(records);
+}
+
+/**
+ * Merges a sketch written by sketch_write into sketch. Its candidates are
+ * offered with their estimates in the merged counters.
+ *
+ * @param sketch        sketch to merge into
+ * @param pairs         Pairs of the written sketch
+ * @param npairs        number of Pairs
+ * @exit                1 if the Pairs are not a sketch
+ */
+void sketch_merge_pairs(Sketch *sketch, const Pair *pairs, size_t npairs) {
+    if (npairs == 0) {
+        // an attempt that mapped no files sends nothing
+        return;
+    }
+
+    SketchCounters *merged;
+    safe_malloc((void **) &merged, sizeof(SketchCounters));
+    char *bytes = (char *) merged;
+    size_t offset = 0;
+    size_t p = 0;
+    for (; p < npairs && ((const char *) &pairs[p])[0] == SKETCH_RECORD_TAG;
+         p++) {
+        size_t length = sizeof(SketchCounters) - offset;
+        if (length > SKETCH_RECORD_BYTES) {
+            length = SKETCH_RECORD_BYTES;
+        }
+        if (length == 0) {
+            break;
+        }
+        memcpy(bytes + offset, (const char *) &pairs[p] + 1, length);
+        offset += length;
+    }
+    if (offset != sizeof(SketchCounters)) {
+        safe_fprintf(stderr, "Error merging a sketch of %zu Pairs\n", npairs);
+        exit(1);
+    }
+
+    SketchCounters *counters = &sketch->counters;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        for (int i = 0; i < SKETCH_WIDTH; i++) {
+            counters->counts[row][i] += merged->counts[row][i];
+        }
+    }
+    for (int i = 0; i < SKETCH_REGISTERS; i++) {
+        if (merged->registers[i] > counters->registers[i]) {
+            counters->registers[i] = merged->registers[i];
+        }
+    }
+    counters->total += merged->total;
+    free(merged);
+
+    // estimates of the candidates so far grew with the merge too
+    for (int i = 0; i < sketch->ncandidates; i++) {
+        SketchCandidate *candidate = &sketch->candidates[i];
+        candidate->count = estimate_hash(counters, candidate->hash);
+    }
+    for (; p < npairs; p++) {
+        unsigned long long hash = hash_key(pairs[p].key);
+        offer_candidate(sketch, pairs[p].key, hash,
+                        estimate_hash(counters, hash));
+    }
+}
+
+/*
+ * Compare two candidates by count, larger first, then key, for use with
+ * qsort.
+ */
+static int compare_candidates(const void *a, const void *b) {
+    const SketchCandidate *candidate_a = a;
+    const SketchCandidate *candidate_b = b;
+    if (candidate_a->count != candidate_b->count) {
+        return candidate_a->count > candidate_b->count ? -1 : 1;
+    }
+    return strcmp(candidate_a->key, candidate_b->key);
+}
+
+/**
+ * Writes the k keys of the sketch with the largest estimates to pairs,
+ * largest first, with the estimates as values. The candidates are sorted
+ * in place.
+ *
+ * @param sketch        sketch to read
+ * @param pairs         room for k Pairs
+ * @param k             number of keys wanted
+ * @return              number of Pairs written, at most
+ *                      SKETCH_CANDIDATES
+ */
+int sketch_heavy_hitters(Sketch *sketch, Pair *pairs, int k) {
+    qsort(sketch->candidates, sketch->ncandidates, sizeof(SketchCandidate),
+          compare_candidates);
+    if (k > sketch->ncandidates) {
+        k = sketch->ncandidates;
+    }
+    for (int i = 0; i < k; i++) {
+        strcpy(pairs[i].key, sketch->candidates[i].key);
+        snprintf(pairs[i].value, MAX_VALUE, "%llu",
+                 sketch->candidates[i].count);
+    }
+    return k;
+}
+
+/*
+ * Frees a sketch.
+ *
+ * @param sketch        sketch to free
+ */
+void sketch_free(Sketch *sketch) {
+    free(sketch);
+}
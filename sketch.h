@@ -0,0 +1,91 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stddef.h>
+
+#include "mapreduce.h"
+
+#define SKETCH_DEPTH 4              // rows of the count-min sketch
+#define SKETCH_WIDTH 2048           // counters per row, a power of two
+#define SKETCH_REGISTER_BITS 12     // of a hash picking a HyperLogLog
+                                    //   register
+#define SKETCH_REGISTERS (1 << SKETCH_REGISTER_BITS)
+#define SKETCH_CANDIDATES 128       // heavy hitters kept per sketch
+#define SKETCH_RECORD_TAG '\002'    // first byte of a Pair carrying sketch
+                                    //   counters, not a key
+#define SKETCH_RECORD_BYTES (sizeof(Pair) - 1)  // of counters per Pair
+
+/*
+ * The mergeable part of a sketch: a count-min sketch of the counts of
+ * keys and the HyperLogLog registers of the distinct keys. Two sketches
+ * merge by adding their counters and keeping the larger register.
+ */
+typedef struct sketch_counters {
+    unsigned long long counts[SKETCH_DEPTH][SKETCH_WIDTH];
+    unsigned char registers[SKETCH_REGISTERS];
+    unsigned long long total;       // of all counts added
+} SketchCounters;
+
+/*
+ * A key that may be among the most frequent, with its estimated count.
+ */
+typedef struct sketch_candidate {
+    char key[MAX_KEY];
+    unsigned long long hash;
+    unsigned long long count;
+} SketchCandidate;
+
+/*
+ * Approximate counts of the keys of a job in fixed memory: count-min
+ * frequencies, the SKETCH_CANDIDATES keys with the largest estimates, and
+ * an estimate of the number of distinct keys.
+ */
+typedef struct sketch {
+    SketchCounters counters;
+    SketchCandidate candidates[SKETCH_CANDIDATES];
+    int ncandidates;
+} Sketch;
+
+/*
+ * Allocates an empty sketch.
+ */
+Sketch *sketch_create();
+
+/*
+ * Counts a Pair, by its value if it is a number, else as 1.
+ */
+void sketch_add_pair(Sketch *sketch, const Pair *pair);
+
+/*
+ * Estimates the count of key, never less than the true count.
+ */
+unsigned long long sketch_estimate(const Sketch *sketch, const char *key);
+
+/*
+ * Estimates the number of distinct keys counted.
+ */
+double sketch_distinct(const Sketch *sketch);
+
+/*
+ * Writes the sketch to fd as Pairs: its counters in Pairs tagged with
+ * SKETCH_RECORD_TAG, then its candidates as Pairs of key and count.
+ */
+void sketch_write(const Sketch *sketch, int fd);
+
+/*
+ * Merges a sketch written by sketch_write into sketch.
+ */
+void sketch_merge_pairs(Sketch *sketch, const Pair *pairs, size_t npairs);
+
+/*
+ * Writes the k keys of the sketch with the largest estimates to pairs,
+ * largest first, with the estimates as values. Returns the number written.
+ */
+int sketch_heavy_hitters(Sketch *sketch, Pair *pairs, int k);
+
+/*
+ * Frees a sketch.
+ */
+void sketch_free(Sketch *sketch);
+
+#endif
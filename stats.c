@@ -0,0 +1,164 @@
+
+/*
+ * Counters workers publish in a shared memory segment, so master can
+ * report the progress of a running job. A worker writes its own counters
+ * with relaxed atomic stores and never waits on master, which reads them
+ * whenever it reports.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+
+#include "stats.h"
+#include "utils.h"
+
+// global variable
+StatsSegment *stats_segment = NULL;
+
+// global variable
+WorkerStats *worker_stats = NULL;
+
+/*
+ * Size of a segment for m mappers and r reducers.
+ */
+static size_t segment_size(int m, int r) {
+    return sizeof(StatsSegment) + sizeof(WorkerStats) * (m + r);
+}
+
+/*
+ * Creates the segment, shared with workers forked afterwards.
+ *
+ * @param m             number of mapper slots
+ * @param r             number of reducer slots
+ * @exit                1 if error
+ */
+void stats_create(int m, int r) {
+    void *memory = mmap(NULL, segment_size(m, r), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    // anonymous memory is zero filled, every worker starts idle
+    stats_segment = memory;
+    stats_segment->m = m;
+    stats_segment->r = r;
+}
+
+/*
+ * Returns the counters of mapper slot i.
+ *
+ * @param i             mapper slot
+ * @return              counters, NULL if there is no segment
+ */
+WorkerStats *stats_of_mapper(int i) {
+    if (stats_segment == NULL) {
+        return NULL;
+    }
+    return &stats_segment->workers[i];
+}
+
+/*
+ * Returns the counters of reducer slot i.
+ *
+ * @param i             reducer slot
+ * @return              counters, NULL if there is no segment
+ */
+WorkerStats *stats_of_reducer(int i) {
+    if (stats_segment == NULL) {
+        return NULL;
+    }
+    return &stats_segment->workers[stats_segment->m + i];
+}
+
+/*
+ * Zeroes counters before a worker starts in their slot.
+ *
+ * @param stats         counters of the slot, may be NULL
+ */
+void stats_reset(WorkerStats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    __atomic_store_n(&stats->phase, PHASE_IDLE, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->input_bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->task_bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->results, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Publishes what this worker is doing.
+ *
+ * @param phase         one of PHASE_*
+ */
+void stats_set_phase(int phase) {
+    if (worker_stats != NULL) {
+        __atomic_store_n(&worker_stats->phase, phase, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Adds to a counter of this worker, which no other process writes.
+ */
+static void add(unsigned long long *counter, unsigned long long n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+/*
+ * Counts input this worker read.
+ *
+ * @param nbytes        bytes read
+ */
+void stats_add_input(unsigned long long nbytes) {
+    if (worker_stats != NULL) {
+        add(&worker_stats->input_bytes, nbytes);
+        add(&worker_stats->task_bytes, nbytes);
+    }
+}
+
+/*
+ * Starts counting the input of a new map task.
+ */
+void stats_start_task() {
+    if (worker_stats != NULL) {
+        __atomic_store_n(&worker_stats->task_bytes, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Counts Pairs this reducer reduced.
+ *
+ * @param npairs        Pairs reduced
+ */
+void stats_add_results(unsigned long long npairs) {
+    if (worker_stats != NULL) {
+        add(&worker_stats->results, npairs);
+    }
+}
+
+/*
+ * Returns the letter shown for a phase in progress lines.
+ *
+ * @param phase         one of PHASE_*
+ */
+char stats_phase_letter(int phase) {
+    const char letters[] = "-mrsR.";
+    if (phase < 0 || phase > PHASE_DONE) {
+        return '?';
+    }
+    return letters[phase];
+}
+
+/*
+ * Unmaps the segment.
+ */
+void stats_free() {
+    if (stats_segment != NULL) {
+        munmap(stats_segment, segment_size(stats_segment->m,
+                                           stats_segment->r));
+        stats_segment = NULL;
+    }
+}
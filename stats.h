@@ -0,0 +1,86 @@
+#ifndef STATS_H
+#define STATS_H
+
+#define PROGRESS_SECONDS 1.0    // between progress lines of master
+
+// What a worker is doing
+#define PHASE_IDLE 0            // mapper waiting for a task
+#define PHASE_MAPPING 1         // mapper mapping an input file
+#define PHASE_RECEIVING 2       // reducer reading and sorting Pairs
+#define PHASE_MERGING 3         // reducer merging its sorted runs
+#define PHASE_REDUCING 4        // reducer running reduce() on every key
+#define PHASE_DONE 5            // worker exiting
+
+/*
+ * Counters one worker publishes. Each is written by its worker only, and
+ * read by master while the worker runs.
+ */
+typedef struct worker_stats {
+    int phase;
+    unsigned long long input_bytes; // of input files a mapper read, or
+                                    //   of Pairs a reducer read
+    unsigned long long task_bytes;  // of the current map task read
+    unsigned long long results;     // Pairs a reducer reduced
+} WorkerStats;
+
+/*
+ * Shared memory segment holding the counters of every worker slot, the
+ * m mappers followed by the r reducers.
+ */
+typedef struct stats_segment {
+    int m;
+    int r;
+    WorkerStats workers[];
+} StatsSegment;
+
+extern StatsSegment *stats_segment;
+
+/*
+ * Counters of this worker, NULL if it publishes none.
+ */
+extern WorkerStats *worker_stats;
+
+/*
+ * Creates the segment shared with workers forked afterwards.
+ */
+void stats_create(int m, int r);
+
+/*
+ * Returns the counters of mapper or reducer slot i, NULL without a segment.
+ */
+WorkerStats *stats_of_mapper(int i);
+WorkerStats *stats_of_reducer(int i);
+
+/*
+ * Zeroes counters before a worker starts in their slot.
+ */
+void stats_reset(WorkerStats *stats);
+
+/*
+ * Publishes what this worker is doing.
+ */
+void stats_set_phase(int phase);
+
+/*
+ * Counts input this worker read. A mapper starts counting a task anew
+ * with stats_start_task().
+ */
+void stats_add_input(unsigned long long nbytes);
+void stats_start_task();
+
+/*
+ * Counts Pairs this reducer reduced.
+ */
+void stats_add_results(unsigned long long npairs);
+
+/*
+ * Returns the letter shown for a phase in progress lines.
+ */
+char stats_phase_letter(int phase);
+
+/*
+ * Unmaps the segment.
+ */
+void stats_free();
+
+#endif
@@ -0,0 +1,110 @@
+
+/*
+ * Bounded selections of the best ranked reduced Pairs, for top K queries.
+ * Each reducer keeps the top K of its partition and master merges them,
+ * so no pass sorts all the results of a job.
+ */
+
+#include <stdlib.h>
+
+#include "job.h"
+#include "topk.h"
+#include "utils.h"
+
+/*
+ * Compare two Pairs by rank, best first, for use with qsort.
+ */
+static int compare_ranks(const void *a, const void *b) {
+    return job_rank(a, b);
+}
+
+/*
+ * Swaps two Pairs of the heap.
+ */
+static void swap_pairs(Pair *a, Pair *b) {
+    Pair tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+/*
+ * Allocates an empty selection of the k best Pairs.
+ *
+ * @param top           selection to initialize
+ * @param k             number of Pairs to keep
+ * @exit                1 if error
+ */
+void top_k_init(TopK *top, int k) {
+    top->k = k;
+    top->count = 0;
+    safe_malloc((void **) &(top->heap), sizeof(Pair) * k);
+}
+
+/*
+ * Moves the Pair at index i down the heap until no child ranks below it.
+ *
+ * @param top           selection whose heap to fix
+ * @param i             index of the Pair
+ */
+static void sift_down(TopK *top, int i) {
+    while (1) {
+        int worst = i;
+        for (int child = 2 * i + 1; child <= 2 * i + 2; child++) {
+            if (child < top->count &&
+                job_rank(&top->heap[child], &top->heap[worst]) > 0) {
+                worst = child;
+            }
+        }
+        if (worst == i) {
+            return;
+        }
+        swap_pairs(&top->heap[i], &top->heap[worst]);
+        i = worst;
+    }
+}
+
+/*
+ * Keeps pair if it ranks among the k best Pairs offered so far, evicting
+ * the worst kept Pair if the selection is full.
+ *
+ * @param top           selection to offer to
+ * @param pair          reduced Pair
+ */
+void top_k_offer(TopK *top, const Pair *pair) {
+    if (top->count < top->k) {
+        // move the new Pair up while it ranks below its parent
+        int i = top->count++;
+        top->heap[i] = *pair;
+        while (i > 0 && job_rank(&top->heap[i],
+                                 &top->heap[(i - 1) / 2]) > 0) {
+            swap_pairs(&top->heap[i], &top->heap[(i - 1) / 2]);
+            i = (i - 1) / 2;
+        }
+        return;
+    }
+
+    if (top->k > 0 && job_rank(pair, &top->heap[0]) < 0) {
+        top->heap[0] = *pair;
+        sift_down(top, 0);
+    }
+}
+
+/*
+ * Sorts the kept Pairs best first, in place of the heap.
+ *
+ * @param top           selection to sort
+ * @return              number of Pairs at the start of top->heap
+ */
+int top_k_sort(TopK *top) {
+    qsort(top->heap, top->count, sizeof(Pair), compare_ranks);
+    return top->count;
+}
+
+/*
+ * Frees memory held by the selection.
+ *
+ * @param top           selection to free
+ */
+void top_k_free(TopK *top) {
+    free(top->heap);
+}
@@ -0,0 +1,38 @@
+#ifndef TOPK_H
+#define TOPK_H
+
+#include "mapreduce.h"
+
+/*
+ * The k best ranked Pairs seen so far, by the job's rank(). They are kept
+ * in a heap with the worst of them at the root, so a Pair that does not
+ * make the cut is rejected with one comparison.
+ */
+typedef struct top_k {
+    Pair *heap;
+    int k;
+    int count;
+} TopK;
+
+/*
+ * Allocates an empty selection of the k best Pairs.
+ */
+void top_k_init(TopK *top, int k);
+
+/*
+ * Keeps pair if it ranks among the k best Pairs offered so far.
+ */
+void top_k_offer(TopK *top, const Pair *pair);
+
+/*
+ * Sorts the kept Pairs best first, in place of the heap. Returns the
+ * number of Pairs, nothing more can be offered.
+ */
+int top_k_sort(TopK *top);
+
+/*
+ * Frees memory held by the selection.
+ */
+void top_k_free(TopK *top);
+
+#endif
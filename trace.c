@@ -0,0 +1,330 @@
+
+/*
+ * Tracing compiled in with "make TRACE=1". Every span is counted in a
+ * latency histogram of its stage, with buckets eight to a power of two
+ * as in HDR histograms, and spans long enough to matter are also kept
+ * as events. Each worker saves its trace to a directory master made when
+ * it exits. Master merges them once the job is over into a latency table
+ * per role on stderr and a Chrome trace, which chrome://tracing or
+ * Perfetto show as a timeline of every process.
+ */
+
+#ifdef MR_TRACE
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "trace.h"
+#include "utils.h"
+
+#define TRACE_MAGIC "MRTRC01"   // first bytes of a saved trace
+
+/*
+ * Latencies of one stage. Bucket i counts spans of at least
+ * bucket_floor(i) nanoseconds.
+ */
+typedef struct histogram {
+    unsigned long long count;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long long buckets[TRACE_BUCKETS];
+} Histogram;
+
+/*
+ * A span kept for the Chrome trace.
+ */
+typedef struct trace_event {
+    int stage;
+    unsigned long long start;
+    unsigned long long duration;
+} TraceEvent;
+
+/*
+ * Header of a saved trace, followed by TRACE_STAGES histograms and
+ * nevents events.
+ */
+typedef struct trace_header {
+    char magic[8];
+    int role;
+    int pid;
+    int nevents;
+} TraceHeader;
+
+/*
+ * Trace of this process.
+ */
+static struct {
+    int role;                   // -1 until tracing started
+    pthread_t thread;           // traced, spans of other threads are not
+    unsigned long long origin;  // time master started, shared by workers
+    char dir[PATH_MAX];         // where workers save their traces
+    Histogram histograms[TRACE_STAGES];
+    TraceEvent *events;
+    int nevents;
+} tracer = {.role = -1};
+
+static const char *stage_names[TRACE_STAGES] = {
+    "read", "write", "select", "input", "map", "route", "sort", "merge",
+    "reduce"
+};
+
+static const char *role_names[TRACE_ROLES] = {"master", "mapper", "reducer"};
+
+/*
+ * Nanoseconds on the monotonic clock, shared by every process.
+ */
+unsigned long long trace_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Returns the bucket counting a span of ns nanoseconds.
+ */
+static int bucket_of(unsigned long long ns) {
+    if (ns < 16) {
+        return ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    int index = 16 + (exponent - 4) * 8 + ((ns >> (exponent - 3)) & 7);
+    return index < TRACE_BUCKETS ? index : TRACE_BUCKETS - 1;
+}
+
+/*
+ * Returns the shortest span counted by a bucket, in nanoseconds.
+ */
+static unsigned long long bucket_floor(int index) {
+    if (index < 16) {
+        return index;
+    }
+    int exponent = (index - 16) / 8 + 4;
+    return (8ULL + (index - 16) % 8) << (exponent - 3);
+}
+
+/*
+ * Counts a span of a stage that started at start, keeping it as an
+ * event if it is long enough and there is room. Only the thread that
+ * started tracing is traced, the trace is not shared between threads.
+ *
+ * @param stage         one of TRACE_* stages
+ * @param start         trace_now() when the span started
+ */
+void trace_span(int stage, unsigned long long start) {
+    if (tracer.role == -1 || !pthread_equal(pthread_self(), tracer.thread)) {
+        return;
+    }
+
+    unsigned long long duration = trace_now() - start;
+    Histogram *histogram = &tracer.histograms[stage];
+    histogram->count++;
+    histogram->total_ns += duration;
+    if (duration > histogram->max_ns) {
+        histogram->max_ns = duration;
+    }
+    histogram->buckets[bucket_of(duration)]++;
+
+    if (duration >= TRACE_SPAN_MIN_NS && tracer.nevents < TRACE_EVENTS) {
+        TraceEvent *event = &tracer.events[tracer.nevents++];
+        event->stage = stage;
+        event->start = start;
+        event->duration = duration;
+    }
+}
+
+/*
+ * Writes the trace of this process to the shared directory.
+ *
+ * @exit                1 if error
+ */
+static void save_trace() {
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/%d", tracer.dir, getpid());
+    FILE *fout = safe_fopen(path, "wb");
+
+    TraceHeader header = {
+        .role = tracer.role,
+        .pid = getpid(),
+        .nevents = tracer.nevents
+    };
+    strncpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    safe_fwrite(&header, sizeof(TraceHeader), 1, fout);
+    safe_fwrite(tracer.histograms, sizeof(Histogram), TRACE_STAGES, fout);
+    safe_fwrite(tracer.events, sizeof(TraceEvent), tracer.nevents, fout);
+    safe_fclose(fout);
+}
+
+/*
+ * Saves the trace of a worker as it exits.
+ */
+static void save_worker_trace() {
+    if (tracer.role != -1 && tracer.role != TRACE_MASTER) {
+        save_trace();
+    }
+}
+
+/**
+ * Starts tracing this process. Master makes the directory its workers
+ * save their traces to, and a forked worker drops what its parent traced.
+ *
+ * @param role          TRACE_MASTER, or the role of a forked worker
+ * @exit                1 if error
+ */
+void trace_start(int role) {
+    if (role == TRACE_MASTER) {
+        snprintf(tracer.dir, PATH_MAX, "/tmp/mapreduce-trace-XXXXXX");
+        if (mkdtemp(tracer.dir) == NULL) {
+            perror("mkdtemp");
+            exit(1);
+        }
+        safe_malloc((void **) &(tracer.events),
+                    sizeof(TraceEvent) * TRACE_EVENTS);
+        tracer.origin = trace_now();
+
+        // workers inherit the handler, master saves its trace itself
+        atexit(save_worker_trace);
+    }
+
+    tracer.role = role;
+    tracer.thread = pthread_self();
+    tracer.nevents = 0;
+    memset(tracer.histograms, 0, sizeof(tracer.histograms));
+}
+
+/*
+ * Prints the latencies of every stage of a role that had spans.
+ *
+ * @param role          role of the processes
+ * @param histograms    merged histograms of the role
+ * @exit                1 if error
+ */
+static void print_latencies(int role, const Histogram *histograms) {
+    for (int stage = 0; stage < TRACE_STAGES; stage++) {
+        const Histogram *histogram = &histograms[stage];
+        if (histogram->count == 0) {
+            continue;
+        }
+
+        // lower bounds of the buckets holding the median and the 99th
+        unsigned long long p50 = 0;
+        unsigned long long p99 = 0;
+        unsigned long long seen = 0;
+        for (int i = 0; i < TRACE_BUCKETS; i++) {
+            seen += histogram->buckets[i];
+            if (p50 == 0 && seen * 2 >= histogram->count) {
+                p50 = bucket_floor(i);
+            }
+            if (seen * 100 >= histogram->count * 99) {
+                p99 = bucket_floor(i);
+                break;
+            }
+        }
+
+        safe_fprintf(stderr, "trace: %-8s %-7s %10llu %12.1f %10.1f "
+                     "%10.1f %10.1f\n", role_names[role], stage_names[stage],
+                     histogram->count, histogram->total_ns / 1e6, p50 / 1e3,
+                     p99 / 1e3, histogram->max_ns / 1e3);
+    }
+}
+
+/**
+ * Merges the traces master and its workers saved. Latencies of each role
+ * are printed on stderr, and every kept span is written to TRACE_JSON in
+ * the Chrome trace event format. The saved traces are removed.
+ *
+ * @exit                1 if error
+ */
+void trace_collect() {
+    save_trace();
+
+    DIR *dir = opendir(tracer.dir);
+    if (dir == NULL) {
+        perror("opendir");
+        exit(1);
+    }
+
+    FILE *json = safe_fopen(TRACE_JSON, "w");
+    safe_fprintf(json, "{\"traceEvents\":[\n");
+    int first = 1;
+
+    static Histogram merged[TRACE_ROLES][TRACE_STAGES];
+    memset(merged, 0, sizeof(merged));
+    Histogram histograms[TRACE_STAGES];
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char path[PATH_MAX + 256];
+        snprintf(path, sizeof(path), "%s/%s", tracer.dir, entry->d_name);
+        FILE *fin = safe_fopen(path, "rb");
+
+        TraceHeader header;
+        if (safe_fread(&header, sizeof(TraceHeader), 1, fin) != 1 ||
+            strncmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.role < 0 || header.role >= TRACE_ROLES ||
+            safe_fread(histograms, sizeof(Histogram), TRACE_STAGES,
+                       fin) != TRACE_STAGES) {
+            // a worker killed while saving its trace
+            safe_fclose(fin);
+            unlink(path);
+            continue;
+        }
+
+        for (int stage = 0; stage < TRACE_STAGES; stage++) {
+            Histogram *into = &merged[header.role][stage];
+            into->count += histograms[stage].count;
+            into->total_ns += histograms[stage].total_ns;
+            if (histograms[stage].max_ns > into->max_ns) {
+                into->max_ns = histograms[stage].max_ns;
+            }
+            for (int i = 0; i < TRACE_BUCKETS; i++) {
+                into->buckets[i] += histograms[stage].buckets[i];
+            }
+        }
+
+        safe_fprintf(json, "%s{\"name\":\"process_name\",\"ph\":\"M\","
+                     "\"pid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+                     first ? "" : ",\n", header.pid,
+                     role_names[header.role], header.pid);
+        first = 0;
+
+        TraceEvent event;
+        for (int i = 0; i < header.nevents &&
+             safe_fread(&event, sizeof(TraceEvent), 1, fin) == 1; i++) {
+            safe_fprintf(json, ",\n{\"name\":\"%s\",\"cat\":\"%s\","
+                         "\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                         "\"ts\":%.3f,\"dur\":%.3f}",
+                         stage_names[event.stage], role_names[header.role],
+                         header.pid, header.pid,
+                         (event.start - tracer.origin) / 1e3,
+                         event.duration / 1e3);
+        }
+
+        safe_fclose(fin);
+        unlink(path);
+    }
+
+    safe_fprintf(json, "\n]}\n");
+    safe_fclose(json);
+    closedir(dir);
+    rmdir(tracer.dir);
+
+    safe_fprintf(stderr, "trace: %-8s %-7s %10s %12s %10s %10s %10s\n",
+                 "role", "stage", "spans", "total ms", "p50 us", "p99 us",
+                 "max us");
+    for (int role = 0; role < TRACE_ROLES; role++) {
+        print_latencies(role, merged[role]);
+    }
+    safe_fprintf(stderr, "trace: timeline written to %s\n", TRACE_JSON);
+
+    free(tracer.events);
+    tracer.role = -1;
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Tracing of where time goes inside each process, compiled in with
+ * "make TRACE=1". Otherwise every macro below expands to nothing.
+ */
+
+// Stages timed by tracing
+#define TRACE_READ 0        // blocked reading a pipe or file
+#define TRACE_WRITE 1       // blocked writing a pipe or file
+#define TRACE_SELECT 2      // master waiting in select
+#define TRACE_INPUT 3       // mapper reading its input file
+#define TRACE_MAP 4         // map()
+#define TRACE_ROUTE 5       // master routing the Pairs of a task
+#define TRACE_SORT 6        // reducer sorting a run of Pairs
+#define TRACE_MERGE 7       // reducer merging runs
+#define TRACE_REDUCE 8      // reduce()
+#define TRACE_STAGES 9
+
+// Processes traced
+#define TRACE_MASTER 0
+#define TRACE_MAPPER 1
+#define TRACE_REDUCER 2
+#define TRACE_ROLES 3
+
+#define TRACE_BUCKETS 512           // of a latency histogram
+#define TRACE_EVENTS 65536          // spans kept per process for the trace
+#define TRACE_SPAN_MIN_NS 20000     // shorter spans are only counted
+#define TRACE_JSON "trace.json"     // Chrome trace written by master
+
+#ifdef MR_TRACE
+
+/*
+ * Starts timing a span, in a variable named name.
+ */
+#define TRACE_BEGIN(name) unsigned long long name = trace_now()
+
+/*
+ * Ends the span started as name, counting it for stage.
+ */
+#define TRACE_END(stage, name) trace_span(stage, name)
+
+/*
+ * Makes master the traced process, with a directory its workers share.
+ */
+#define TRACE_START_MASTER() trace_start(TRACE_MASTER)
+
+/*
+ * Makes a forked worker the traced process, dropping what its parent
+ * traced. The worker saves its trace when it exits.
+ */
+#define TRACE_START_WORKER(role) trace_start(role)
+
+/*
+ * Merges the traces of master and its workers, once they exited.
+ */
+#define TRACE_COLLECT() trace_collect()
+
+/*
+ * Nanoseconds on a clock shared by every process.
+ */
+unsigned long long trace_now();
+
+void trace_span(int stage, unsigned long long start);
+void trace_start(int role);
+void trace_collect();
+
+#else
+
+#define TRACE_BEGIN(name)
+#define TRACE_END(stage, name)
+#define TRACE_START_MASTER()
+#define TRACE_START_WORKER(role)
+#define TRACE_COLLECT()
+
+#endif
+
+#endif
@@ -4,8 +4,10 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 
+#include "trace.h"
 #include "utils.h"
 
 /*
@@ -22,6 +24,21 @@ void safe_malloc(void **buffer, size_t size) {
     }
 }
 
+/*
+ * realloc with error checking.
+ *
+ * @param buffer        pointer to the memory to resize
+ * @param size          bytes to resize to
+ */
+void safe_realloc(void **buffer, size_t size) {
+    void *resized = realloc(*buffer, size);
+    if (!resized) {
+        safe_fprintf(stderr, "Realloc failed\n");
+        exit(1);
+    }
+    *buffer = resized;
+}
+
 /**
  * Replaces current process with a given executable,
  * passing it a given array of arguments.
@@ -46,7 +63,9 @@ void safe_execvp(const char *file, char *const argv[]) {
  * @return              The bytes read.
  */
 ssize_t safe_read(int fildes, void *buf, size_t nbyte) {
+    TRACE_BEGIN(started);
     ssize_t result = read(fildes, buf, nbyte);
+    TRACE_END(TRACE_READ, started);
     if (result < 0) {
         safe_fprintf(stderr, "Error reading from a file descriptor.\n");
         exit(1);
@@ -80,7 +99,10 @@ size_t safe_fread(void *ptr, size_t size, size_t nmemb, FILE *stream){
  * @param nbyte   The size of the data.
  */
 void safe_write(int fildes, const void *buf, size_t nbyte){
-    if (write(fildes, buf, nbyte) != nbyte) {
+    TRACE_BEGIN(started);
+    ssize_t written = write(fildes, buf, nbyte);
+    TRACE_END(TRACE_WRITE, started);
+    if (written != nbyte) {
         safe_fprintf(stderr, "Error writing to %d.\n", fildes);
         switch(errno) {
             case EAGAIN:
@@ -126,6 +148,43 @@ void safe_write(int fildes, const void *buf, size_t nbyte){
     }
 }
 
+/**
+ * Writes what a non-blocking file descriptor accepts from buffer.
+ * @param fildes  The non-blocking file descriptor to write data into.
+ * @param buf     The source of the data.
+ * @param nbyte   The size of the data.
+ * @return        The bytes written, 0 if the descriptor is full,
+ *                -1 if the reading end of the pipe has been closed.
+ */
+ssize_t safe_write_nonblocking(int fildes, const void *buf, size_t nbyte) {
+    ssize_t result = write(fildes, buf, nbyte);
+    if (result < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        if (errno == EPIPE) {
+            return -1;
+        }
+        safe_fprintf(stderr, "Error writing to %d.\n", fildes);
+        perror("write");
+        exit(1);
+    }
+
+    return result;
+}
+
+/**
+ * Makes reads and writes on a file descriptor non-blocking.
+ * @param fildes  The file descriptor to change.
+ */
+void safe_set_nonblocking(int fildes) {
+    int flags = fcntl(fildes, F_GETFL);
+    if (flags == -1 || fcntl(fildes, F_SETFL, flags | O_NONBLOCK) == -1) {
+        safe_fprintf(stderr, "Error making %d non-blocking.\n", fildes);
+        exit(1);
+    }
+}
+
 /**
  * Writes binary data into a file stream.
  * @param ptr    A pointer to the data to be written.
@@ -234,7 +293,7 @@ pid_t safe_fork() {
  *
  * @param fd    the file descriptor for the pipe
  */
-void safe_pipe(int *fd) {
+void safe_pipe(int fd[2]) {
     if(pipe(fd) != 0) {
         safe_fprintf(stderr, "Error piping.\n");
         exit(1);
@@ -251,10 +310,35 @@ void safe_pipe(int *fd) {
  * @return            The number of file descriptors that are ready.
  */
 int safe_select(int nfds, fd_set *read_fds, fd_set *write_fds, fd_set *except_fds) {
+    TRACE_BEGIN(started);
     int result = select(nfds, read_fds, write_fds, except_fds, NULL);
+    TRACE_END(TRACE_SELECT, started);
     if (result <= 0) {
         safe_fprintf(stderr, "Error with select.\n");
         exit(1);
     }
     return result;
 }
+
+/**
+ * Waits for one or more file descriptors to be ready, or for a timeout.
+ *
+ * @param  nfds       The largest file descriptor to wait for.
+ * @param  read_fds   The read file descriptors to listen.
+ * @param  write_fds  The write file descriptors to listen.
+ * @param  except_fds The exception file descriptors to listen.
+ * @param  timeout    The longest time to wait.
+ * @return            The number of file descriptors that are ready,
+ *                    0 if the timeout expired.
+ */
+int safe_select_timeout(int nfds, fd_set *read_fds, fd_set *write_fds,
+                        fd_set *except_fds, struct timeval *timeout) {
+    TRACE_BEGIN(started);
+    int result = select(nfds, read_fds, write_fds, except_fds, timeout);
+    TRACE_END(TRACE_SELECT, started);
+    if (result < 0) {
+        safe_fprintf(stderr, "Error with select.\n");
+        exit(1);
+    }
+    return result;
+}
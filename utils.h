@@ -9,12 +9,37 @@
 #include <unistd.h>
 
 #define DEFAULT_NWORKERS 2       // The number of default workers
+#define MAX_REDUCE_THREADS 64    // Threads of a reducer at most
+
+#define READ_END 0               // Ends of a pipe() pair
+#define WRITE_END 1
 
 // Container for map reduce logistics
 typedef struct mapReduceLogistics {
     int nmapworkers;
     int nreduceworkers;
+    int reduce_threads; // threads of each reducer
     char *dirname;
+    char *workdir;      // where map output is persisted, NULL if not
+    int resume;         // 1 to reuse map output persisted in workdir
+    int combine;        // 1 to combine the output of each file with reduce()
+    int aggregate;      // 1 to aggregate the output by key without reducers
+    int approx;         // 1 to count keys approximately in sketches,
+                        //   without reducers
+    char *join_dir;     // small side of a broadcast join, NULL if none
+    int top_k;          // number of best ranked results to keep, 0 for all
+    int auto_tune;      // 1 to size workers for the machine and pin them
+    int progress;       // 1 to report progress on stderr while running
+    long long pack_bytes;  // pack small files into tasks of up to this
+                           //   many bytes, 0 to not pack
+    int pipes;          // 1 to feed reducers through pipes, not shared memory
+    char **jobs;        // shared objects of a chain of jobs, run in order
+    int njobs;          //   0 to run the linked job
+    char *workers;      // "host:port,..." of worker daemons, NULL if local
+    int daemon_port;    // port to serve jobs on as a worker daemon, 0 if not
+    char *server_socket;    // Unix socket to serve jobs on, NULL if not
+    char *submit_socket;    // Unix socket of the job server to run the job
+                            //   on, NULL to run it here
 } MapReduceLogistics;
 
 /**
@@ -22,6 +47,11 @@ typedef struct mapReduceLogistics {
  */
 void safe_malloc(void **buffer, size_t size);
 
+/**
+ * realloc with error checking.
+ */
+void safe_realloc(void **buffer, size_t size);
+
 /**
  * Replaces current process with a given executable,
  * passing it a given array of arguments.
@@ -43,6 +73,16 @@ size_t safe_fread(void *ptr, size_t size, size_t nmemb, FILE *stream);
  */
 void safe_write(int fildes, const void *buf, size_t nbyte);
 
+/**
+ * Writes what a non-blocking file descriptor accepts from buffer.
+ */
+ssize_t safe_write_nonblocking(int fildes, const void *buf, size_t nbyte);
+
+/**
+ * Makes reads and writes on a file descriptor non-blocking.
+ */
+void safe_set_nonblocking(int fildes);
+
 /**
  * Writes binary data into a file stream.
  */
@@ -95,4 +135,10 @@ void safe_pipe(int filedes[2]);
  */
 int safe_select(int nfds, fd_set *read_fds, fd_set *write_fds, fd_set *except_fdst);
 
+/**
+ * Waits for one or more file descriptors to be ready, or for a timeout.
+ */
+int safe_select_timeout(int nfds, fd_set *read_fds, fd_set *write_fds,
+                        fd_set *except_fds, struct timeval *timeout);
+
 #endif
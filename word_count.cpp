@@ -0,0 +1,48 @@
+/*
+ * word_freq.c as a typed C++ job: counts the words of the input, lower
+ * cased and without punctuation. Build it with
+ * "make cxxplugin JOB=word_count" and run it with
+ * "mapreduce -j word_count.so -d dirname".
+ */
+
+#include <cctype>
+
+#include "mapreduce.hpp"
+
+struct WordCount : mapreduce::Mapper<std::string_view, long>,
+                   mapreduce::Reducer<std::string_view, long, long> {
+    /*
+     * Emits every word of the chunk with a count of 1.
+     */
+    static void map(const char *chunk, Emitter &out) {
+        char word[MAX_KEY];
+        size_t length = 0;
+        for (const char *c = chunk; ; c++) {
+            if (*c == '\0' || isspace((unsigned char) *c)) {
+                if (length > 0) {
+                    out.emit(std::string_view(word, length), 1);
+                    length = 0;
+                }
+                if (*c == '\0') {
+                    break;
+                }
+            } else if (!ispunct((unsigned char) *c) && length < MAX_KEY - 1) {
+                word[length++] = tolower((unsigned char) *c);
+            }
+        }
+    }
+
+    /*
+     * Sums the counts of a word. The sums are valid counts, so this
+     * doubles as the combiner.
+     */
+    static long reduce(const std::string_view &key, Values values) {
+        long count = 0;
+        for (long value : values) {
+            count += value;
+        }
+        return count;
+    }
+};
+
+MAPREDUCE_JOB(WordCount)
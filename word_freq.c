@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
+#include "job.h"
 #include "mapreduce.h"
 
 
@@ -83,3 +84,18 @@ Pair reduce(const char *key, const LLValues *head_value) {
     pair.value[MAX_VALUE - 1] = '\0';
     return pair;
 }
+
+
+/*
+ * Exported when built as a plugin with "make plugin JOB=word_freq" and
+ * run with "mapreduce -j word_freq.so". The counts reduce() returns are
+ * valid values, so it doubles as the combiner.
+ */
+const Job mapreduce_job = {
+    .abi_version = JOB_ABI_VERSION,
+    .map = map,
+    .reduce = reduce,
+    .combine = NULL,
+    .partition = NULL,
+    .map_pair = NULL
+};
@@ -0,0 +1,445 @@
+
+/*
+ * A worker daemon runs map tasks and one reduce partition of distributed
+ * jobs. For each job a coordinator connects, the daemon forks a job
+ * process with a local mapper and reducer. Pairs the mapper emits for
+ * other partitions are sent straight to the worker owning the partition,
+ * and the reduced output of this worker's partition goes back to the
+ * coordinator.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "job.h"
+#include "mapper.h"
+#include "mapreduce.h"
+#include "master.h"
+#include "net.h"
+#include "pairqueue.h"
+#include "reducer.h"
+#include "utils.h"
+#include "worker.h"
+
+#define SHUFFLE_PAIRS 64    // Pairs read at once from the mapper or a peer
+
+/*
+ * State of one job process.
+ */
+typedef struct worker_job {
+    int index;              // partition reduced by this worker
+    int nworkers;
+    int coordinator_fd;
+    int to_mapper;          // task requests for the local mapper
+    int from_mapper;        // Pairs of the local mapper, -1 once closed
+    int to_reducer;         // Pairs of this worker's partition
+    pid_t mapper_pid;
+    pid_t reducer_pid;
+    int *to_peer;           // shuffle connections to other workers
+    int *from_peer;         // shuffle connections from other workers
+    PairQueue *queues;      // Pairs waiting to be sent to each peer
+
+    Pair mapped[SHUFFLE_PAIRS];     // read from the mapper
+    size_t mapped_bytes;
+    size_t mapped_cursor;           // Pairs of mapped already routed
+} WorkerJob;
+
+/*
+ * Forks the local reducer of a job, reading Pairs from a pipe.
+ *
+ * @param job           job to create the reducer for
+ * @param listen_fd     shuffle socket, closed in the child
+ * @exit                1 if error
+ */
+static void spawn_job_reducer(WorkerJob *job, int listen_fd) {
+    int to_reducer_pipe[2];
+    safe_pipe(to_reducer_pipe);
+
+    fflush(NULL);
+    pid_t pid = safe_fork();
+    if (pid == 0) {
+        safe_close(to_reducer_pipe[WRITE_END]);
+        safe_dup2(to_reducer_pipe[READ_END], STDIN_FILENO);
+        safe_close(job->coordinator_fd);
+        safe_close(listen_fd);
+        reduce_process_pairs(NULL);
+        exit(0);
+    }
+
+    safe_close(to_reducer_pipe[READ_END]);
+    job->to_reducer = to_reducer_pipe[WRITE_END];
+    job->reducer_pid = pid;
+}
+
+/*
+ * Forks the local mapper of a job, reading tasks from a pipe and writing
+ * Pairs to another.
+ *
+ * @param job           job to create the mapper for
+ * @param listen_fd     shuffle socket, closed in the child
+ * @exit                1 if error
+ */
+static void spawn_job_mapper(WorkerJob *job, int listen_fd) {
+    int to_mapper_pipe[2];
+    int from_mapper_pipe[2];
+    safe_pipe(to_mapper_pipe);
+    safe_pipe(from_mapper_pipe);
+
+    fflush(NULL);
+    pid_t pid = safe_fork();
+    if (pid == 0) {
+        safe_close(to_mapper_pipe[WRITE_END]);
+        safe_dup2(to_mapper_pipe[READ_END], STDIN_FILENO);
+        safe_close(from_mapper_pipe[READ_END]);
+        safe_dup2(from_mapper_pipe[WRITE_END], STDOUT_FILENO);
+        safe_close(job->to_reducer);
+        safe_close(job->coordinator_fd);
+        safe_close(listen_fd);
+        map_digest_files();
+        exit(0);
+    }
+
+    safe_close(to_mapper_pipe[READ_END]);
+    safe_close(from_mapper_pipe[WRITE_END]);
+    job->to_mapper = to_mapper_pipe[WRITE_END];
+    job->from_mapper = from_mapper_pipe[READ_END];
+    job->mapper_pid = pid;
+}
+
+/*
+ * Kills the local workers and ends the job process. The coordinator sees
+ * the connection close and fails the job.
+ *
+ * @param job           running job
+ * @param reason        printed to stderr
+ * @exit                1
+ */
+static void abort_job(WorkerJob *job, const char *reason) {
+    safe_fprintf(stderr, "worker: %s\n", reason);
+    kill(job->mapper_pid, SIGKILL);
+    kill(job->reducer_pid, SIGKILL);
+    exit(1);
+}
+
+/*
+ * Routes Pairs read from the mapper to the reducer or peer queues.
+ * Stops when the queue of a peer is full.
+ *
+ * @param job           running job
+ * @exit                1 if error
+ */
+static void route_mapped(WorkerJob *job) {
+    size_t nmapped = job->mapped_bytes / sizeof(Pair);
+
+    while (job->mapped_cursor < nmapped) {
+        Pair *pair = &job->mapped[job->mapped_cursor];
+
+        if (is_task_done_marker(pair)) {
+            net_send_message(job->coordinator_fd, MSG_TASK_DONE, NULL, 0);
+        } else {
+            int partition = job_partition(pair->key, job->nworkers);
+            if (partition == job->index) {
+                safe_write(job->to_reducer, pair, sizeof(Pair));
+            } else if (pair_queue_has_room(&job->queues[partition])) {
+                pair_queue_push(&job->queues[partition], pair);
+            } else {
+                // back-pressure, wait for the peer to drain
+                return;
+            }
+        }
+        job->mapped_cursor++;
+    }
+
+    // keep the bytes of a Pair split across reads
+    size_t routed = nmapped * sizeof(Pair);
+    memmove(job->mapped, (char *) job->mapped + routed,
+            job->mapped_bytes - routed);
+    job->mapped_bytes -= routed;
+    job->mapped_cursor = 0;
+}
+
+/*
+ * Forwards Pairs a peer sent for this worker's partition to the reducer.
+ *
+ * @param job           running job
+ * @param j             peer index
+ * @param buffer        bytes read from the peer but not forwarded
+ * @param nbytes        number of bytes in buffer
+ * @exit                1 if error
+ */
+static void read_peer(WorkerJob *job, int j, Pair *buffer, size_t *nbytes) {
+    ssize_t nread = safe_read(job->from_peer[j], (char *) buffer + *nbytes,
+                              sizeof(Pair) * SHUFFLE_PAIRS - *nbytes);
+    if (nread == 0) {
+        safe_close(job->from_peer[j]);
+        job->from_peer[j] = -1;
+        return;
+    }
+    *nbytes += nread;
+
+    size_t complete = (*nbytes / sizeof(Pair)) * sizeof(Pair);
+    safe_write(job->to_reducer, buffer, complete);
+    memmove(buffer, (char *) buffer + complete, *nbytes - complete);
+    *nbytes -= complete;
+}
+
+/*
+ * Sends the output of the local reducer to the coordinator. If the
+ * reducer failed, its output may be missing or partial, so none is sent
+ * and the connection is closed without ending the results, which fails
+ * the job at the coordinator.
+ *
+ * @param job           finished job
+ * @exit                1 if error, or if the reducer failed
+ */
+static void send_results(WorkerJob *job) {
+    safe_close(job->to_reducer);
+    int status;
+    pid_t reaped = waitpid(job->reducer_pid, &status, 0);
+
+    char filename[MAX_FILENAME] = "";
+    sprintf(filename, "[%d].out", job->reducer_pid);
+    if (reaped == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        safe_fprintf(stderr, "worker: the reducer failed\n");
+        unlink(filename);
+        exit(1);
+    }
+    FILE *fin = safe_fopen(filename, "rb");
+
+    Pair results[SHUFFLE_PAIRS];
+    size_t nread;
+    while ((nread = safe_fread(results, sizeof(Pair), SHUFFLE_PAIRS, fin)) > 0) {
+        net_send_message(job->coordinator_fd, MSG_RESULT, results,
+                         sizeof(Pair) * nread);
+    }
+    safe_fclose(fin);
+    unlink(filename);
+
+    net_send_message(job->coordinator_fd, MSG_RESULT_END, NULL, 0);
+}
+
+/*
+ * Connects this worker with every other worker of the job.
+ *
+ * @param job           job to connect
+ * @param listen_fd     shuffle socket peers connect to
+ * @param peers         shuffle addresses of all workers
+ * @exit                1 if error
+ */
+static void connect_peers(WorkerJob *job, int listen_fd, PeerAddress *peers) {
+    int n = job->nworkers;
+    safe_malloc((void **) &(job->to_peer), sizeof(int) * n);
+    safe_malloc((void **) &(job->from_peer), sizeof(int) * n);
+    safe_malloc((void **) &(job->queues), sizeof(PairQueue) * n);
+
+    // connections complete in the listen backlog before being accepted
+    for (int j = 0; j < n; j++) {
+        job->to_peer[j] = -1;
+        job->from_peer[j] = -1;
+        pair_queue_init(&job->queues[j], PAIR_QUEUE_PAIRS);
+        if (j != job->index) {
+            job->to_peer[j] = net_connect(peers[j].host, ntohl(peers[j].port));
+            safe_set_nonblocking(job->to_peer[j]);
+        }
+    }
+    for (int j = 0; j < n; j++) {
+        if (j != job->index) {
+            job->from_peer[j] = net_accept(listen_fd);
+        }
+    }
+}
+
+/*
+ * Runs one job for a coordinator, as a process forked by the daemon.
+ *
+ * @param coordinator_fd    connection to the coordinator
+ * @exit                    0 once the results are sent, 1 if error
+ */
+static void run_job(int coordinator_fd) {
+    WorkerJob job = {.coordinator_fd = coordinator_fd,
+                     .mapped_bytes = 0, .mapped_cursor = 0};
+    int type;
+    void *payload;
+    size_t length;
+
+    if (!net_recv_message(coordinator_fd, &type, &payload, &length) ||
+        type != MSG_JOB || length != sizeof(JobSpec)) {
+        safe_fprintf(stderr, "worker: expected a job\n");
+        exit(1);
+    }
+    JobSpec *spec = payload;
+    unsigned long long job_hash = (unsigned long long)
+        ntohl(spec->job_hash[0]) << 32 | ntohl(spec->job_hash[1]);
+    if (job_hash != job_identity()) {
+        // the coordinator sees the connection close and gives up
+        safe_fprintf(stderr, "worker: the coordinator runs another job "
+                     "(%016llx) than this daemon loaded (%016llx)\n",
+                     job_hash, job_identity());
+        exit(1);
+    }
+    job.index = ntohl(spec->index);
+    job.nworkers = ntohl(spec->nworkers);
+    map_settings.combine = ntohl(spec->combine);
+    map_settings.r = job.nworkers;
+    free(payload);
+
+    int listen_fd = net_listen(0);
+    spawn_job_reducer(&job, listen_fd);
+    spawn_job_mapper(&job, listen_fd);
+
+    uint32_t port = htonl(net_local_port(listen_fd));
+    net_send_message(coordinator_fd, MSG_JOB_ACK, &port, sizeof(port));
+
+    if (!net_recv_message(coordinator_fd, &type, &payload, &length) ||
+        type != MSG_PEERS || length != sizeof(PeerAddress) * job.nworkers) {
+        safe_fprintf(stderr, "worker: expected the peers of the job\n");
+        exit(1);
+    }
+    connect_peers(&job, listen_fd, payload);
+    free(payload);
+    safe_close(listen_fd);
+
+    Pair peer_buffers[job.nworkers][SHUFFLE_PAIRS];
+    size_t peer_bytes[job.nworkers];
+    memset(peer_bytes, 0, sizeof(peer_bytes));
+
+    int map_ended = 0;      // 1 once the coordinator has no more tasks
+    int shuffle_sent = 0;   // 1 once all peers were told the map ended
+    fd_set read_set;
+    fd_set write_set;
+
+    while (1) {
+        int queued = 0;
+        for (int j = 0; j < job.nworkers; j++) {
+            if (!pair_queue_is_empty(&job.queues[j])) {
+                queued = 1;
+            }
+        }
+        int parked = job.mapped_cursor < job.mapped_bytes / sizeof(Pair);
+
+        // tell peers no more Pairs are coming
+        if (job.from_mapper == -1 && !parked && !queued && !shuffle_sent) {
+            for (int j = 0; j < job.nworkers; j++) {
+                if (job.to_peer[j] != -1) {
+                    shutdown(job.to_peer[j], SHUT_WR);
+                }
+            }
+            shuffle_sent = 1;
+        }
+
+        int open_peers = 0;
+        for (int j = 0; j < job.nworkers; j++) {
+            if (job.from_peer[j] != -1) {
+                open_peers = 1;
+            }
+        }
+        if (shuffle_sent && !open_peers) {
+            break;
+        }
+
+        FD_ZERO(&read_set);
+        FD_ZERO(&write_set);
+        if (!map_ended) {
+            FD_SET(coordinator_fd, &read_set);
+        }
+        if (job.from_mapper != -1 && !parked) {
+            FD_SET(job.from_mapper, &read_set);
+        }
+        for (int j = 0; j < job.nworkers; j++) {
+            if (job.from_peer[j] != -1) {
+                FD_SET(job.from_peer[j], &read_set);
+            }
+            if (!pair_queue_is_empty(&job.queues[j])) {
+                FD_SET(job.to_peer[j], &write_set);
+            }
+        }
+
+        safe_select(FD_SETSIZE, &read_set, &write_set, NULL);
+
+        for (int j = 0; j < job.nworkers; j++) {
+            if (job.to_peer[j] != -1 && FD_ISSET(job.to_peer[j], &write_set) &&
+                pair_queue_flush(&job.queues[j], job.to_peer[j]) == -1) {
+                abort_job(&job, "lost a peer");
+            }
+        }
+        if (parked) {
+            route_mapped(&job);
+        }
+
+        if (!map_ended && FD_ISSET(coordinator_fd, &read_set)) {
+            if (!net_recv_message(coordinator_fd, &type, &payload, &length)) {
+                abort_job(&job, "lost the coordinator");
+            }
+            if (type == MSG_MAP_TASK) {
+                // same request master sends a local mapper
+                char request[PATH_MAX + 32];
+                int request_length = snprintf(request, sizeof(request),
+                                              "%c 0 %s ", TASK_MAP,
+                                              (char *) payload);
+                safe_write(job.to_mapper, request, request_length);
+            } else if (type == MSG_MAP_END) {
+                safe_close(job.to_mapper);
+                map_ended = 1;
+            }
+            free(payload);
+        }
+
+        if (job.from_mapper != -1 && FD_ISSET(job.from_mapper, &read_set)) {
+            ssize_t nread = safe_read(job.from_mapper,
+                                      (char *) job.mapped + job.mapped_bytes,
+                                      sizeof(job.mapped) - job.mapped_bytes);
+            if (nread == 0 && !map_ended) {
+                abort_job(&job, "the mapper failed");
+            } else if (nread == 0) {
+                safe_close(job.from_mapper);
+                job.from_mapper = -1;
+            } else {
+                job.mapped_bytes += nread;
+                route_mapped(&job);
+            }
+        }
+
+        for (int j = 0; j < job.nworkers; j++) {
+            if (job.from_peer[j] != -1 &&
+                FD_ISSET(job.from_peer[j], &read_set)) {
+                read_peer(&job, j, peer_buffers[j], &peer_bytes[j]);
+            }
+        }
+    }
+
+    send_results(&job);
+    exit(0);
+}
+
+/**
+ * Runs a worker daemon that accepts jobs from coordinators on port.
+ * Each job runs in its own process, so one daemon can serve several jobs.
+ *
+ * @param port          port to listen on
+ * @exit                1 if error
+ */
+void run_worker_daemon(int port) {
+    int listen_fd = net_listen(port);
+
+    // a lost peer is reported by a failing write
+    signal(SIGPIPE, SIG_IGN);
+
+    while (1) {
+        int coordinator_fd = net_accept(listen_fd);
+
+        pid_t pid = safe_fork();
+        if (pid == 0) {
+            safe_close(listen_fd);
+            run_job(coordinator_fd);
+        }
+        safe_close(coordinator_fd);
+
+        while (waitpid(-1, NULL, WNOHANG) > 0) {
+            // reap finished jobs
+        }
+    }
+}
@@ -0,0 +1,9 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+/*
+ * Runs a worker daemon that accepts jobs from coordinators on port.
+ */
+void run_worker_daemon(int port);
+
+#endif
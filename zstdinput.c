@@ -0,0 +1,396 @@
+/*
+ * Reader of .zst input files. No zstd headers are needed to build the
+ * engine: libzstd is loaded when a mapper opens its first .zst file, and
+ * the few functions used are declared here as the library exports them.
+ *
+ * A file is mapped into memory and its frames found up front. Files
+ * written by zstd -T or pzstd hold many frames of known size, which
+ * threads decompress ahead of the mapper in parallel, in the same way as
+ * readahead.c reads blocks ahead. Other files are streamed.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "zstdinput.h"
+
+#define ZSTD_CONTENTSIZE_UNKNOWN (0ULL - 1)
+#define ZSTD_CONTENTSIZE_ERROR (0ULL - 2)
+
+/*
+ * Buffers of ZSTD_decompressStream, as zstd.h declares them.
+ */
+typedef struct zstd_in_buffer {
+    const void *src;
+    size_t size;
+    size_t pos;
+} ZstdInBuffer;
+
+typedef struct zstd_out_buffer {
+    void *dst;
+    size_t size;
+    size_t pos;
+} ZstdOutBuffer;
+
+/*
+ * Functions of libzstd, NULL until loaded.
+ */
+static struct {
+    void *(*create_dctx)(void);
+    size_t (*free_dctx)(void *dctx);
+    size_t (*decompress_dctx)(void *dctx, void *dst, size_t capacity,
+                              const void *src, size_t size);
+    size_t (*decompress_stream)(void *dctx, ZstdOutBuffer *out,
+                                ZstdInBuffer *in);
+    unsigned long long (*frame_content_size)(const void *src, size_t size);
+    size_t (*find_frame_compressed_size)(const void *src, size_t size);
+    unsigned (*is_error)(size_t code);
+    const char *(*error_name)(size_t code);
+} zstd = {.create_dctx = NULL};
+
+
+/*
+ * Loads libzstd, if not yet done.
+ *
+ * @param path          .zst file that needs it
+ * @exit                1 if libzstd is missing
+ */
+static void load_zstd(const char *path) {
+    if (zstd.create_dctx != NULL) {
+        return;
+    }
+
+    void *library = dlopen(ZSTD_LIBRARY, RTLD_NOW | RTLD_LOCAL);
+    if (library == NULL) {
+        safe_fprintf(stderr, "Cannot read '%s': %s\n", path, dlerror());
+        exit(1);
+    }
+    *(void **) &zstd.free_dctx = dlsym(library, "ZSTD_freeDCtx");
+    *(void **) &zstd.decompress_dctx = dlsym(library, "ZSTD_decompressDCtx");
+    *(void **) &zstd.decompress_stream = dlsym(library,
+                                               "ZSTD_decompressStream");
+    *(void **) &zstd.frame_content_size = dlsym(library,
+                                                "ZSTD_getFrameContentSize");
+    *(void **) &zstd.find_frame_compressed_size =
+        dlsym(library, "ZSTD_findFrameCompressedSize");
+    *(void **) &zstd.is_error = dlsym(library, "ZSTD_isError");
+    *(void **) &zstd.error_name = dlsym(library, "ZSTD_getErrorName");
+    *(void **) &zstd.create_dctx = dlsym(library, "ZSTD_createDCtx");
+    if (zstd.free_dctx == NULL || zstd.decompress_dctx == NULL ||
+        zstd.decompress_stream == NULL || zstd.frame_content_size == NULL ||
+        zstd.find_frame_compressed_size == NULL || zstd.is_error == NULL ||
+        zstd.error_name == NULL || zstd.create_dctx == NULL) {
+        safe_fprintf(stderr, "Cannot read '%s': %s is too old\n", path,
+                     ZSTD_LIBRARY);
+        exit(1);
+    }
+}
+
+/*
+ * Creates a decompression context.
+ *
+ * @exit                1 if error
+ * @return              the context
+ */
+static void *create_context() {
+    void *dctx = zstd.create_dctx();
+    if (dctx == NULL) {
+        safe_fprintf(stderr, "Error creating a zstd context\n");
+        exit(1);
+    }
+    return dctx;
+}
+
+/*
+ * Exits if a zstd function failed.
+ *
+ * @param input         file decompressed
+ * @param code          what the function returned
+ * @exit                1 if it is an error
+ */
+static void check_zstd(ZstdInput *input, size_t code) {
+    if (zstd.is_error(code)) {
+        safe_fprintf(stderr, "Error decompressing '%s': %s\n", input->path,
+                     zstd.error_name(code));
+        exit(1);
+    }
+}
+
+/*
+ * Finds the frames of a mapped file, and whether they can be
+ * decompressed by threads: there are several, and each one's size is
+ * known and at most ZSTD_MAX_FRAME_BYTES.
+ *
+ * @param input         file to search
+ * @exit                1 if the file is corrupt or truncated
+ * @return              1 if the frames can be decompressed by threads
+ */
+static int find_frames(ZstdInput *input) {
+    long capacity = 16;
+    safe_malloc((void **) &input->frames, capacity * sizeof(ZstdFrame));
+    input->nframes = 0;
+
+    int sized = 1;
+    size_t offset = 0;
+    while (offset < input->size) {
+        const unsigned char *src = input->mapped + offset;
+        size_t remaining = input->size - offset;
+        size_t compressed = zstd.find_frame_compressed_size(src, remaining);
+        check_zstd(input, compressed);
+        unsigned long long length = zstd.frame_content_size(src, remaining);
+        if (length == ZSTD_CONTENTSIZE_UNKNOWN ||
+            length == ZSTD_CONTENTSIZE_ERROR || length > ZSTD_MAX_FRAME_BYTES) {
+            sized = 0;
+        }
+
+        if (input->nframes == capacity) {
+            capacity *= 2;
+            safe_realloc((void **) &input->frames,
+                         capacity * sizeof(ZstdFrame));
+        }
+        ZstdFrame *frame = &input->frames[input->nframes++];
+        frame->offset = offset;
+        frame->compressed = compressed;
+        frame->length = sized ? length : 0;
+        offset += compressed;
+    }
+    return sized && input->nframes > 1;
+}
+
+/*
+ * Decompresses every ZSTD_PARALLEL_FRAMES-th frame of a file into a slot,
+ * waiting for the mapper to free it, until the file ends or the mapper
+ * stops reading.
+ *
+ * @param arg           the ZstdSlot of the thread
+ * @exit                1 if the file is corrupt
+ * @return              NULL
+ */
+static void *decode_frames(void *arg) {
+    ZstdSlot *slot = arg;
+    ZstdInput *input = slot->input;
+    void *dctx = create_context();
+
+    pthread_mutex_lock(&input->lock);
+    for (long next = slot - input->slots; next < input->nframes;
+         next += ZSTD_PARALLEL_FRAMES) {
+        while (slot->state != FRAME_FREE && !input->stop) {
+            pthread_cond_wait(&input->changed, &input->lock);
+        }
+        if (input->stop) {
+            break;
+        }
+        slot->state = FRAME_DECODING;
+        pthread_mutex_unlock(&input->lock);
+
+        ZstdFrame *frame = &input->frames[next];
+        size_t length = zstd.decompress_dctx(dctx, slot->data, frame->length,
+                                             input->mapped + frame->offset,
+                                             frame->compressed);
+        check_zstd(input, length);
+        if (length != frame->length) {
+            safe_fprintf(stderr, "Error decompressing '%s': frame %ld has "
+                         "the wrong size\n", input->path, next);
+            exit(1);
+        }
+
+        pthread_mutex_lock(&input->lock);
+        slot->length = length;
+        slot->state = FRAME_READY;
+        pthread_cond_broadcast(&input->changed);
+    }
+    pthread_mutex_unlock(&input->lock);
+
+    zstd.free_dctx(dctx);
+    return NULL;
+}
+
+/*
+ * Starts the threads decompressing the frames of a file.
+ *
+ * @param input         file to decompress
+ * @exit                1 if error
+ */
+static void start_decoders(ZstdInput *input) {
+    size_t largest = 1;
+    for (long f = 0; f < input->nframes; f++) {
+        if (input->frames[f].length > largest) {
+            largest = input->frames[f].length;
+        }
+    }
+
+    input->next = 0;
+    input->current_offset = 0;
+    input->stop = 0;
+    pthread_mutex_init(&input->lock, NULL);
+    pthread_cond_init(&input->changed, NULL);
+    for (int i = 0; i < ZSTD_PARALLEL_FRAMES; i++) {
+        ZstdSlot *slot = &input->slots[i];
+        safe_malloc((void **) &slot->data, largest);
+        slot->length = 0;
+        slot->state = FRAME_FREE;
+        slot->input = input;
+        if (pthread_create(&input->decoders[i], NULL, decode_frames,
+                           slot) != 0) {
+            safe_fprintf(stderr, "Error starting a thread\n");
+            exit(1);
+        }
+    }
+}
+
+/**
+ * Opens a .zst file, mapping it into memory, and starts decompressing it.
+ *
+ * @param path          path of the file
+ * @exit                1 if error
+ * @return              the ZstdInput of the file
+ */
+void *zstd_input_open(const char *path) {
+    load_zstd(path);
+
+    ZstdInput *input;
+    safe_malloc((void **) &input, sizeof(ZstdInput));
+    input->path = path;
+    input->mapped = NULL;
+    input->frames = NULL;
+    input->nframes = 0;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1) {
+        safe_fprintf(stderr, "Error opening file '%s'\n", path);
+        exit(1);
+    }
+    input->size = info.st_size;
+    if (input->size > 0) {
+        input->mapped = mmap(NULL, input->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (input->mapped == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        madvise(input->mapped, input->size, MADV_SEQUENTIAL);
+    }
+    safe_close(fd);
+
+    input->parallel = find_frames(input);
+    if (input->parallel) {
+        start_decoders(input);
+    } else {
+        input->stream = create_context();
+        input->in_offset = 0;
+        input->in_frame = 0;
+    }
+    return input;
+}
+
+/*
+ * Copies the next decompressed bytes of a streamed file.
+ *
+ * @param input         file being read
+ * @param buf           where to copy the bytes
+ * @param nbyte         bytes to copy
+ * @exit                1 if the file is corrupt or truncated
+ * @return              bytes copied, fewer than nbyte only at the end
+ */
+static size_t read_stream(ZstdInput *input, char *buf, size_t nbyte) {
+    ZstdOutBuffer out = {.dst = buf, .size = nbyte, .pos = 0};
+    ZstdInBuffer in = {.src = input->mapped, .size = input->size,
+                       .pos = input->in_offset};
+
+    while (out.pos < out.size) {
+        size_t before = out.pos;
+        if (in.pos == in.size && !input->in_frame) {
+            break;
+        }
+        size_t result = zstd.decompress_stream(input->stream, &out, &in);
+        check_zstd(input, result);
+        input->in_frame = result != 0;
+        if (in.pos == in.size && input->in_frame && out.pos == before) {
+            safe_fprintf(stderr, "'%s' is truncated\n", input->path);
+            exit(1);
+        }
+    }
+    input->in_offset = in.pos;
+    return out.pos;
+}
+
+/**
+ * Copies the next nbyte decompressed bytes of a .zst file to buf.
+ *
+ * @param file          ZstdInput of the file
+ * @param buf           where to copy the bytes
+ * @param nbyte         bytes to copy
+ * @exit                1 if the file is corrupt or truncated
+ * @return              bytes copied, fewer than nbyte only at the end of
+ *                      the file
+ */
+size_t zstd_input_read(void *file, char *buf, size_t nbyte) {
+    ZstdInput *input = file;
+    if (!input->parallel) {
+        return read_stream(input, buf, nbyte);
+    }
+
+    size_t total = 0;
+    while (total < nbyte && input->next < input->nframes) {
+        ZstdSlot *slot = &input->slots[input->next % ZSTD_PARALLEL_FRAMES];
+        if (input->current_offset == 0) {
+            pthread_mutex_lock(&input->lock);
+            while (slot->state != FRAME_READY) {
+                pthread_cond_wait(&input->changed, &input->lock);
+            }
+            pthread_mutex_unlock(&input->lock);
+        }
+
+        size_t count = slot->length - input->current_offset;
+        if (count > nbyte - total) {
+            count = nbyte - total;
+        }
+        memcpy(buf + total, slot->data + input->current_offset, count);
+        total += count;
+        input->current_offset += count;
+
+        if (input->current_offset == slot->length) {
+            pthread_mutex_lock(&input->lock);
+            slot->state = FRAME_FREE;
+            pthread_cond_broadcast(&input->changed);
+            pthread_mutex_unlock(&input->lock);
+            input->next++;
+            input->current_offset = 0;
+        }
+    }
+    return total;
+}
+
+/**
+ * Stops decompressing a .zst file and closes it.
+ *
+ * @param file          ZstdInput of the file
+ * @exit                1 if error
+ */
+void zstd_input_close(void *file) {
+    ZstdInput *input = file;
+    if (input->parallel) {
+        pthread_mutex_lock(&input->lock);
+        input->stop = 1;
+        pthread_cond_broadcast(&input->changed);
+        pthread_mutex_unlock(&input->lock);
+        for (int i = 0; i < ZSTD_PARALLEL_FRAMES; i++) {
+            pthread_join(input->decoders[i], NULL);
+            free(input->slots[i].data);
+        }
+        pthread_mutex_destroy(&input->lock);
+        pthread_cond_destroy(&input->changed);
+    } else {
+        zstd.free_dctx(input->stream);
+    }
+    if (input->mapped != NULL) {
+        munmap(input->mapped, input->size);
+    }
+    free(input->frames);
+    free(input);
+}
@@ -0,0 +1,82 @@
+#ifndef ZSTDINPUT_H
+#define ZSTDINPUT_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define ZSTD_LIBRARY "libzstd.so.1"     // loaded by the first .zst file
+#define ZSTD_PARALLEL_FRAMES 4          // frames decompressed at once
+#define ZSTD_MAX_FRAME_BYTES (16 * 1024 * 1024)   // largest frame
+                                        //   decompressed whole, larger
+                                        //   files are streamed
+
+// States of a slot of decompressed frames
+#define FRAME_FREE 0        // read by the mapper, may be refilled
+#define FRAME_DECODING 1    // being decompressed by its thread
+#define FRAME_READY 2       // decompressed, waiting for the mapper
+
+/*
+ * A frame of a .zst file, as found in the mapped file.
+ */
+typedef struct zstd_frame {
+    size_t offset;          // of the frame in the file
+    size_t compressed;      // bytes of the frame in the file
+    size_t length;          // bytes of its contents
+} ZstdFrame;
+
+/*
+ * A slot that thread i decompresses frames i, i + ZSTD_PARALLEL_FRAMES,
+ * ... into, one at a time as the mapper frees it.
+ */
+typedef struct zstd_slot {
+    char *data;
+    size_t length;
+    int state;
+    struct zstd_input *input;   // the file, for the slot's thread
+} ZstdSlot;
+
+/*
+ * A .zst file, mapped into memory. A file of several frames of known
+ * size, as written by zstd -T or pzstd, is decompressed by
+ * ZSTD_PARALLEL_FRAMES threads, each decompressing every
+ * ZSTD_PARALLEL_FRAMES-th frame ahead of the mapper. Any other file is
+ * streamed through one decompression context.
+ */
+typedef struct zstd_input {
+    const char *path;
+    unsigned char *mapped;  // the compressed file, NULL if empty
+    size_t size;
+    int parallel;           // 1 if frames are decompressed by threads
+    // streamed
+    void *stream;           // decompression context
+    size_t in_offset;       // compressed bytes decompressed so far
+    int in_frame;           // 1 if a frame was started, not ended
+    // decompressed by frames
+    ZstdFrame *frames;
+    long nframes;
+    long next;              // frame the mapper reads next
+    size_t current_offset;  // bytes of it already read
+    ZstdSlot slots[ZSTD_PARALLEL_FRAMES];   // frame i in slots[i % N]
+    pthread_t decoders[ZSTD_PARALLEL_FRAMES];
+    pthread_mutex_t lock;   // of the slot states
+    pthread_cond_t changed;
+    int stop;               // tells the threads to exit
+} ZstdInput;
+
+/*
+ * Opens a .zst file. Returns its ZstdInput.
+ */
+void *zstd_input_open(const char *path);
+
+/*
+ * Copies the next nbyte decompressed bytes of the file to buf, as fread
+ * does. Returns fewer than nbyte only at the end of the file.
+ */
+size_t zstd_input_read(void *file, char *buf, size_t nbyte);
+
+/*
+ * Stops decompressing and closes the file.
+ */
+void zstd_input_close(void *file);
+
+#endif